@@ -0,0 +1,335 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+#include <components/viruscan/bench/bench_services.h>
+#include <mysql/plugin.h>
+
+#include <pthread.h>
+#include <strings.h>
+
+/*
+  The placeholders are defined by scan.cc and scan_pfs.cc, the component
+  infrastructure fills them when the component is loaded. Here they point
+  at the stubs below.
+*/
+
+static std::atomic<unsigned long long> runtime_errors{0};
+static std::atomic<unsigned long long> pfs_columns{0};
+
+/* Error log: no line is ever built, LogEvent gives up on a null line */
+
+static log_item_data *bench_line_item_set_with_key(log_line *, log_item_type,
+                                                   const char *,
+                                                   unsigned int) {
+  return nullptr;
+}
+static log_item_data *bench_line_item_set(log_line *, log_item_type) {
+  return nullptr;
+}
+static log_line *bench_line_init() { return nullptr; }
+static void bench_line_exit(log_line *) {}
+static int bench_line_item_count(log_line *) { return 0; }
+static log_item_type_mask bench_line_item_types_seen(log_line *,
+                                                     log_item_type_mask) {
+  return 0;
+}
+static bool bench_item_set_int(log_item_data *, long long) { return true; }
+static bool bench_item_set_float(log_item_data *, double) { return true; }
+static bool bench_item_set_lexstring(log_item_data *, const char *, size_t) {
+  return true;
+}
+static bool bench_item_set_cstring(log_item_data *, const char *) {
+  return true;
+}
+static int bench_line_submit(log_line *) { return 0; }
+static int bench_errcode_by_errsymbol(const char *) { return 0; }
+static const char *bench_errmsg_by_errcode(int) { return "%s"; }
+
+static void *bench_malloc(size_t size) { return malloc(size); }
+static char *bench_strndup(const char *s, size_t n) { return strndup(s, n); }
+static void bench_free(void *p) { free(p); }
+static size_t bench_length(const char *s) { return strlen(s); }
+static char *bench_find_first(const char *s, int c) {
+  return const_cast<char *>(strchr(s, c));
+}
+static char *bench_find_last(const char *s, int c) {
+  return const_cast<char *>(strrchr(s, c));
+}
+static int bench_compare(const char *a, const char *b, size_t len,
+                         bool case_insensitive) {
+  return case_insensitive ? strncasecmp(a, b, len) : strncmp(a, b, len);
+}
+static size_t bench_substitutev(char *to, size_t n, const char *fmt,
+                                va_list ap) {
+  int written = vsnprintf(to, n, fmt, ap);
+  return written < 0 ? 0 : (size_t)written;
+}
+static size_t bench_substitute(char *to, size_t n, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  size_t written = bench_substitutev(to, n, fmt, ap);
+  va_end(ap);
+  return written;
+}
+
+/* Mutexes and condition variables, without instrumentation */
+
+static pthread_mutex_t *native_mutex(mysql_mutex_t *that) {
+  return reinterpret_cast<pthread_mutex_t *>(&that->m_mutex);
+}
+
+static void bench_mutex_register(const char *, PSI_mutex_info *, int) {}
+static int bench_mutex_init(PSI_mutex_key, mysql_mutex_t *that,
+                            const native_mutexattr_t *attr, const char *,
+                            unsigned int) {
+  that->m_psi = nullptr;
+  return pthread_mutex_init(native_mutex(that), attr);
+}
+static int bench_mutex_destroy(mysql_mutex_t *that, const char *,
+                               unsigned int) {
+  return pthread_mutex_destroy(native_mutex(that));
+}
+static int bench_mutex_lock(mysql_mutex_t *that, const char *, unsigned int) {
+  return pthread_mutex_lock(native_mutex(that));
+}
+static int bench_mutex_trylock(mysql_mutex_t *that, const char *,
+                               unsigned int) {
+  return pthread_mutex_trylock(native_mutex(that));
+}
+static int bench_mutex_unlock(mysql_mutex_t *that, const char *,
+                              unsigned int) {
+  return pthread_mutex_unlock(native_mutex(that));
+}
+
+static pthread_cond_t *native_cond(mysql_cond_t *that) {
+  return reinterpret_cast<pthread_cond_t *>(&that->m_cond);
+}
+
+static void bench_cond_register(const char *, PSI_cond_info *, int) {}
+static int bench_cond_init(PSI_cond_key, mysql_cond_t *that, const char *,
+                           unsigned int) {
+  that->m_psi = nullptr;
+  return pthread_cond_init(native_cond(that), nullptr);
+}
+static int bench_cond_destroy(mysql_cond_t *that, const char *,
+                              unsigned int) {
+  return pthread_cond_destroy(native_cond(that));
+}
+static int bench_cond_wait(mysql_cond_t *that, mysql_mutex_t *mutex,
+                           const char *, unsigned int) {
+  return pthread_cond_wait(native_cond(that), native_mutex(mutex));
+}
+static int bench_cond_timedwait(mysql_cond_t *that, mysql_mutex_t *mutex,
+                                const struct timespec *abstime, const char *,
+                                unsigned int) {
+  return pthread_cond_timedwait(native_cond(that), native_mutex(mutex),
+                                abstime);
+}
+static int bench_cond_signal(mysql_cond_t *that, const char *, unsigned int) {
+  return pthread_cond_signal(native_cond(that));
+}
+static int bench_cond_broadcast(mysql_cond_t *that, const char *,
+                                unsigned int) {
+  return pthread_cond_broadcast(native_cond(that));
+}
+
+/* Session: every thread runs as bench@localhost, with every privilege */
+
+static char bench_thd[1];
+static char bench_security_context[1];
+
+static mysql_service_status_t bench_current_thd(MYSQL_THD *thd) {
+  *thd = (MYSQL_THD)bench_thd;
+  return 0;
+}
+static mysql_service_status_t bench_thd_security_context(
+    MYSQL_THD, Security_context_handle *ctx) {
+  *ctx = (Security_context_handle)bench_security_context;
+  return 0;
+}
+static mysql_service_status_t bench_security_context_get(
+    Security_context_handle, const char *name, void *inout_pvalue) {
+  MYSQL_LEX_CSTRING *value = (MYSQL_LEX_CSTRING *)inout_pvalue;
+
+  if (strcmp(name, "priv_user") == 0) {
+    value->str = "bench";
+    value->length = 5;
+  } else if (strcmp(name, "priv_host") == 0) {
+    value->str = "localhost";
+    value->length = 9;
+  } else
+    return 1;
+  return 0;
+}
+static mysql_service_status_t bench_has_global_grant(Security_context_handle,
+                                                     const char *, size_t) {
+  return 1;
+}
+
+/* Never killed: scans only stop on their deadline */
+int thd_killed(const MYSQL_THD) { return 0; }
+
+static void bench_runtime_error(int, int, va_list) {
+  runtime_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* performance_schema columns: the values go nowhere */
+
+static void bench_set_int(PSI_field *, PSI_int) {
+  pfs_columns.fetch_add(1, std::memory_order_relaxed);
+}
+static void bench_set_bigint(PSI_field *, PSI_bigint) {
+  pfs_columns.fetch_add(1, std::memory_order_relaxed);
+}
+static void bench_set_ubigint(PSI_field *, PSI_ubigint) {
+  pfs_columns.fetch_add(1, std::memory_order_relaxed);
+}
+static void bench_set_varchar(PSI_field *, const char *) {
+  pfs_columns.fetch_add(1, std::memory_order_relaxed);
+}
+static void bench_set_varchar_len(PSI_field *, const char *, unsigned int) {
+  pfs_columns.fetch_add(1, std::memory_order_relaxed);
+}
+static void bench_set_timestamp(PSI_field *, unsigned long long) {
+  pfs_columns.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+  Index reads: the key reader given to index_read() is the key itself, a
+  NUL terminated string, always read as an exact key.
+*/
+static void bench_read_key_string(PSI_key_reader *reader,
+                                  PSI_plugin_key_string *key, int find_flag) {
+  const char *value = (const char *)reader;
+  size_t length = std::min<size_t>(strlen(value),
+                                   key->m_value_buffer_capacity);
+
+  memcpy(key->m_value_buffer, value, length);
+  key->m_value_buffer_length = length;
+  key->m_find_flags = find_flag;
+  key->m_is_null = false;
+}
+static bool bench_match_key_string(bool record_null, const char *value,
+                                   unsigned int length,
+                                   PSI_plugin_key_string *key) {
+  if (record_null || key->m_is_null) return record_null == key->m_is_null;
+  return length == key->m_value_buffer_length &&
+         strncasecmp(value, key->m_value_buffer, length) == 0;
+}
+
+static SERVICE_TYPE_NO_CONST(log_builtins) bench_log_builtins;
+static SERVICE_TYPE_NO_CONST(log_builtins_string) bench_log_builtins_string;
+static SERVICE_TYPE_NO_CONST(mysql_mutex_v1) bench_mutex;
+static SERVICE_TYPE_NO_CONST(mysql_cond_v1) bench_cond;
+static SERVICE_TYPE_NO_CONST(mysql_current_thread_reader)
+    bench_thread_reader;
+static SERVICE_TYPE_NO_CONST(mysql_thd_security_context) bench_thd_context;
+static SERVICE_TYPE_NO_CONST(mysql_security_context_options)
+    bench_context_options;
+static SERVICE_TYPE_NO_CONST(global_grants_check) bench_grants_check;
+static SERVICE_TYPE_NO_CONST(mysql_runtime_error) bench_runtime;
+static SERVICE_TYPE_NO_CONST(pfs_plugin_column_integer_v1) bench_pfs_integer;
+static SERVICE_TYPE_NO_CONST(pfs_plugin_column_bigint_v1) bench_pfs_bigint;
+static SERVICE_TYPE_NO_CONST(pfs_plugin_column_string_v2) bench_pfs_string;
+static SERVICE_TYPE_NO_CONST(pfs_plugin_column_timestamp_v2)
+    bench_pfs_timestamp;
+
+void bench_services_init() {
+  bench_log_builtins.line_item_set_with_key = bench_line_item_set_with_key;
+  bench_log_builtins.line_item_set = bench_line_item_set;
+  bench_log_builtins.line_init = bench_line_init;
+  bench_log_builtins.line_exit = bench_line_exit;
+  bench_log_builtins.line_item_count = bench_line_item_count;
+  bench_log_builtins.line_item_types_seen = bench_line_item_types_seen;
+  bench_log_builtins.item_set_int = bench_item_set_int;
+  bench_log_builtins.item_set_float = bench_item_set_float;
+  bench_log_builtins.item_set_lexstring = bench_item_set_lexstring;
+  bench_log_builtins.item_set_cstring = bench_item_set_cstring;
+  bench_log_builtins.line_submit = bench_line_submit;
+  bench_log_builtins.errcode_by_errsymbol = bench_errcode_by_errsymbol;
+  bench_log_builtins.errmsg_by_errcode = bench_errmsg_by_errcode;
+  log_bi = &bench_log_builtins;
+  mysql_service_log_builtins = &bench_log_builtins;
+
+  bench_log_builtins_string.malloc = bench_malloc;
+  bench_log_builtins_string.strndup = bench_strndup;
+  bench_log_builtins_string.free = bench_free;
+  bench_log_builtins_string.length = bench_length;
+  bench_log_builtins_string.find_first = bench_find_first;
+  bench_log_builtins_string.find_last = bench_find_last;
+  bench_log_builtins_string.compare = bench_compare;
+  bench_log_builtins_string.substitutev = bench_substitutev;
+  bench_log_builtins_string.substitute = bench_substitute;
+  log_bs = &bench_log_builtins_string;
+  mysql_service_log_builtins_string = &bench_log_builtins_string;
+
+  bench_mutex.register_info = bench_mutex_register;
+  bench_mutex.init = bench_mutex_init;
+  bench_mutex.destroy = bench_mutex_destroy;
+  bench_mutex.lock = bench_mutex_lock;
+  bench_mutex.trylock = bench_mutex_trylock;
+  bench_mutex.unlock = bench_mutex_unlock;
+  mysql_service_mysql_mutex_v1 = &bench_mutex;
+
+  bench_cond.register_info = bench_cond_register;
+  bench_cond.init = bench_cond_init;
+  bench_cond.destroy = bench_cond_destroy;
+  bench_cond.wait = bench_cond_wait;
+  bench_cond.timedwait = bench_cond_timedwait;
+  bench_cond.signal = bench_cond_signal;
+  bench_cond.broadcast = bench_cond_broadcast;
+  mysql_service_mysql_cond_v1 = &bench_cond;
+
+  bench_thread_reader.get = bench_current_thd;
+  mysql_service_mysql_current_thread_reader = &bench_thread_reader;
+  bench_thd_context.get = bench_thd_security_context;
+  mysql_service_mysql_thd_security_context = &bench_thd_context;
+  bench_context_options.get = bench_security_context_get;
+  mysql_service_mysql_security_context_options = &bench_context_options;
+  bench_grants_check.has_global_grant = bench_has_global_grant;
+  mysql_service_global_grants_check = &bench_grants_check;
+  bench_runtime.emit = bench_runtime_error;
+  mysql_service_mysql_runtime_error = &bench_runtime;
+
+  bench_pfs_integer.set = bench_set_int;
+  pfs_integer = &bench_pfs_integer;
+  bench_pfs_bigint.set = bench_set_bigint;
+  bench_pfs_bigint.set_unsigned = bench_set_ubigint;
+  pfs_bigint = &bench_pfs_bigint;
+  bench_pfs_string.set_varchar_utf8mb4 = bench_set_varchar;
+  bench_pfs_string.set_varchar_utf8mb4_len = bench_set_varchar_len;
+  bench_pfs_string.read_key_string = bench_read_key_string;
+  bench_pfs_string.match_key_string = bench_match_key_string;
+  pfs_string = &bench_pfs_string;
+  bench_pfs_timestamp.set = bench_set_timestamp;
+  bench_pfs_timestamp.set2 = bench_set_timestamp;
+  pfs_timestamp = &bench_pfs_timestamp;
+}
+
+unsigned long long bench_runtime_errors() {
+  return runtime_errors.load(std::memory_order_relaxed);
+}
+
+unsigned long long bench_pfs_columns() {
+  return pfs_columns.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#ifndef VIRUSCAN_BENCH_SERVICES_H
+#define VIRUSCAN_BENCH_SERVICES_H
+
+/*
+  Server services of the component, replaced by stubs in viruscan_bench.
+
+  Mutexes and condition variables are plain pthread ones, the error log
+  drops its events, the current account is bench@localhost and holds every
+  privilege. The performance_schema column setters only count the calls.
+*/
+
+/* Point the service placeholders of the component at the stubs */
+void bench_services_init();
+
+/* Errors the UDFs raised through mysql_runtime_error */
+unsigned long long bench_runtime_errors();
+/* Values handed to the performance_schema column setters */
+unsigned long long bench_pfs_columns();
+
+#endif /* VIRUSCAN_BENCH_SERVICES_H */
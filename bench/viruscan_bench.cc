@@ -0,0 +1,711 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+/*
+  viruscan_bench: the scan path of the component, outside of mysqld
+
+  The component sources are linked as they are and the server services
+  they use are stubs (bench_services.cc), so that a change of the scan path
+  can be measured without a server. Every corpus is scanned from 1, 2, 4 ...
+  up to --threads threads, for --duration seconds after a --warmup. Each
+  run prints one JSON object on a line of its own:
+
+    {"run":"scan","corpus":"text","entry":"scan_data","threads":4,...}
+
+  with the scans and MB per second, the p50, p95, p99 and max latency and
+  the operator new calls per scan made by the component. Two more lines give
+  the rows per second of a full read and of an index read of
+  performance_schema.viruscan_matches.
+
+  The cache is off by default: every payload of a corpus is the same and
+  would be a cache hit from the second scan on.
+*/
+
+#include <components/viruscan/scan.h>
+#include <components/viruscan/bench/bench_services.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <sstream>
+
+/*
+  Allocations, counted around the calls into the component only: the
+  latencies and results of the bench are kept out of the count. ClamAV
+  allocates with malloc() and is not counted either.
+*/
+static std::atomic<unsigned long long> allocations{0};
+static thread_local bool count_allocations = false;
+
+void *operator new(size_t size) {
+  if (count_allocations)
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  if (count_allocations)
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+#define BENCH_EICAR                                                       \
+  "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+/* Latencies kept per thread, the scans past it are counted only */
+#define BENCH_MAX_SAMPLES (1 << 20)
+
+struct Bench_options {
+  std::string database_directory;
+  std::string corpora = "text,eicar,zip,pdf";
+  std::string corpus_directory;
+  std::string entry = "scan_data";
+  std::string profile = "default";
+  size_t text_size = 4096;
+  unsigned int zip_depth = 5;
+  size_t pdf_size = 8 * 1024 * 1024;
+  unsigned int threads = std::max(1U, std::thread::hardware_concurrency());
+  double duration = 5;
+  double warmup = 1;
+  unsigned long long cache = 0;
+  unsigned int engine_shards = 0;
+  unsigned int matches = 1000;
+  unsigned int pfs_reads = 1000;
+};
+
+struct Payload {
+  std::string name;
+  std::string data;
+};
+
+struct Corpus {
+  std::string name;
+  std::vector<Payload> payloads;
+};
+
+/*
+  Corpora
+*/
+
+static std::string make_text(size_t size) {
+  static const char line[] =
+      "The quick brown fox jumps over the lazy dog, 0123456789.\n";
+  std::string text;
+
+  text.reserve(size);
+  while (text.size() < size)
+    text.append(line, std::min(sizeof(line) - 1, size - text.size()));
+  return text;
+}
+
+static unsigned int crc32(const std::string &data) {
+  static unsigned int table[256];
+  static bool table_ready = false;
+
+  if (!table_ready) {
+    for (unsigned int i = 0; i < 256; i++) {
+      unsigned int c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    table_ready = true;
+  }
+
+  unsigned int crc = 0xFFFFFFFFU;
+  for (unsigned char c : data) crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFU;
+}
+
+static void put16(std::string *out, unsigned int value) {
+  out->push_back((char)(value & 0xFF));
+  out->push_back((char)((value >> 8) & 0xFF));
+}
+
+static void put32(std::string *out, unsigned int value) {
+  put16(out, value & 0xFFFF);
+  put16(out, value >> 16);
+}
+
+/* A ZIP archive of one stored (not compressed) entry */
+static std::string make_zip(const std::string &name,
+                            const std::string &content) {
+  unsigned int crc = crc32(content);
+  std::string zip;
+
+  /* Local file header */
+  put32(&zip, 0x04034B50);
+  put16(&zip, 20);   /* version needed */
+  put16(&zip, 0);    /* flags */
+  put16(&zip, 0);    /* stored */
+  put16(&zip, 0);    /* time */
+  put16(&zip, 0x21); /* date, 1980-01-01 */
+  put32(&zip, crc);
+  put32(&zip, content.size());
+  put32(&zip, content.size());
+  put16(&zip, name.size());
+  put16(&zip, 0);
+  zip += name;
+  zip += content;
+
+  /* Central directory */
+  size_t directory = zip.size();
+  put32(&zip, 0x02014B50);
+  put16(&zip, 20); /* version made by */
+  put16(&zip, 20);
+  put16(&zip, 0);
+  put16(&zip, 0);
+  put16(&zip, 0);
+  put16(&zip, 0x21);
+  put32(&zip, crc);
+  put32(&zip, content.size());
+  put32(&zip, content.size());
+  put16(&zip, name.size());
+  put16(&zip, 0); /* extra */
+  put16(&zip, 0); /* comment */
+  put16(&zip, 0); /* disk */
+  put16(&zip, 0); /* internal attributes */
+  put32(&zip, 0); /* external attributes */
+  put32(&zip, 0); /* offset of the local header */
+  zip += name;
+
+  /* End of central directory */
+  size_t directory_size = zip.size() - directory;
+  put32(&zip, 0x06054B50);
+  put16(&zip, 0);
+  put16(&zip, 0);
+  put16(&zip, 1);
+  put16(&zip, 1);
+  put32(&zip, directory_size);
+  put32(&zip, directory);
+  put16(&zip, 0);
+  return zip;
+}
+
+/* depth archives in each other, the innermost holds the text */
+static std::string make_nested_zip(unsigned int depth,
+                                   const std::string &text) {
+  std::string data = text;
+  std::string name = "payload.txt";
+
+  for (unsigned int level = 0; level < depth; level++) {
+    data = make_zip(name, data);
+    name = "level" + std::to_string(level) + ".zip";
+  }
+  return data;
+}
+
+/* A one page PDF, its content stream grown to about size bytes */
+static std::string make_pdf(size_t size) {
+  static const char text_line[] =
+      "BT /F1 12 Tf 72 712 Td (The quick brown fox jumps over the lazy dog)"
+      " Tj ET\n";
+  std::string content;
+  std::string pdf = "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n";
+  std::vector<size_t> offsets;
+  char buf[64];
+
+  content.reserve(size);
+  while (content.size() + sizeof(text_line) - 1 <= size)
+    content.append(text_line, sizeof(text_line) - 1);
+
+  offsets.push_back(pdf.size());
+  pdf += "1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n";
+  offsets.push_back(pdf.size());
+  pdf += "2 0 obj\n<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n";
+  offsets.push_back(pdf.size());
+  pdf +=
+      "3 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792] "
+      "/Contents 4 0 R >>\nendobj\n";
+  offsets.push_back(pdf.size());
+  pdf += "4 0 obj\n<< /Length " + std::to_string(content.size()) +
+         " >>\nstream\n";
+  pdf += content;
+  pdf += "\nendstream\nendobj\n";
+
+  size_t xref = pdf.size();
+  pdf += "xref\n0 5\n0000000000 65535 f \n";
+  for (size_t offset : offsets) {
+    snprintf(buf, sizeof(buf), "%010zu 00000 n \n", offset);
+    pdf += buf;
+  }
+  pdf += "trailer\n<< /Size 5 /Root 1 0 R >>\nstartxref\n" +
+         std::to_string(xref) + "\n%%EOF\n";
+  return pdf;
+}
+
+/* Every regular file of a directory, not recursing */
+static bool load_directory(const std::string &path, Corpus *corpus) {
+  DIR *dir = opendir(path.c_str());
+  struct dirent *entry;
+
+  if (dir == nullptr) return false;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string file = path + "/" + entry->d_name;
+    struct stat st;
+
+    if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    std::ifstream in(file, std::ios::binary);
+    corpus->payloads.push_back(
+        {entry->d_name, std::string(std::istreambuf_iterator<char>(in),
+                                    std::istreambuf_iterator<char>())});
+  }
+  closedir(dir);
+  return !corpus->payloads.empty();
+}
+
+static bool build_corpora(const Bench_options &options,
+                          std::vector<Corpus> *corpora) {
+  std::stringstream names(options.corpora);
+  std::string name;
+
+  while (std::getline(names, name, ',')) {
+    Corpus corpus;
+    corpus.name = name;
+    if (name == "text")
+      corpus.payloads.push_back({"text", make_text(options.text_size)});
+    else if (name == "eicar")
+      corpus.payloads.push_back({"eicar", BENCH_EICAR});
+    else if (name == "zip")
+      corpus.payloads.push_back(
+          {"zip", make_nested_zip(options.zip_depth,
+                                  make_text(options.text_size))});
+    else if (name == "pdf")
+      corpus.payloads.push_back({"pdf", make_pdf(options.pdf_size)});
+    else if (!name.empty()) {
+      fprintf(stderr, "unknown corpus '%s'\n", name.c_str());
+      return false;
+    }
+    if (!corpus.payloads.empty()) corpora->push_back(std::move(corpus));
+  }
+
+  if (!options.corpus_directory.empty()) {
+    Corpus corpus;
+    corpus.name = "directory";
+    if (!load_directory(options.corpus_directory, &corpus)) {
+      fprintf(stderr, "no file to scan in '%s'\n",
+              options.corpus_directory.c_str());
+      return false;
+    }
+    corpora->push_back(std::move(corpus));
+  }
+  return true;
+}
+
+/*
+  Scan runs
+*/
+
+struct Worker_result {
+  unsigned long long scans = 0;
+  unsigned long long bytes = 0;
+  unsigned long long clean = 0;
+  unsigned long long infected = 0;
+  unsigned long long errors = 0;
+  /* Microseconds, at most BENCH_MAX_SAMPLES */
+  std::vector<unsigned int> latencies;
+};
+
+enum bench_phase { PHASE_WARMUP = 0, PHASE_MEASURE, PHASE_STOP };
+
+struct Run_state {
+  const Bench_options *options;
+  const Corpus *corpus;
+  const Scan_profile *profile;
+  std::atomic<int> phase{PHASE_WARMUP};
+};
+
+/* Through scan_data(), a detection is recorded like virus_scan() does */
+static int scan_direct(const Run_state *run, const Payload &payload) {
+  count_allocations = true;
+  struct scan_result result = udf_impl::scan_data(
+      payload.data.data(), payload.data.size(), run->profile);
+  if (result.engine && result.return_code == CL_VIRUS) {
+    PSI_int signatures = {(long)result.engine->signatures, false};
+    addVirus_element(time(nullptr), result.virus_name, "bench", "localhost",
+                     "bench", signatures, nullptr, result.size);
+  }
+  count_allocations = false;
+
+  return result.engine ? result.return_code : CL_ENULLARG;
+}
+
+/* Through the virus_scan() UDF, with its privilege check and admission */
+static int scan_udf(const Run_state *run, const Payload &payload) {
+  char *args[2] = {const_cast<char *>(payload.data.data()),
+                   const_cast<char *>(run->profile->name)};
+  unsigned long lengths[2] = {payload.data.size(),
+                              strlen(run->profile->name)};
+  enum Item_result types[2] = {STRING_RESULT, STRING_RESULT};
+  UDF_INIT initid;
+  UDF_ARGS udf_args;
+  char outp[256];
+  unsigned long length = sizeof(outp) - 1;
+  char is_null = 0, error = 0;
+
+  memset(&initid, 0, sizeof(initid));
+  memset(&udf_args, 0, sizeof(udf_args));
+  udf_args.arg_count = 2;
+  udf_args.arg_type = types;
+  udf_args.args = args;
+  udf_args.lengths = lengths;
+
+  count_allocations = true;
+  udf_impl::viruscan_udf(&initid, &udf_args, outp, &length, &is_null, &error);
+  count_allocations = false;
+
+  if (error) return CL_ENULLARG;
+  return strcmp(outp, "clean: no virus found") == 0 ? CL_CLEAN : CL_VIRUS;
+}
+
+static void scan_worker(Run_state *run, unsigned int worker,
+                        Worker_result *result) {
+  const std::vector<Payload> &payloads = run->corpus->payloads;
+  bool udf = run->options->entry == "udf";
+  size_t next = worker;
+
+  result->latencies.reserve(BENCH_MAX_SAMPLES);
+
+  for (int phase; (phase = run->phase.load()) != PHASE_STOP;) {
+    const Payload &payload = payloads[next++ % payloads.size()];
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    int return_code = udf ? scan_udf(run, payload) : scan_direct(run, payload);
+    unsigned long long elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+
+    if (phase != PHASE_MEASURE) continue;
+    result->scans++;
+    result->bytes += payload.data.size();
+    if (return_code == CL_CLEAN)
+      result->clean++;
+    else if (return_code == CL_VIRUS)
+      result->infected++;
+    else
+      result->errors++;
+    if (result->latencies.size() < BENCH_MAX_SAMPLES)
+      result->latencies.push_back(
+          (unsigned int)std::min<unsigned long long>(elapsed_us, UINT_MAX));
+  }
+}
+
+static unsigned int percentile(const std::vector<unsigned int> &sorted,
+                               double fraction) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1,
+                         (size_t)(fraction * (sorted.size() - 1) + 0.5))];
+}
+
+static void run_scans(const Bench_options &options, const Corpus &corpus,
+                      const Scan_profile *profile, unsigned int threads) {
+  Run_state run;
+  std::vector<Worker_result> results(threads);
+  std::vector<std::thread> workers;
+
+  run.options = &options;
+  run.corpus = &corpus;
+  run.profile = profile;
+
+  for (unsigned int i = 0; i < threads; i++)
+    workers.emplace_back(scan_worker, &run, i, &results[i]);
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+  unsigned long long allocations_before = allocations.load();
+  unsigned long long sharded_before = stats_get(STAT_SHARDED_SCAN_TIME_US);
+  unsigned long long shards_before = stats_get(STAT_SHARD_SCAN_TIME_US);
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  run.phase = PHASE_MEASURE;
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+  run.phase = PHASE_STOP;
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (std::thread &worker : workers) worker.join();
+  /* The scans in flight when the run stopped are counted in both */
+  unsigned long long allocated = allocations.load() - allocations_before;
+  /* Time the shards scanned for per second of sharded scan */
+  unsigned long long sharded_us =
+      stats_get(STAT_SHARDED_SCAN_TIME_US) - sharded_before;
+  double shard_parallelism =
+      sharded_us ? (double)(stats_get(STAT_SHARD_SCAN_TIME_US) -
+                            shards_before) /
+                       sharded_us
+                 : 0.0;
+
+  Worker_result total;
+  for (Worker_result &result : results) {
+    total.scans += result.scans;
+    total.bytes += result.bytes;
+    total.clean += result.clean;
+    total.infected += result.infected;
+    total.errors += result.errors;
+    total.latencies.insert(total.latencies.end(), result.latencies.begin(),
+                           result.latencies.end());
+  }
+  std::sort(total.latencies.begin(), total.latencies.end());
+
+  printf(
+      "{\"run\":\"scan\",\"corpus\":\"%s\",\"entry\":\"%s\","
+      "\"profile\":\"%s\",\"threads\":%u,\"payloads\":%zu,"
+      "\"seconds\":%.3f,\"scans\":%llu,\"scans_per_sec\":%.1f,"
+      "\"mb_per_sec\":%.2f,\"p50_us\":%u,\"p95_us\":%u,\"p99_us\":%u,"
+      "\"max_us\":%u,\"clean\":%llu,\"infected\":%llu,\"errors\":%llu,"
+      "\"allocations\":%llu,\"allocations_per_scan\":%.2f,"
+      "\"shard_parallelism\":%.2f}\n",
+      corpus.name.c_str(), options.entry.c_str(), profile->name, threads,
+      corpus.payloads.size(), seconds, total.scans, total.scans / seconds,
+      total.bytes / seconds / (1024 * 1024),
+      percentile(total.latencies, 0.50), percentile(total.latencies, 0.95),
+      percentile(total.latencies, 0.99),
+      total.latencies.empty() ? 0 : total.latencies.back(), total.clean,
+      total.infected, total.errors, allocated,
+      total.scans ? (double)allocated / total.scans : 0.0, shard_parallelism);
+  fflush(stdout);
+}
+
+/*
+  performance_schema.viruscan_matches, read the way the server does
+*/
+
+static void run_pfs_reads(const Bench_options &options) {
+  PFS_engine_table_proxy *table = &virus_st_share.m_proxy_engine_table;
+  const unsigned int columns = 7;
+  unsigned long long rows = 0, columns_before = bench_pfs_columns();
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  for (unsigned int i = 0; i < options.pfs_reads; i++) {
+    PSI_pos *pos;
+    PSI_table_handle *handle = table->open_table(&pos);
+    table->rnd_init(handle, true);
+    while (table->rnd_next(handle) == 0) {
+      for (unsigned int column = 0; column < columns; column++)
+        table->read_column_value(handle, nullptr, column);
+      rows++;
+    }
+    table->close_table(handle);
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  printf(
+      "{\"run\":\"pfs_scan\",\"table\":\"viruscan_matches\","
+      "\"reads\":%u,\"rows\":%llu,\"columns\":%llu,\"seconds\":%.3f,"
+      "\"rows_per_sec\":%.1f}\n",
+      options.pfs_reads, rows, bench_pfs_columns() - columns_before, seconds,
+      rows / seconds);
+
+  /* WHERE USER = 'bench' */
+  rows = 0;
+  start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < options.pfs_reads; i++) {
+    PSI_pos *pos;
+    PSI_index_handle *index;
+    PSI_table_handle *handle = table->open_table(&pos);
+    table->index_init(handle, VIRUS_INDEX_USER, true, &index);
+    table->index_read(index, (PSI_key_reader *)"bench", 1, VIRUS_KEY_EXACT);
+    while (table->index_next(handle) == 0) rows++;
+    table->close_table(handle);
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+                .count();
+  printf(
+      "{\"run\":\"pfs_index\",\"table\":\"viruscan_matches\","
+      "\"key\":\"USER\",\"reads\":%u,\"rows\":%llu,\"seconds\":%.3f,"
+      "\"rows_per_sec\":%.1f}\n",
+      options.pfs_reads, rows, seconds, rows / seconds);
+  fflush(stdout);
+}
+
+/*
+  Command line
+*/
+
+static void usage() {
+  fprintf(stderr,
+          "usage: viruscan_bench [--option=value ...]\n"
+          "  --database-dir=DIR    signatures, default the ClamAV one\n"
+          "  --corpus=LIST         text,eicar,zip,pdf (default all)\n"
+          "  --corpus-dir=DIR      also scan the files of DIR\n"
+          "  --text-size=BYTES     text payload and innermost archive entry\n"
+          "  --zip-depth=N         archives nested in each other\n"
+          "  --pdf-size=BYTES      PDF content stream\n"
+          "  --threads=N           runs with 1, 2, 4 ... N threads\n"
+          "  --duration=SECONDS    measured time of a run\n"
+          "  --warmup=SECONDS      time scanned before a run is measured\n"
+          "  --entry=NAME          scan_data or udf\n"
+          "  --profile=NAME        fast, default, paranoid, hash or auto\n"
+          "  --cache-size=BYTES    verdict cache, 0 (default) to disable\n"
+          "  --engine-shards=N     split the databases across N engines\n"
+          "  --matches-size=N      rows of viruscan_matches\n"
+          "  --pfs-reads=N         reads of viruscan_matches, 0 to skip\n");
+}
+
+static bool parse_options(int argc, char **argv, Bench_options *options) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = strchr(arg, '=');
+
+    if (strncmp(arg, "--", 2) != 0 || value == nullptr) return false;
+    std::string name(arg + 2, value - arg - 2);
+    value++;
+
+    if (name == "database-dir")
+      options->database_directory = value;
+    else if (name == "corpus")
+      options->corpora = value;
+    else if (name == "corpus-dir")
+      options->corpus_directory = value;
+    else if (name == "text-size")
+      options->text_size = strtoull(value, nullptr, 10);
+    else if (name == "zip-depth")
+      options->zip_depth = strtoul(value, nullptr, 10);
+    else if (name == "pdf-size")
+      options->pdf_size = strtoull(value, nullptr, 10);
+    else if (name == "threads")
+      options->threads = std::max(1UL, strtoul(value, nullptr, 10));
+    else if (name == "duration")
+      options->duration = strtod(value, nullptr);
+    else if (name == "warmup")
+      options->warmup = strtod(value, nullptr);
+    else if (name == "entry")
+      options->entry = value;
+    else if (name == "profile")
+      options->profile = value;
+    else if (name == "cache-size")
+      options->cache = strtoull(value, nullptr, 10);
+    else if (name == "engine-shards")
+      options->engine_shards = std::min<unsigned long>(
+          strtoul(value, nullptr, 10), VIRUS_ENGINE_SHARDS_MAX);
+    else if (name == "matches-size")
+      options->matches = std::max(1UL, strtoul(value, nullptr, 10));
+    else if (name == "pfs-reads")
+      options->pfs_reads = strtoul(value, nullptr, 10);
+    else
+      return false;
+  }
+  return options->entry == "scan_data" || options->entry == "udf";
+}
+
+int main(int argc, char **argv) {
+  Bench_options options;
+  std::vector<Corpus> corpora;
+
+  if (!parse_options(argc, argv, &options)) {
+    usage();
+    return 2;
+  }
+
+  const Scan_profile *profile =
+      find_scan_profile(options.profile.c_str(), options.profile.size());
+  if (profile == nullptr) {
+    fprintf(stderr, "unknown scan profile '%s'\n", options.profile.c_str());
+    return 2;
+  }
+  if (!build_corpora(options, &corpora)) return 2;
+
+  /* What viruscan_service_init() does, minus the registrations */
+  bench_services_init();
+  if (!options.database_directory.empty())
+    database_directory = const_cast<char *>(options.database_directory.c_str());
+  cache_size = options.cache;
+  engine_shards = options.engine_shards;
+  matches_size = options.matches;
+  mysql_mutex_init(key_mutex_engine_reload, &LOCK_engine_reload, nullptr);
+  mysql_mutex_init(key_mutex_engine_loaded, &LOCK_engine_loaded, nullptr);
+  mysql_mutex_init(key_mutex_database_settings, &LOCK_database_settings,
+                   nullptr);
+  database_strings_changed();
+  mysql_cond_init(key_cond_engine_loaded, &COND_engine_loaded);
+  init_cache();
+  init_admission();
+  init_clean_store();
+  init_virus_share(&virus_st_share);
+  init_virus_data();
+  init_virus_summary();
+  shard_pool.start(engine_shards > 1 ? engine_shards - 1 : 0,
+                   engine_shards * VIRUS_POOL_QUEUE_PER_THREAD);
+
+  cl_error_t rv = cl_init(CL_INIT_DEFAULT);
+  if (rv != CL_SUCCESS) {
+    fprintf(stderr, "can't initialize libclamav: %s\n", cl_strerror(rv));
+    return 1;
+  }
+
+  /* Loaded in the foreground: the runs must not wait for it */
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  unsigned int signatures = 0;
+  if (!reload_engine(&signatures)) {
+    fprintf(stderr, "the ClamAV engine could not be loaded\n");
+    return 1;
+  }
+  printf(
+      "{\"run\":\"load\",\"clamav\":\"%s\",\"signatures\":%u,"
+      "\"seconds\":%.3f,\"shards\":%zu,\"shard_memory_mb\":%llu}\n",
+      cl_retver(), signatures,
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count(),
+      acquire_engine()->shards.size(),
+      acquire_engine()->shard_memory / (1024 * 1024));
+  fflush(stdout);
+
+  for (const Corpus &corpus : corpora)
+    for (unsigned int threads = 1;; threads *= 2) {
+      threads = std::min(threads, options.threads);
+      run_scans(options, corpus, profile, threads);
+      if (threads == options.threads) break;
+    }
+
+  if (options.pfs_reads > 0) run_pfs_reads(options);
+
+  shard_pool.stop();
+  release_engine();
+  cleanup_virus_summary();
+  cleanup_virus_data();
+  cleanup_clean_store();
+  cleanup_admission();
+  cleanup_cache();
+  cleanup_scratch_pool();
+  return 0;
+}
@@ -21,15 +21,20 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
 
 #define LOG_COMPONENT_TAG "viruscan"
-#define NO_SIGNATURE_CHANGE 0
-#define SIGNATURE_CHANGE 1
 
 #include <components/viruscan/scan.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 REQUIRES_SERVICE_PLACEHOLDER(log_builtins);
 REQUIRES_SERVICE_PLACEHOLDER(log_builtins_string);
 REQUIRES_SERVICE_PLACEHOLDER(dynamic_privilege_register);
 REQUIRES_SERVICE_PLACEHOLDER(udf_registration);
+REQUIRES_SERVICE_PLACEHOLDER(udf_registration_aggregate);
 REQUIRES_SERVICE_PLACEHOLDER(mysql_udf_metadata);
 REQUIRES_SERVICE_PLACEHOLDER(mysql_thd_security_context);
 REQUIRES_SERVICE_PLACEHOLDER(mysql_security_context_options);
@@ -37,55 +42,270 @@ REQUIRES_SERVICE_PLACEHOLDER(global_grants_check);
 REQUIRES_SERVICE_PLACEHOLDER(mysql_current_thread_reader);
 REQUIRES_SERVICE_PLACEHOLDER(mysql_runtime_error);
 REQUIRES_SERVICE_PLACEHOLDER(status_variable_registration);
+REQUIRES_SERVICE_PLACEHOLDER(component_sys_variable_register);
+REQUIRES_SERVICE_PLACEHOLDER(component_sys_variable_unregister);
 
 REQUIRES_MYSQL_MUTEX_SERVICE_PLACEHOLDER;
+REQUIRES_MYSQL_COND_SERVICE_PLACEHOLDER;
 
 SERVICE_TYPE(log_builtins) * log_bi;
 SERVICE_TYPE(log_builtins_string) * log_bs;
 
 static const char *SCAN_PRIVILEGE_NAME = "VIRUS_SCAN";
 
-static unsigned int  signature_status = 0;
-static unsigned int  virusfound_status = 0;
-static char clamav_version[10] = "";
+static char clamav_version[ENGINE_VERSION_MAX_LENGTH] = "";
+
+/* Only used to demonstrate a stuck mutex, see "bug-stuck" */
+static mysql_mutex_t LOCK_virus_data;
 
 PSI_mutex_key key_mutex_virus_data = 0;
+PSI_mutex_key key_mutex_engine_reload = 0;
+PSI_mutex_key key_mutex_virus_cache = 0;
+PSI_mutex_key key_mutex_engine_loaded = 0;
+PSI_mutex_key key_mutex_scan_pool = 0;
+PSI_mutex_key key_mutex_scan_batch = 0;
+PSI_mutex_key key_mutex_virus_tickets = 0;
+PSI_mutex_key key_mutex_virus_admission = 0;
+PSI_mutex_key key_mutex_virus_store = 0;
+PSI_mutex_key key_mutex_virus_summary = 0;
+PSI_mutex_key key_mutex_virus_streams = 0;
+PSI_mutex_key key_mutex_database_settings = 0;
 PSI_mutex_info virus_data_mutex[] = {
   {&key_mutex_virus_data, "virus_scan_data", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
-     "Virus scan data, permanent mutex, singleton."}
+     "Virus scan data, permanent mutex, singleton."},
+  {&key_mutex_engine_reload, "virus_engine_reload", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Serializes ClamAV engine reloads, permanent mutex, singleton."},
+  {&key_mutex_virus_cache, "virus_scan_cache", 0, PSI_VOLATILITY_PERMANENT,
+     "Verdict cache shard, permanent mutex, one per shard."},
+  {&key_mutex_engine_loaded, "virus_engine_loaded", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "ClamAV engine load state, permanent mutex, singleton."},
+  {&key_mutex_scan_pool, "virus_scan_pool", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Scan worker pool queue, permanent mutex, singleton."},
+  {&key_mutex_scan_batch, "virus_scan_batch", 0, PSI_VOLATILITY_UNKNOWN,
+     "Scans submitted by one virus_scan_batch() group."},
+  {&key_mutex_virus_tickets, "virus_scan_tickets", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Asynchronous scan tickets, permanent mutex, singleton."},
+  {&key_mutex_virus_admission, "virus_scan_admission", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Running and queued scans, permanent mutex, singleton."},
+  {&key_mutex_virus_store, "virus_clean_store", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Persistent store of clean payloads, permanent mutex, singleton."},
+  {&key_mutex_virus_summary, "virus_matches_summary", 0, PSI_VOLATILITY_PERMANENT,
+     "Detections summary shard, permanent mutex, one per shard."},
+  {&key_mutex_virus_streams, "virus_scan_streams", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Open scan streams, permanent mutex, singleton."},
+  {&key_mutex_database_settings, "virus_database_settings", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Copies of the database string variables, permanent mutex, singleton."}
+};
+
+PSI_cond_key key_cond_engine_loaded = 0;
+PSI_cond_key key_cond_scan_pool = 0;
+PSI_cond_key key_cond_scan_batch = 0;
+PSI_cond_key key_cond_virus_tickets = 0;
+PSI_cond_key key_cond_virus_admission = 0;
+PSI_cond_key key_cond_virus_store = 0;
+PSI_cond_info virus_data_cond[] = {
+  {&key_cond_engine_loaded, "virus_engine_loaded", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Signalled when a ClamAV engine load completes, permanent condition, singleton."},
+  {&key_cond_scan_pool, "virus_scan_pool", 0, PSI_VOLATILITY_PERMANENT,
+     "Scan worker pool queue state changes, permanent condition."},
+  {&key_cond_scan_batch, "virus_scan_batch", 0, PSI_VOLATILITY_UNKNOWN,
+     "Signalled when a scan of a virus_scan_batch() group completes."},
+  {&key_cond_virus_tickets, "virus_scan_tickets", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Signalled when an asynchronous scan completes, permanent condition, singleton."},
+  {&key_cond_virus_admission, "virus_scan_admission", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Signalled when queued scans are granted a slot, permanent condition, singleton."},
+  {&key_cond_virus_store, "virus_clean_store", PSI_FLAG_SINGLETON, PSI_VOLATILITY_PERMANENT,
+     "Wakes the clean store maintainer up, permanent condition, singleton."}
 };
 
+/* Sums the per-CPU shards of a counter, see scan_stats.cc */
+template <enum stats_counter counter>
+static int show_stats_counter(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = stats_get(counter);
+  return 0;
+}
+
+static int show_admission_queue_depth(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = admission_queue_depth();
+  return 0;
+}
+
+static int show_cache_hits(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long hits, misses, memory;
+  cache_get_stats(&hits, &misses, &memory);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = hits;
+  return 0;
+}
+
+static int show_cache_misses(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long hits, misses, memory;
+  cache_get_stats(&hits, &misses, &memory);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = misses;
+  return 0;
+}
+
+static int show_cache_memory(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long hits, misses, memory;
+  cache_get_stats(&hits, &misses, &memory);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = memory;
+  return 0;
+}
+
+static int show_clean_store_hits(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long hits, misses, entries;
+  clean_store_get_stats(&hits, &misses, &entries);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = hits;
+  return 0;
+}
+
+static int show_clean_store_misses(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long hits, misses, entries;
+  clean_store_get_stats(&hits, &misses, &entries);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = misses;
+  return 0;
+}
+
+static int show_clean_store_entries(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long hits, misses, entries;
+  clean_store_get_stats(&hits, &misses, &entries);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = entries;
+  return 0;
+}
+
+static int show_streams_open(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long open, spilled, expired;
+  stream_get_stats(&open, &spilled, &expired);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = open;
+  return 0;
+}
+
+static int show_streams_spilled(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long open, spilled, expired;
+  stream_get_stats(&open, &spilled, &expired);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = spilled;
+  return 0;
+}
+
+static int show_streams_expired(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  unsigned long long open, spilled, expired;
+  stream_get_stats(&open, &spilled, &expired);
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = expired;
+  return 0;
+}
+
+/* Shards of the published engine, 0 when scans use the whole engine */
+static int show_engine_shards(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  Engine_ref engine = acquire_engine();
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = engine ? engine->shards.size() : 0;
+  return 0;
+}
+
+static int show_engine_shard_memory(MYSQL_THD, SHOW_VAR *var, char *buf) {
+  Engine_ref engine = acquire_engine();
+  var->type = SHOW_LONGLONG;
+  var->value = buf;
+  *(unsigned long long *)buf = engine ? engine->shard_memory : 0;
+  return 0;
+}
+
 
 static SHOW_VAR viruscan_status_variables[] = {
   {"viruscan.clamav_signatures", (char *)&signature_status, SHOW_INT,
     SHOW_SCOPE_GLOBAL},
   {"viruscan.clamav_engine_version", (char *)&clamav_version, SHOW_CHAR,
     SHOW_SCOPE_GLOBAL},
-  {"viruscan.virus_found", (char *)&virusfound_status, SHOW_INT,
+  {"viruscan.virus_found", (char *)&show_stats_counter<STAT_VIRUS_FOUND>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.scans_total", (char *)&show_stats_counter<STAT_SCANS>, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.scans_clean", (char *)&show_stats_counter<STAT_SCANS_CLEAN>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.scans_infected", (char *)&show_stats_counter<STAT_SCANS_INFECTED>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.scan_errors", (char *)&show_stats_counter<STAT_SCAN_ERRORS>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.scans_aborted", (char *)&show_stats_counter<STAT_SCANS_ABORTED>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.bytes_scanned", (char *)&show_stats_counter<STAT_BYTES_SCANNED>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.scan_time_us_total", (char *)&show_stats_counter<STAT_SCAN_TIME_US>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.reload_count", (char *)&show_stats_counter<STAT_RELOADS>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.admission_queue_depth", (char *)&show_admission_queue_depth,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.admission_wait_us_total",
+     (char *)&show_stats_counter<STAT_ADMISSION_WAIT_US>, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.admission_timeouts",
+     (char *)&show_stats_counter<STAT_ADMISSION_TIMEOUTS>, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.engine_state", (char *)&engine_state_status, SHOW_CHAR,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.engine_load_time_ms", (char *)&engine_load_time_ms, SHOW_LONGLONG,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.engine_reloaded_at", (char *)&engine_reloaded_at, SHOW_CHAR,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.signatures_changed_at", (char *)&signatures_changed_at, SHOW_CHAR,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.cache_hits", (char *)&show_cache_hits, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.cache_misses", (char *)&show_cache_misses, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.cache_memory", (char *)&show_cache_memory, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.clean_store_hits", (char *)&show_clean_store_hits, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.clean_store_misses", (char *)&show_clean_store_misses, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.clean_store_entries", (char *)&show_clean_store_entries,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.streams_open", (char *)&show_streams_open, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.streams_spilled", (char *)&show_streams_spilled, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.streams_expired", (char *)&show_streams_expired, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.engine_shards_loaded", (char *)&show_engine_shards, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.engine_shard_memory", (char *)&show_engine_shard_memory,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.sharded_scans", (char *)&show_stats_counter<STAT_SHARDED_SCANS>,
+     SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"viruscan.sharded_scan_time_us",
+     (char *)&show_stats_counter<STAT_SHARDED_SCAN_TIME_US>, SHOW_FUNC,
+     SHOW_SCOPE_GLOBAL},
+  {"viruscan.shard_scan_time_us",
+     (char *)&show_stats_counter<STAT_SHARD_SCAN_TIME_US>, SHOW_FUNC,
      SHOW_SCOPE_GLOBAL},
    {nullptr, nullptr, SHOW_LONG, SHOW_SCOPE_GLOBAL}
 };
 
 
-struct scan_result scan_data(const char *data, size_t data_size);
-
-/*
- * Holds the data of a virus scan
- */
-struct scan_result
-{
-  int               return_code;
-  const char        *virus_name;
-  long unsigned int scanned;
-};
-
-/*
- * Global variable to access the ClamAV engine
- */
-struct cl_engine *engine = NULL;
-char   *signatureDir;
-struct cl_stat signatureStat;
-
 class udf_list {
   typedef std::list<std::string> udf_list_t;
 
@@ -102,6 +322,19 @@ class udf_list {
     return true;
   }
 
+  bool add_aggregate(const char *func_name, enum Item_result return_type,
+                     Udf_func_any func, Udf_func_init init_func,
+                     Udf_func_deinit deinit_func, Udf_func_add add_func,
+                     Udf_func_clear clear_func) {
+    if (!mysql_service_udf_registration_aggregate->udf_register(
+            func_name, return_type, func, init_func, deinit_func, add_func,
+            clear_func)) {
+      set.push_back(func_name);
+      return false;
+    }
+    return true;
+  }
+
   bool unregister() {
     udf_list_t delete_set;
     /* try to unregister all of the udfs */
@@ -127,56 +360,641 @@ class udf_list {
   udf_list_t set;
 } * list;
 
-unsigned int reload_engine()
-{
-  unsigned int signatureNum = 0;
-  cl_error_t rv;
+int register_status_variables() {
+  if (mysql_service_status_variable_registration->register_variable(
+          (SHOW_VAR *)&viruscan_status_variables)) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register status variable");
+    return 1;
+  }
+  LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, "Status variable(s) registered");
+  return 0;
+}
+
+static void update_cache_size(MYSQL_THD, SYS_VAR *, void *var_ptr,
+                              const void *save) {
+  *(unsigned long long *)var_ptr = *(const unsigned long long *)save;
+  cache_trim();
+}
+
+static void update_clean_store_size(MYSQL_THD, SYS_VAR *, void *var_ptr,
+                                    const void *save) {
+  *(unsigned long long *)var_ptr = *(const unsigned long long *)save;
+  clean_store_resize();
+}
+
+static void update_database_string(MYSQL_THD, SYS_VAR *, void *var_ptr,
+                                   const void *save) {
+  *(char **)var_ptr = *(char *const *)save;
+  database_strings_changed();
+}
 
-  if (engine != NULL)
+static void update_admission_limit(MYSQL_THD, SYS_VAR *, void *var_ptr,
+                                   const void *save) {
+  *(unsigned int *)var_ptr = *(const unsigned int *)save;
+  admission_limits_changed();
+}
+
+/*
+ * Each variable is registered in its own scope: the *_CHECK_ARG macros
+ * declare a struct type that can only be defined once per scope.
+ */
+int register_system_variables() {
   {
-    cl_engine_free(engine);
+    INTEGRAL_CHECK_ARG(ulonglong) cache_size_arg;
+    cache_size_arg.def_val = VIRUS_CACHE_DEFAULT_SIZE;
+    cache_size_arg.min_val = 0;
+    cache_size_arg.max_val = ULLONG_MAX;
+    cache_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "cache_size",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Memory budget in bytes of the scan verdict cache, 0 disables it",
+            nullptr, update_cache_size, (void *)&cache_size_arg,
+            (void *)&cache_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
   }
 
-  engine = cl_engine_new();
+  /* Clean verdicts kept across restarts, see scan_store.cc */
+  {
+    STR_CHECK_ARG(str) clean_store_file_arg;
+    clean_store_file_arg.def_val = nullptr;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "clean_store_file",
+            PLUGIN_VAR_STR | PLUGIN_VAR_MEMALLOC | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "File keeping the hashes of the payloads found clean across "
+            "restarts, relative to the data directory, empty disables it",
+            nullptr, nullptr, (void *)&clean_store_file_arg,
+            (void *)&clean_store_file)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
 
-  memset(&signatureStat, 0, sizeof(struct cl_stat));
-  signatureDir = const_cast<char*>(cl_retdbdir());
-  cl_statinidir(signatureDir, &signatureStat);
-  /*
-   * Load the signatures from signatureDir, we use only the default dir
-   */
-  rv = cl_load(signatureDir, engine, &signatureNum, CL_DB_STDOPT);
-  char buf[1024];
-  if (CL_SUCCESS != rv)
   {
-    snprintf(buf, 1024, "failure loading clamav databases: %s", cl_strerror(rv));
-    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    INTEGRAL_CHECK_ARG(ulonglong) clean_store_size_arg;
+    clean_store_size_arg.def_val = VIRUS_STORE_DEFAULT_SIZE;
+    clean_store_size_arg.min_val = 0;
+    clean_store_size_arg.max_val = ULLONG_MAX;
+    clean_store_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "clean_store_size",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Size cap in bytes of viruscan.clean_store_file",
+            nullptr, update_clean_store_size, (void *)&clean_store_size_arg,
+            (void *)&clean_store_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
   }
 
-  rv = cl_engine_compile(engine);
-  if (CL_SUCCESS != rv)
   {
-    snprintf(buf, 1024, "cannot create clamav engine: %s", cl_strerror(rv));
-    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
-    cl_engine_free(engine);
+    INTEGRAL_CHECK_ARG(uint) engine_wait_timeout_arg;
+    engine_wait_timeout_arg.def_val = 0;
+    engine_wait_timeout_arg.min_val = 0;
+    engine_wait_timeout_arg.max_val = 3600 * 1000;
+    engine_wait_timeout_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "engine_wait_timeout",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Milliseconds virus_scan() waits for the ClamAV engine to be "
+            "loaded before failing, 0 fails immediately",
+            nullptr, nullptr, (void *)&engine_wait_timeout_arg,
+            (void *)&engine_wait_timeout)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
   }
 
-  snprintf(buf, 1024, "clamav engine loaded with signatureNum %d from %s", signatureNum, signatureDir);
-  LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, buf);
-  signature_status = signatureNum;
-  return signatureNum;
-}
+  {
+    INTEGRAL_CHECK_ARG(uint) scan_timeout_arg;
+    scan_timeout_arg.def_val = VIRUS_SCAN_DEFAULT_TIMEOUT;
+    scan_timeout_arg.min_val = 0;
+    scan_timeout_arg.max_val = 3600 * 1000;
+    scan_timeout_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "scan_timeout",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Milliseconds after which a scan is aborted between two of its "
+            "files, 0 disables the deadline",
+            nullptr, nullptr, (void *)&scan_timeout_arg,
+            (void *)&scan_timeout)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
 
-int register_status_variables() {
-  if (mysql_service_status_variable_registration->register_variable(
-          (SHOW_VAR *)&viruscan_status_variables)) {
-    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register status variable");
-    return 1;
+  {
+    INTEGRAL_CHECK_ARG(uint) scan_threads_arg;
+    scan_threads_arg.def_val =
+        std::max(1U, std::thread::hardware_concurrency());
+    scan_threads_arg.min_val = 1;
+    scan_threads_arg.max_val = 1024;
+    scan_threads_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "scan_threads",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Number of worker threads used by virus_scan_batch()",
+            nullptr, nullptr, (void *)&scan_threads_arg,
+            (void *)&scan_threads)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
   }
-  LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, "Status variable(s) registered");
+
+  {
+    INTEGRAL_CHECK_ARG(uint) async_threads_arg;
+    async_threads_arg.def_val = VIRUS_ASYNC_DEFAULT_THREADS;
+    async_threads_arg.min_val = 1;
+    async_threads_arg.max_val = 1024;
+    async_threads_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "async_threads",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Number of worker threads running virus_scan_async() scans",
+            nullptr, nullptr, (void *)&async_threads_arg,
+            (void *)&async_threads)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) async_queue_size_arg;
+    async_queue_size_arg.def_val = VIRUS_ASYNC_DEFAULT_QUEUE_SIZE;
+    async_queue_size_arg.min_val = 1;
+    async_queue_size_arg.max_val = 1024 * 1024;
+    async_queue_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "async_queue_size",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Number of virus_scan_async() tickets kept, pending ones "
+            "included",
+            nullptr, nullptr, (void *)&async_queue_size_arg,
+            (void *)&async_queue_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(ulonglong) async_queue_max_bytes_arg;
+    async_queue_max_bytes_arg.def_val = VIRUS_ASYNC_DEFAULT_QUEUE_MAX_BYTES;
+    async_queue_max_bytes_arg.min_val = 0;
+    async_queue_max_bytes_arg.max_val = 64ULL * 1024 * 1024 * 1024;
+    async_queue_max_bytes_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "async_queue_max_bytes",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Payload bytes the queued and running virus_scan_async() scans "
+            "may hold, 0 for no limit",
+            nullptr, nullptr, (void *)&async_queue_max_bytes_arg,
+            (void *)&async_queue_max_bytes)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  /* Streaming scans, see scan_stream.cc */
+  {
+    INTEGRAL_CHECK_ARG(ulonglong) stream_buffer_size_arg;
+    stream_buffer_size_arg.def_val = VIRUS_STREAM_DEFAULT_BUFFER_SIZE;
+    stream_buffer_size_arg.min_val = 0;
+    stream_buffer_size_arg.max_val = 1024ULL * 1024 * 1024;
+    stream_buffer_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "stream_buffer_size",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Bytes of a scan stream kept in memory, larger streams are "
+            "written to the server tmpdir",
+            nullptr, nullptr, (void *)&stream_buffer_size_arg,
+            (void *)&stream_buffer_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) max_streams_arg;
+    max_streams_arg.def_val = VIRUS_STREAM_DEFAULT_MAX;
+    max_streams_arg.min_val = 1;
+    max_streams_arg.max_val = 64 * 1024;
+    max_streams_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_streams",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Number of scan streams open at the same time",
+            nullptr, nullptr, (void *)&max_streams_arg,
+            (void *)&max_streams)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) stream_idle_timeout_arg;
+    stream_idle_timeout_arg.def_val = VIRUS_STREAM_DEFAULT_IDLE_TIMEOUT;
+    stream_idle_timeout_arg.min_val = 1;
+    stream_idle_timeout_arg.max_val = 31536000;
+    stream_idle_timeout_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "stream_idle_timeout",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Seconds after which a scan stream not fed any more can be "
+            "reclaimed by another one",
+            nullptr, nullptr, (void *)&stream_idle_timeout_arg,
+            (void *)&stream_idle_timeout)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    ENUM_CHECK_ARG(enum) scan_profile_arg;
+    scan_profile_arg.def_val = VIRUS_PROFILE_DEFAULT;
+    scan_profile_arg.typelib = &scan_profile_typelib;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "scan_profile", PLUGIN_VAR_ENUM | PLUGIN_VAR_RQCMDARG,
+            "Scan profile used when virus_scan() is not given one: fast, "
+            "default, paranoid, hash or auto",
+            nullptr, nullptr, (void *)&scan_profile_arg,
+            (void *)&scan_profile)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  /* ClamAV engine limits, applied when the engine is (re)loaded */
+  {
+    INTEGRAL_CHECK_ARG(ulonglong) max_filesize_arg;
+    max_filesize_arg.def_val = 0;
+    max_filesize_arg.min_val = 0;
+    max_filesize_arg.max_val = LLONG_MAX;
+    max_filesize_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_filesize",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Bytes of a file or embedded object that are scanned, 0 keeps the "
+            "ClamAV default",
+            nullptr, nullptr, (void *)&max_filesize_arg,
+            (void *)&engine_limits.max_filesize)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(ulonglong) max_scansize_arg;
+    max_scansize_arg.def_val = 0;
+    max_scansize_arg.min_val = 0;
+    max_scansize_arg.max_val = LLONG_MAX;
+    max_scansize_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_scansize",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Bytes scanned per payload, embedded objects included, 0 keeps "
+            "the ClamAV default",
+            nullptr, nullptr, (void *)&max_scansize_arg,
+            (void *)&engine_limits.max_scansize)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) max_recursion_arg;
+    max_recursion_arg.def_val = 0;
+    max_recursion_arg.min_val = 0;
+    max_recursion_arg.max_val = 1024;
+    max_recursion_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_recursion",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Nesting depth of archives and embedded objects, 0 keeps the "
+            "ClamAV default",
+            nullptr, nullptr, (void *)&max_recursion_arg,
+            (void *)&engine_limits.max_recursion)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) max_files_arg;
+    max_files_arg.def_val = 0;
+    max_files_arg.min_val = 0;
+    max_files_arg.max_val = UINT_MAX;
+    max_files_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_files",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Embedded files scanned per payload, 0 keeps the ClamAV default",
+            nullptr, nullptr, (void *)&max_files_arg,
+            (void *)&engine_limits.max_files)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) max_scantime_arg;
+    max_scantime_arg.def_val = 0;
+    max_scantime_arg.min_val = 0;
+    max_scantime_arg.max_val = UINT_MAX;
+    max_scantime_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_scantime",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Milliseconds after which a scan is aborted, 0 keeps the ClamAV "
+            "default",
+            nullptr, nullptr, (void *)&max_scantime_arg,
+            (void *)&engine_limits.max_scantime)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  /* Signature databases, applied when the engine is (re)loaded */
+  {
+    STR_CHECK_ARG(str) database_directory_arg;
+    database_directory_arg.def_val = nullptr;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "database_directory",
+            PLUGIN_VAR_STR | PLUGIN_VAR_MEMALLOC | PLUGIN_VAR_RQCMDARG,
+            "Directory of the ClamAV signature databases, empty for the "
+            "ClamAV default",
+            nullptr, update_database_string, (void *)&database_directory_arg,
+            (void *)&database_directory)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    STR_CHECK_ARG(str) database_include_arg;
+    database_include_arg.def_val = nullptr;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "database_include",
+            PLUGIN_VAR_STR | PLUGIN_VAR_MEMALLOC | PLUGIN_VAR_RQCMDARG,
+            "Comma separated databases, files or types to load, empty for "
+            "all of them",
+            nullptr, update_database_string, (void *)&database_include_arg,
+            (void *)&database_include)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    STR_CHECK_ARG(str) database_exclude_arg;
+    database_exclude_arg.def_val = nullptr;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "database_exclude",
+            PLUGIN_VAR_STR | PLUGIN_VAR_MEMALLOC | PLUGIN_VAR_RQCMDARG,
+            "Comma separated databases, files or types never loaded",
+            nullptr, update_database_string, (void *)&database_exclude_arg,
+            (void *)&database_exclude)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(ulonglong) database_options_arg;
+    database_options_arg.def_val = CL_DB_STDOPT;
+    database_options_arg.min_val = 0;
+    database_options_arg.max_val = UINT_MAX;
+    database_options_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "database_options",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "CL_DB_* flags given to cl_load(), CL_DB_STDOPT by default",
+            nullptr, nullptr, (void *)&database_options_arg,
+            (void *)&database_options)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  /* Reload the engine when the signature directory changes */
+  {
+    BOOL_CHECK_ARG(bool) auto_reload_arg;
+    auto_reload_arg.def_val = false;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "auto_reload", PLUGIN_VAR_BOOL | PLUGIN_VAR_RQCMDARG,
+            "Reload the engine when the signature databases are updated",
+            nullptr, nullptr, (void *)&auto_reload_arg,
+            (void *)&auto_reload)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) auto_reload_quiet_period_arg;
+    auto_reload_quiet_period_arg.def_val =
+        VIRUS_AUTO_RELOAD_DEFAULT_QUIET_PERIOD;
+    auto_reload_quiet_period_arg.min_val = 0;
+    auto_reload_quiet_period_arg.max_val = 3600 * 1000;
+    auto_reload_quiet_period_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "auto_reload_quiet_period",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Milliseconds without change in the signature directory before "
+            "the engine is reloaded",
+            nullptr, nullptr, (void *)&auto_reload_quiet_period_arg,
+            (void *)&auto_reload_quiet_period)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) engine_shards_arg;
+    engine_shards_arg.def_val = 0;
+    engine_shards_arg.min_val = 0;
+    engine_shards_arg.max_val = VIRUS_ENGINE_SHARDS_MAX;
+    engine_shards_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "engine_shards",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Also split the databases across this many engines, a large "
+            "payload is scanned on all of them at once. 0 for none",
+            nullptr, nullptr, (void *)&engine_shards_arg,
+            (void *)&engine_shards)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(ulonglong) shard_min_size_arg;
+    shard_min_size_arg.def_val = VIRUS_SHARD_DEFAULT_MIN_SIZE;
+    shard_min_size_arg.min_val = 0;
+    shard_min_size_arg.max_val = ULLONG_MAX;
+    shard_min_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "shard_min_size",
+            PLUGIN_VAR_LONGLONG | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Payloads of at least this many bytes are scanned on the engine "
+            "shards, smaller ones on the whole engine",
+            nullptr, nullptr, (void *)&shard_min_size_arg,
+            (void *)&shard_min_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    BOOL_CHECK_ARG(bool) hash_engine_arg;
+    hash_engine_arg.def_val = false;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "hash_engine", PLUGIN_VAR_BOOL | PLUGIN_VAR_RQCMDARG,
+            "Also load the hash databases in a lightweight engine, used by "
+            "the 'hash' scan profile",
+            nullptr, nullptr, (void *)&hash_engine_arg,
+            (void *)&hash_engine)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  /* Admission control of the scans run on connection threads */
+  {
+    INTEGRAL_CHECK_ARG(uint) max_concurrent_scans_arg;
+    max_concurrent_scans_arg.def_val = 0;
+    max_concurrent_scans_arg.min_val = 0;
+    max_concurrent_scans_arg.max_val = 65536;
+    max_concurrent_scans_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_concurrent_scans",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Scans running at once on connection threads, the others wait. "
+            "0 for no limit",
+            nullptr, update_admission_limit,
+            (void *)&max_concurrent_scans_arg,
+            (void *)&max_concurrent_scans)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) max_account_scans_arg;
+    max_account_scans_arg.def_val = 0;
+    max_account_scans_arg.min_val = 0;
+    max_account_scans_arg.max_val = 65536;
+    max_account_scans_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "max_account_scans",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Scans running at once for one account, 0 for no limit",
+            nullptr, update_admission_limit, (void *)&max_account_scans_arg,
+            (void *)&max_account_scans)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) admission_timeout_arg;
+    admission_timeout_arg.def_val = VIRUS_ADMISSION_DEFAULT_TIMEOUT;
+    admission_timeout_arg.min_val = 0;
+    admission_timeout_arg.max_val = 3600 * 1000;
+    admission_timeout_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "admission_timeout",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG,
+            "Milliseconds a scan waits for its turn before failing",
+            nullptr, nullptr, (void *)&admission_timeout_arg,
+            (void *)&admission_timeout)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) matches_size_arg;
+    matches_size_arg.def_val = VIRUS_MAX_ROWS;
+    matches_size_arg.min_val = 1;
+    matches_size_arg.max_val = VIRUS_MATCHES_MAX_SIZE;
+    matches_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "matches_size",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Number of detections kept in performance_schema.viruscan_matches",
+            nullptr, nullptr, (void *)&matches_size_arg,
+            (void *)&matches_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  {
+    INTEGRAL_CHECK_ARG(uint) matches_summary_size_arg;
+    matches_summary_size_arg.def_val = VIRUS_SUMMARY_DEFAULT_SIZE;
+    matches_summary_size_arg.min_val = VIRUS_SUMMARY_SHARDS;
+    matches_summary_size_arg.max_val = 1024 * 1024;
+    matches_summary_size_arg.blk_sz = 0;
+    if (mysql_service_component_sys_variable_register->register_variable(
+            "viruscan", "matches_summary_size",
+            PLUGIN_VAR_INT | PLUGIN_VAR_UNSIGNED | PLUGIN_VAR_RQCMDARG |
+                PLUGIN_VAR_READONLY,
+            "Number of virus, user and host rows kept in "
+            "performance_schema.viruscan_matches_summary",
+            nullptr, nullptr, (void *)&matches_summary_size_arg,
+            (void *)&matches_summary_size)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to register system variable");
+      return 1;
+    }
+  }
+
+  LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, "System variable(s) registered");
   return 0;
 }
 
+int unregister_system_variables() {
+  static const char *names[] = {"cache_size", "clean_store_file",
+                                "clean_store_size", "engine_wait_timeout",
+                                "scan_timeout",
+                                "scan_threads", "async_threads",
+                                "async_queue_size", "async_queue_max_bytes",
+                                "stream_buffer_size",
+                                "max_streams", "stream_idle_timeout",
+                                "scan_profile",
+                                "max_filesize", "max_scansize",
+                                "max_recursion", "max_files",
+                                "max_scantime", "database_directory",
+                                "database_include", "database_exclude",
+                                "database_options", "hash_engine",
+                                "engine_shards", "shard_min_size",
+                                "auto_reload",
+                                "auto_reload_quiet_period",
+                                "max_concurrent_scans", "max_account_scans",
+                                "admission_timeout", "matches_size",
+                                "matches_summary_size"};
+  int result = 0;
+
+  for (const char *name : names) {
+    if (mysql_service_component_sys_variable_unregister->unregister_variable(
+            "viruscan", name)) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "Failed to unregister system variable");
+      result = 1;
+    }
+  }
+  if (result == 0)
+    LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, "System variable(s) unregistered");
+  return result;
+}
+
 int unregister_status_variables() {
   if (mysql_service_status_variable_registration->unregister_variable(
           (SHOW_VAR *)&viruscan_status_variables)) {
@@ -190,27 +1008,208 @@ int unregister_status_variables() {
 
 namespace udf_impl {
 
-struct scan_result scan_data(const char *data, size_t data_size)
-{
-  struct scan_result result = {0, "", 0};
-  cl_fmap_t *map;
-
-  map = cl_fmap_open_memory(data, data_size);
-  /* scan file descriptor */
-  static struct cl_scan_options cl_scan_options;
-  memset(&cl_scan_options, 0, sizeof(struct cl_scan_options));
-  cl_scan_options.parse |= ~0;                           /* enable all parsers */
-  cl_scan_options.general |= CL_SCAN_GENERAL_ALLMATCHES;
-  result.return_code = cl_scanmap_callback(map,
-                          NULL,
-                          &result.virus_name,
-                          &result.scanned,
+/* pread() callback of cl_fmap_open_handle(), the handle is the descriptor */
+static off_t pread_file(void *handle, void *buf, size_t count, off_t offset) {
+  return pread((int)(intptr_t)handle, buf, count, offset);
+}
+
+/* The engine of a generation a profile scans with */
+static struct cl_engine *profile_engine(const Engine_generation &generation,
+                                        const Scan_profile *profile) {
+  return profile->hash_only ? generation.hash_engine : generation.engine;
+}
+
+/*
+ * Run engine on a map with cl_scan_options, and close it. A scan the engine
+ * callbacks aborted is not clean: its verdict is CL_ETIMEOUT or CL_BREAK,
+ * unless a virus was found before.
+ */
+static void scan_map(cl_fmap_t *map, struct cl_engine *engine,
+                     const char *file_name,
+                     struct cl_scan_options cl_scan_options,
+                     struct scan_result *result, Scan_control *control) {
+  const char *virus_name = nullptr;
+
+  if (map == nullptr) {
+    result->return_code = CL_EMEM;
+    return;
+  }
+
+  control->aborted = SCAN_NOT_ABORTED;
+  control->deadline_us =
+      control->timeout_ms == 0
+          ? 0
+          : std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                    .count() +
+                control->timeout_ms * 1000ULL;
+
+  result->return_code = cl_scanmap_callback(map,
+                          file_name,
+                          &virus_name,
+                          &result->scanned,
                           engine,
                           &cl_scan_options,
-                          NULL);
+                          control);
 
   cl_fmap_close(map);
 
+  if (control->aborted != SCAN_NOT_ABORTED &&
+      result->return_code != CL_VIRUS)
+    result->return_code =
+        control->aborted == SCAN_TIMED_OUT ? CL_ETIMEOUT : CL_BREAK;
+
+  if (result->return_code == CL_VIRUS && virus_name != nullptr)
+    snprintf(result->virus_name, sizeof(result->virus_name), "%s",
+             virus_name);
+}
+
+/* Are the shards of the engine of result worth the scan of size bytes */
+static bool scan_on_shards(const struct scan_result &result,
+                           const Scan_profile *profile, size_t size,
+                           const Scan_control *control) {
+  /* The matches collected by a context would be spread across the shards */
+  return !result.engine->shards.empty() && size >= shard_min_size &&
+         !profile->hash_only && control->context == nullptr;
+}
+
+/*
+ * Scan a payload, data or the file fd, on every shard of the engine at
+ * once, the caller scanning the first one. Each shard unpacks the payload
+ * again: only the signatures are split. A virus any shard finds is the
+ * verdict, else the first error or abort of a shard.
+ */
+static void scan_shards(const char *data, int fd, size_t size,
+                        const char *file_name,
+                        const struct cl_scan_options &options,
+                        struct scan_result *result, Scan_control *control) {
+  const std::vector<struct cl_engine *> &shards = result->engine->shards;
+  struct scan_result shard_results[VIRUS_ENGINE_SHARDS_MAX];
+  Scan_control shard_controls[VIRUS_ENGINE_SHARDS_MAX];
+  unsigned long long shard_us[VIRUS_ENGINE_SHARDS_MAX];
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  auto scan_shard = [&](size_t shard) {
+    std::chrono::steady_clock::time_point shard_start =
+        std::chrono::steady_clock::now();
+    shard_results[shard].return_code = CL_CLEAN;
+    shard_results[shard].virus_name[0] = '\0';
+    shard_results[shard].scanned = 0;
+    shard_controls[shard].thd = control->thd;
+    shard_controls[shard].timeout_ms = control->timeout_ms;
+
+    scan_map(data != nullptr
+                 ? cl_fmap_open_memory(data, size)
+                 : cl_fmap_open_handle((void *)(intptr_t)fd, 0, size,
+                                       pread_file, 1),
+             shards[shard], file_name, options, &shard_results[shard],
+             &shard_controls[shard]);
+    shard_us[shard] = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - shard_start)
+                          .count();
+  };
+
+  {
+    Scan_batch batch(shards.size(), &shard_pool);
+    for (size_t shard = 1; shard < shards.size(); shard++)
+      batch.submit([&scan_shard, shard] { scan_shard(shard); });
+    scan_shard(0);
+  }
+
+  unsigned long long busy_us = 0;
+  result->return_code = CL_CLEAN;
+  result->scanned = 0;
+  for (size_t shard = 0; shard < shards.size(); shard++) {
+    const struct scan_result &shard_result = shard_results[shard];
+    busy_us += shard_us[shard];
+    result->scanned = std::max(result->scanned, shard_result.scanned);
+    if (shard_result.return_code == CL_CLEAN ||
+        result->return_code == CL_VIRUS ||
+        (result->return_code != CL_CLEAN &&
+         shard_result.return_code != CL_VIRUS))
+      continue;
+    result->return_code = shard_result.return_code;
+    memcpy(result->virus_name, shard_result.virus_name,
+           sizeof(result->virus_name));
+    control->aborted = shard_controls[shard].aborted;
+  }
+
+  stats_add(STAT_SHARDED_SCANS);
+  stats_add(STAT_SHARDED_SCAN_TIME_US,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+  stats_add(STAT_SHARD_SCAN_TIME_US, busy_us);
+}
+
+/* Bytes in the unit of scan_result.scanned, rounded up */
+static long unsigned int scanned_blocks(size_t bytes) {
+  return (bytes + CL_COUNT_PRECISION - 1) / CL_COUNT_PRECISION;
+}
+
+static struct scan_result scan_payload(const char *data, size_t data_size,
+                                       const Scan_profile *profile,
+                                       Scan_control *control)
+{
+  struct scan_result result = {0, "", 0, wait_for_engine(engine_wait_timeout),
+                               data_size};
+  Cache_key key;
+  bool cacheable = false;
+
+  if (!result.engine) {
+    result.return_code = CL_ENULLARG;
+    return result;
+  }
+  if (profile_engine(*result.engine, profile) == nullptr) {
+    result.return_code = VIRUS_ENOHASHENGINE;
+    return result;
+  }
+
+  /*
+   * Identical payloads were already scanned by this engine generation,
+   * hashing them is much cheaper than running ClamAV again. The cache only
+   * knows the verdict, not what a scan context collects. The clean store
+   * outlives the server, it is looked up after the cache.
+   */
+  if ((cache_enabled() || clean_store_enabled()) &&
+      control->context == nullptr) {
+    cacheable = cache_make_key(data, data_size, profile, &key);
+    if (cacheable && cache_enabled() &&
+        cache_lookup(key, result.engine->generation, &result.return_code,
+                     result.virus_name, sizeof(result.virus_name))) {
+      result.scanned = scanned_blocks(data_size);
+      return result;
+    }
+    if (cacheable && clean_store_enabled() &&
+        clean_store_lookup(key, result.engine->database_tag)) {
+      result.return_code = CL_CLEAN;
+      result.scanned = scanned_blocks(data_size);
+      if (cache_enabled())
+        cache_store(key, result.engine->generation, result.return_code,
+                    result.virus_name);
+      return result;
+    }
+  }
+
+  if (scan_on_shards(result, profile, data_size, control))
+    scan_shards(data, -1, data_size, nullptr,
+                scan_options(profile, data, data_size, data_size), &result,
+                control);
+  else
+    scan_map(cl_fmap_open_memory(data, data_size),
+             profile_engine(*result.engine, profile), nullptr,
+             scan_options(profile, data, data_size, data_size), &result,
+             control);
+
+  /* Errors and aborted scans are not verdicts, they are not cached */
+  if (cacheable && cache_enabled() &&
+      (result.return_code == CL_CLEAN || result.return_code == CL_VIRUS))
+    cache_store(key, result.engine->generation, result.return_code,
+                result.virus_name);
+  if (cacheable && clean_store_enabled() && result.return_code == CL_CLEAN)
+    clean_store_insert(key, result.engine->database_tag);
+
   //just a fake bug
   if (strcmp(data, "bug-stuck") == 0) {
     mysql_mutex_lock(&LOCK_virus_data);
@@ -223,6 +1222,175 @@ struct scan_result scan_data(const char *data, size_t data_size)
   return result;
 }
 
+/*
+ * Scan a payload and account for it in the scan status variables and
+ * performance_schema.viruscan_scan_latency, cache hits included. Calls that
+ * found no engine did not scan anything. Without control, the scan has the
+ * viruscan.scan_timeout deadline and no session.
+ */
+struct scan_result scan_data(const char *data, size_t data_size,
+                             const Scan_profile *profile,
+                             Scan_control *control)
+{
+  Scan_control default_control;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  struct scan_result result = scan_payload(
+      data, data_size, profile,
+      control != nullptr ? control : &default_control);
+
+  if (result.engine)
+    record_scan(
+        data_size, result.return_code,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+
+  return result;
+}
+
+/*
+ * Scan an open file. ClamAV reads the pages it needs through pread_file()
+ * and ages them out, the file is never copied in the server memory as a
+ * whole. Files are not cached: hashing them would read them twice.
+ */
+struct scan_result scan_file(int fd, size_t file_size, const char *file_name,
+                             const Scan_profile *profile,
+                             Scan_control *control = nullptr)
+{
+  Scan_control default_control;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  struct scan_result result = {0, "", 0, wait_for_engine(engine_wait_timeout),
+                               file_size};
+
+  if (!result.engine) {
+    result.return_code = CL_ENULLARG;
+    return result;
+  }
+  if (profile_engine(*result.engine, profile) == nullptr) {
+    result.return_code = VIRUS_ENOHASHENGINE;
+    return result;
+  }
+
+  /* The auto profile sniffs the head of the file, the rest is not read */
+  char head[VIRUS_SNIFF_HEAD_SIZE];
+  ssize_t head_length = 0;
+  if (profile->sniff) {
+    head_length = pread(fd, head, sizeof(head), 0);
+    if (head_length < 0) head_length = 0;
+  }
+
+  if (control == nullptr) control = &default_control;
+  if (scan_on_shards(result, profile, file_size, control))
+    scan_shards(nullptr, fd, file_size, file_name,
+                scan_options(profile, head, head_length, file_size), &result,
+                control);
+  else
+    scan_map(cl_fmap_open_handle((void *)(intptr_t)fd, 0, file_size,
+                                 pread_file, 1),
+             profile_engine(*result.engine, profile), file_name,
+             scan_options(profile, head, head_length, file_size), &result,
+             control);
+
+  record_scan(file_size, result.return_code,
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count());
+  return result;
+}
+
+/*
+ * Resolve a path of the server and check it against secure_file_priv, like
+ * LOAD_FILE() does: NULL disables the access to files, an empty value
+ * allows any path.
+ */
+static bool secure_file_path(const char *path, std::string *resolved,
+                             std::string *error) {
+  char secure_file_priv[PATH_MAX + 1];
+  char *value = secure_file_priv;
+  size_t length = sizeof(secure_file_priv) - 1;
+  char real_path[PATH_MAX];
+
+  if (mysql_service_component_sys_variable_register->get_variable(
+          "mysql_server", "secure_file_priv", (void **)&value, &length)) {
+    *error = "cannot read secure_file_priv";
+    return false;
+  }
+  std::string allowed(value, length);
+
+  if (allowed == "NULL") {
+    *error = "the access to files is disabled by secure_file_priv";
+    return false;
+  }
+
+  if (realpath(path, real_path) == nullptr) {
+    *error = std::string(path) + ": " + strerror(errno);
+    return false;
+  }
+  *resolved = real_path;
+
+  if (allowed.empty()) return true;
+
+  char real_allowed[PATH_MAX];
+  if (realpath(allowed.c_str(), real_allowed) != nullptr) {
+    allowed = real_allowed;
+    if (allowed.back() != '/') allowed += '/';
+    if (resolved->compare(0, allowed.size(), allowed) == 0 ||
+        *resolved + "/" == allowed)
+      return true;
+  }
+
+  *error = std::string(path) + " is not allowed by secure_file_priv";
+  return false;
+}
+
+/*
+ * List the regular files below a directory. Symbolic links are not followed,
+ * the walk never leaves the directory checked against secure_file_priv.
+ */
+static bool list_files(const std::string &root,
+                       std::vector<std::string> *files, std::string *error) {
+  std::vector<std::string> directories(1, root);
+
+  while (!directories.empty()) {
+    std::string directory = directories.back();
+    directories.pop_back();
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+      if (directory == root) {
+        *error = root + ": " + strerror(errno);
+        return false;
+      }
+      continue; /* counted as nothing, like a file that vanished */
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+
+      std::string path = directory + "/" + entry->d_name;
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+                                                                   : DT_LNK;
+      }
+
+      if (type == DT_DIR)
+        directories.push_back(path);
+      else if (type == DT_REG)
+        files->push_back(path);
+    }
+    closedir(dir);
+  }
+
+  return true;
+}
+
 bool have_virus_scan_privilege(void *opaque_thd) {
   // get the security context of the thread
   Security_context_handle ctx = nullptr;
@@ -239,35 +1407,547 @@ bool have_virus_scan_privilege(void *opaque_thd) {
   return false;
 }
 	
+static void get_user_host(MYSQL_THD thd, MYSQL_LEX_CSTRING *user,
+                          MYSQL_LEX_CSTRING *host) {
+  Security_context_handle ctx = nullptr;
+  mysql_service_mysql_thd_security_context->get(thd, &ctx);
+
+  mysql_service_mysql_security_context_options->get(ctx, "priv_user", user);
+  mysql_service_mysql_security_context_options->get(ctx, "priv_host", host);
+}
+
+/* The account used by the per-account admission limit, in a scratch */
+static const char *account_name(const MYSQL_LEX_CSTRING &user,
+                                const MYSQL_LEX_CSTRING &host,
+                                Scan_scratch *scratch) {
+  snprintf(scratch->account, sizeof(scratch->account), "%.*s@%.*s",
+           (int)user.length, user.str, (int)host.length, host.str);
+  return scratch->account;
+}
+
+/* Verdict of a scan cut short, nullptr for the others */
+static const char *aborted_verdict(int return_code) {
+  if (return_code == CL_ETIMEOUT)
+    return "timeout: the scan ran past its deadline";
+  if (return_code == CL_BREAK) return "aborted: the query was killed";
+  return nullptr;
+}
+
+/*
+ * Log a detection and keep it in performance_schema.viruscan_matches
+ */
+static void record_virus(const struct scan_result &result, const char *user,
+                         const char *host, const char *file = nullptr) {
+  char buf[1024];
+
+  if (file != nullptr)
+    snprintf(buf, 1024, "Virus found: %s in %s !!", result.virus_name, file);
+  else
+    snprintf(buf, 1024, "Virus found: %s !!", result.virus_name);
+  LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+  stats_add(STAT_VIRUS_FOUND);
+  PSI_int signature_psi = {(long)signature_status, false};
+
+  addVirus_element(time(nullptr), result.virus_name, user, host,
+                   clamav_version, signature_psi, file, result.size);
+}
+
+/*
+ * Scan one file of a virus_scan_directory() call. The kernel is told the
+ * file is read once, front to back: small files are read ahead as a whole
+ * before ClamAV asks for them, and the pages are dropped afterwards so that
+ * a staging directory does not push the server data out of the page cache.
+ */
+static void scan_directory_file(const std::string &path,
+                                const Scan_profile *profile, Scan_batch *batch,
+                                const std::string &user,
+                                const std::string &host) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (fd >= 0) close(fd);
+    batch->record(CL_EOPEN, nullptr);
+    return;
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (st.st_size <= VIRUS_DIRECTORY_READAHEAD)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+  struct scan_result result = scan_file(fd, st.st_size, path.c_str(), profile);
+
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  close(fd);
+
+  if (!result.engine) result.return_code = CL_ENULLARG;
+  if (result.return_code == CL_VIRUS)
+    record_virus(result, user.c_str(), host.c_str(), path.c_str());
+  batch->record(result.return_code, result.virus_name);
+}
+
 const char *udf_init = "udf_init", *my_udf = "my_udf",
            *my_udf_clear = "my_clear", *my_udf_add = "my_udf_add";
 
-static bool viruscan_udf_init(UDF_INIT *initid, UDF_ARGS *, char *) {
+static bool viruscan_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                              char *message) {
+  if (args->arg_count < 1 || args->arg_count > 3) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan() requires the data, an optional scan profile and "
+             "an optional timeout in milliseconds");
+    return true;
+  }
+  if (args->arg_count >= 2) args->arg_type[1] = STRING_RESULT;
+  if (args->arg_count == 3) args->arg_type[2] = INT_RESULT;
+
+  const char* name = "utf8mb4";
+  char *value = const_cast<char*>(name);
+  initid->ptr = const_cast<char *>(udf_init);
+  if (mysql_service_mysql_udf_metadata->result_set(
+          initid, "charset",
+          const_cast<char *>(value))) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
+    return false;
+  }
+  return 0;
+}
+
+static void viruscan_udf_deinit(__attribute__((unused)) UDF_INIT *initid) {
+  assert(initid->ptr == udf_init || initid->ptr == my_udf);
+}
+
+const char *viruscan_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
+                          unsigned long *length, char *is_null, char *error) {
+
+    MYSQL_THD thd;
+    mysql_service_mysql_current_thread_reader->get(&thd);
+
+    struct scan_result result;
+
+    if(!have_virus_scan_privilege(thd)) {
+       mysql_error_service_printf(
+            ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+            SCAN_PRIVILEGE_NAME);
+       *error = 1;
+       *is_null = 1;
+       return 0;
+    }
+
+    if (args->args[0] == nullptr) {
+      *is_null = 1;
+      return 0;
+    }
+
+    const Scan_profile *profile = default_scan_profile();
+    if (args->arg_count >= 2 && args->args[1] != nullptr) {
+      profile = find_scan_profile(args->args[1], args->lengths[1]);
+      if (profile == nullptr) {
+        mysql_error_service_printf(
+             ER_UDF_ERROR, 0, "virus_scan",
+             unknown_scan_profile_message());
+        *error = 1;
+        *is_null = 1;
+        return 0;
+      }
+    }
+
+    Scan_control control;
+    control.thd = thd;
+    /* NULL keeps viruscan.scan_timeout, 0 scans without deadline */
+    if (args->arg_count == 3 && args->args[2] != nullptr)
+      control.timeout_ms = (unsigned int)std::min(
+          std::max(*(long long *)args->args[2], 0LL), (long long)UINT_MAX);
+
+    // We need to get some info like user and host
+    MYSQL_LEX_CSTRING user;
+    MYSQL_LEX_CSTRING host;
+    get_user_host(thd, &user, &host);
+
+    Scan_scratch_ref scratch;
+    Scan_admission admission(account_name(user, host, scratch.get()), thd);
+    if (!admission.admitted()) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan",
+           admission.killed()
+               ? "aborted: the query was killed"
+               : "too many concurrent scans, no slot freed up in time");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    result = scan_data(args->args[0], args->lengths[0], profile, &control);
+    if (!result.engine) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan",
+           get_engine_state() == ENGINE_LOADING
+               ? "ClamAV engine is loading"
+               : "ClamAV engine is not available");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    if (result.return_code == CL_CLEAN) {
+      strncpy(outp, "clean: no virus found", *length);
+    } else if (result.return_code == CL_VIRUS) {
+      strncpy(outp, result.virus_name, *length);
+      record_virus(result, user.str, host.str);
+    } else if (aborted_verdict(result.return_code) != nullptr) {
+      strncpy(outp, aborted_verdict(result.return_code), *length);
+    } else {
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan",
+                                 scan_strerror(result.return_code));
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    *length = strlen(outp);
+    return const_cast<char *>(outp);
+}
+
+static bool virusfile_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                               char *message) {
+  if (args->arg_count < 1 || args->arg_count > 2) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_file() requires a path and an optional scan profile");
+    return true;
+  }
+  args->arg_type[0] = STRING_RESULT;
+  if (args->arg_count == 2) args->arg_type[1] = STRING_RESULT;
+
+  const char* name = "utf8mb4";
+  char *value = const_cast<char*>(name);
+  initid->ptr = const_cast<char *>(udf_init);
+  if (mysql_service_mysql_udf_metadata->result_set(
+          initid, "charset",
+          const_cast<char *>(value))) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
+    return false;
+  }
+  return 0;
+}
+
+static void virusfile_udf_deinit(__attribute__((unused)) UDF_INIT *initid) {
+  assert(initid->ptr == udf_init || initid->ptr == my_udf);
+}
+
+const char *virusfile_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
+                          unsigned long *length, char *is_null, char *error) {
+
+    MYSQL_THD thd;
+    mysql_service_mysql_current_thread_reader->get(&thd);
+
+    if(!have_virus_scan_privilege(thd)) {
+       mysql_error_service_printf(
+            ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+            SCAN_PRIVILEGE_NAME);
+       *error = 1;
+       *is_null = 1;
+       return 0;
+    }
+
+    if (args->args[0] == nullptr) {
+      *is_null = 1;
+      return 0;
+    }
+
+    const Scan_profile *profile = default_scan_profile();
+    if (args->arg_count == 2 && args->args[1] != nullptr) {
+      profile = find_scan_profile(args->args[1], args->lengths[1]);
+      if (profile == nullptr) {
+        mysql_error_service_printf(
+             ER_UDF_ERROR, 0, "virus_scan_file",
+             unknown_scan_profile_message());
+        *error = 1;
+        *is_null = 1;
+        return 0;
+      }
+    }
+
+    std::string path(args->args[0], args->lengths[0]);
+    std::string resolved, message;
+    if (!secure_file_path(path.c_str(), &resolved, &message)) {
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_file",
+                                 message.c_str());
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    int fd = open(resolved.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      message = path + ": " + strerror(errno);
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_file",
+                                 message.c_str());
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      message = path + ": not a regular file";
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_file",
+                                 message.c_str());
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    MYSQL_LEX_CSTRING user;
+    MYSQL_LEX_CSTRING host;
+    get_user_host(thd, &user, &host);
+
+    Scan_scratch_ref scratch;
+    Scan_admission admission(account_name(user, host, scratch.get()), thd);
+    if (!admission.admitted()) {
+      close(fd);
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_file",
+           admission.killed()
+               ? "aborted: the query was killed"
+               : "too many concurrent scans, no slot freed up in time");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    Scan_control control;
+    control.thd = thd;
+    struct scan_result result =
+        scan_file(fd, st.st_size, resolved.c_str(), profile, &control);
+    close(fd);
+
+    if (!result.engine) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_file",
+           get_engine_state() == ENGINE_LOADING
+               ? "ClamAV engine is loading"
+               : "ClamAV engine is not available");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    if (result.return_code == CL_CLEAN) {
+      strncpy(outp, "clean: no virus found", *length);
+    } else if (result.return_code == CL_VIRUS) {
+      strncpy(outp, result.virus_name, *length);
+      record_virus(result, user.str, host.str, resolved.c_str());
+    } else if (aborted_verdict(result.return_code) != nullptr) {
+      strncpy(outp, aborted_verdict(result.return_code), *length);
+    } else {
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_file",
+                                 scan_strerror(result.return_code));
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    *length = strlen(outp);
+    return const_cast<char *>(outp);
+}
+
+static bool virusdirectory_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                                    char *message) {
+  if (args->arg_count < 1 || args->arg_count > 2) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_directory() requires a path and an optional number "
+             "of threads");
+    return true;
+  }
+  args->arg_type[0] = STRING_RESULT;
+  if (args->arg_count == 2) args->arg_type[1] = INT_RESULT;
+
+  const char* name = "utf8mb4";
+  char *value = const_cast<char*>(name);
+  if (mysql_service_mysql_udf_metadata->result_set(
+          initid, "charset",
+          const_cast<char *>(value))) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
+    return true;
+  }
+
+  /* Holds the summary */
+  initid->ptr = reinterpret_cast<char *>(new std::string());
+  initid->max_length = 65535;
+  initid->maybe_null = true;
+  return false;
+}
+
+static void virusdirectory_udf_deinit(UDF_INIT *initid) {
+  delete reinterpret_cast<std::string *>(initid->ptr);
+}
+
+/*
+ * Scan the files below a directory on the scan pool. Every job takes the
+ * next file of the shared list until it is exhausted, so a thread that gets
+ * small files simply scans more of them.
+ */
+const char *virusdirectory_udf(UDF_INIT *initid, UDF_ARGS *args, char *,
+                               unsigned long *length, char *is_null,
+                               char *error) {
+
+    MYSQL_THD thd;
+    mysql_service_mysql_current_thread_reader->get(&thd);
+
+    if(!have_virus_scan_privilege(thd)) {
+       mysql_error_service_printf(
+            ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+            SCAN_PRIVILEGE_NAME);
+       *error = 1;
+       *is_null = 1;
+       return 0;
+    }
+
+    if (args->args[0] == nullptr) {
+      *is_null = 1;
+      return 0;
+    }
+
+    std::string path(args->args[0], args->lengths[0]);
+    std::string root, message;
+    std::vector<std::string> files;
+    if (!secure_file_path(path.c_str(), &root, &message) ||
+        !list_files(root, &files, &message)) {
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_directory",
+                                 message.c_str());
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    if (!wait_for_engine(engine_wait_timeout)) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_directory",
+           get_engine_state() == ENGINE_LOADING
+               ? "ClamAV engine is loading"
+               : "ClamAV engine is not available");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+
+    /* Never more jobs than pool workers or files */
+    size_t threads = scan_threads;
+    if (args->arg_count == 2 && args->args[1] != nullptr &&
+        *(long long *)args->args[1] > 0)
+      threads = std::min<size_t>(threads, *(long long *)args->args[1]);
+    threads = std::max<size_t>(1, std::min(threads, files.size()));
+
+    MYSQL_LEX_CSTRING user;
+    MYSQL_LEX_CSTRING host;
+    get_user_host(thd, &user, &host);
+    std::string user_name(user.str, user.length);
+    std::string host_name(host.str, host.length);
+
+    const Scan_profile *profile = default_scan_profile();
+    std::atomic<size_t> next_file{0};
+    Scan_batch batch(threads);
+
+    for (size_t i = 0; i < threads; i++) {
+      batch.submit([&] {
+        size_t file;
+        while ((file = next_file.fetch_add(1)) < files.size())
+          scan_directory_file(files[file], profile, &batch, user_name,
+                              host_name);
+      });
+    }
+
+    std::string *summary = reinterpret_cast<std::string *>(initid->ptr);
+    *summary = batch.summary("files");
+    *length = summary->length();
+    return summary->c_str();
+}
+
+/* Append a JSON string literal */
+static void json_append_string(std::string *json, const char *value) {
+  static const char hex[] = "0123456789abcdef";
+
+  json->push_back('"');
+  for (const unsigned char *p = (const unsigned char *)value; *p; p++) {
+    switch (*p) {
+      case '"':
+        json->append("\\\"");
+        break;
+      case '\\':
+        json->append("\\\\");
+        break;
+      case '\n':
+        json->append("\\n");
+        break;
+      case '\r':
+        json->append("\\r");
+        break;
+      case '\t':
+        json->append("\\t");
+        break;
+      default:
+        if (*p < 0x20) {
+          json->append("\\u00");
+          json->push_back(hex[*p >> 4]);
+          json->push_back(hex[*p & 0xf]);
+        } else {
+          json->push_back(*p);
+        }
+    }
+  }
+  json->push_back('"');
+}
+
+static bool virusjson_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                               char *message) {
+  if (args->arg_count < 1 || args->arg_count > 2) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_json() requires the data and an optional scan "
+             "profile");
+    return true;
+  }
+  if (args->arg_count == 2) args->arg_type[1] = STRING_RESULT;
+
   const char* name = "utf8mb4";
   char *value = const_cast<char*>(name);
-  initid->ptr = const_cast<char *>(udf_init);
   if (mysql_service_mysql_udf_metadata->result_set(
           initid, "charset",
           const_cast<char *>(value))) {
     LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
-    return false;
+    return true;
   }
-  return 0;
+
+  /* Holds the document */
+  initid->ptr = reinterpret_cast<char *>(new std::string());
+  initid->max_length = 65535;
+  initid->maybe_null = true;
+  return false;
 }
 
-static void viruscan_udf_deinit(__attribute__((unused)) UDF_INIT *initid) {
-  assert(initid->ptr == udf_init || initid->ptr == my_udf);
+static void virusjson_udf_deinit(UDF_INIT *initid) {
+  delete reinterpret_cast<std::string *>(initid->ptr);
 }
 
-const char *viruscan_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
-                          unsigned long *length, char *is_null, char *error) {
+/*
+ * Scan a payload once and describe everything ClamAV found:
+ *
+ * {"verdict": "infected", "matches": ["Eicar-Signature"],
+ *  "file_type": "CL_TYPE_TEXT_ASCII", "bytes": 68, "bytes_scanned": 4096,
+ *  "scan_time_us": 412, "engine_generation": 2, "signatures": 8671805}
+ *
+ * The verdict cache is bypassed, it does not keep the matches.
+ */
+const char *virusjson_udf(UDF_INIT *initid, UDF_ARGS *args, char *,
+                          unsigned long *length, char *is_null,
+                          char *error) {
 
     MYSQL_THD thd;
     mysql_service_mysql_current_thread_reader->get(&thd);
 
-    struct scan_result result;
-    char buf[1024];
-
     if(!have_virus_scan_privilege(thd)) {
        mysql_error_service_printf(
             ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
@@ -277,33 +1957,107 @@ const char *viruscan_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
        return 0;
     }
 
-    result = scan_data(args->args[0], args->lengths[0]);
-    if (result.return_code == 0) {
-      strncpy(outp, "clean: no virus found", *length);
-    } else {
-      strncpy(outp, result.virus_name, *length);
-      snprintf(buf, 1024, "Virus found: %s !!", result.virus_name);
-      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
-      virusfound_status++;
-      PSI_int signature_psi = {(long)signature_status, false};
+    if (args->args[0] == nullptr) {
+      *is_null = 1;
+      return 0;
+    }
+
+    const Scan_profile *profile = default_scan_profile();
+    if (args->arg_count == 2 && args->args[1] != nullptr) {
+      profile = find_scan_profile(args->args[1], args->lengths[1]);
+      if (profile == nullptr) {
+        mysql_error_service_printf(
+             ER_UDF_ERROR, 0, "virus_scan_json",
+             unknown_scan_profile_message());
+        *error = 1;
+        *is_null = 1;
+        return 0;
+      }
+    }
 
-      // We need to get some info like user and host
-      Security_context_handle ctx = nullptr;
-      mysql_service_mysql_thd_security_context->get(thd, &ctx);
-      MYSQL_LEX_CSTRING user;
-      MYSQL_LEX_CSTRING host;
+    MYSQL_LEX_CSTRING user;
+    MYSQL_LEX_CSTRING host;
+    get_user_host(thd, &user, &host);
+
+    Scan_scratch_ref scratch;
+    Scan_admission admission(account_name(user, host, scratch.get()), thd);
+    if (!admission.admitted()) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_json",
+           admission.killed()
+               ? "aborted: the query was killed"
+               : "too many concurrent scans, no slot freed up in time");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
 
-      mysql_service_mysql_security_context_options->get(ctx, "priv_user",
-                                                        &user);
+    Scan_context &context = scratch->context;
+    Scan_control control;
+    control.context = &context;
+    control.thd = thd;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    struct scan_result result =
+        scan_data(args->args[0], args->lengths[0], profile, &control);
+    unsigned long long scan_time_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+
+    if (!result.engine) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_json",
+           get_engine_state() == ENGINE_LOADING
+               ? "ClamAV engine is loading"
+               : "ClamAV engine is not available");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
 
-      mysql_service_mysql_security_context_options->get(ctx, "priv_host",
-                                                        &host);
-      addVirus_element(time(nullptr), result.virus_name,
-                                     user.str, host.str, clamav_version ,signature_psi);
+    if (result.return_code == CL_VIRUS) {
+      /* Without callback, the engine still reports the first match */
+      if (context.match_count == 0) context.add_match(result.virus_name);
+      record_virus(result, user.str, host.str);
     }
 
-    *length = strlen(outp);
-    return const_cast<char *>(outp);
+    std::string *json = reinterpret_cast<std::string *>(initid->ptr);
+    json->assign("{\"verdict\": ");
+    json_append_string(json, result.return_code == CL_CLEAN   ? "clean"
+                             : result.return_code == CL_VIRUS ? "infected"
+                             : result.return_code == CL_ETIMEOUT ? "timeout"
+                             : result.return_code == CL_BREAK    ? "aborted"
+                                                                 : "error");
+    if (result.return_code != CL_CLEAN && result.return_code != CL_VIRUS &&
+        aborted_verdict(result.return_code) == nullptr) {
+      json->append(", \"error\": ");
+      json_append_string(json, scan_strerror(result.return_code));
+    }
+    json->append(", \"matches\": [");
+    for (size_t i = 0; i < context.match_count; i++) {
+      if (i > 0) json->append(", ");
+      json_append_string(json, context.matches[i].c_str());
+    }
+    json->append("], \"file_type\": ");
+    if (context.file_type.empty())
+      json->append("null");
+    else
+      json_append_string(json, context.file_type.c_str());
+    /* Formatted in place, std::to_string() temporaries would allocate */
+    char numbers[256];
+    snprintf(numbers, sizeof(numbers),
+             ", \"bytes\": %lu, \"bytes_scanned\": %llu, "
+             "\"scan_time_us\": %llu, \"engine_generation\": %llu, "
+             "\"signatures\": %u}",
+             args->lengths[0],
+             (unsigned long long)result.scanned * CL_COUNT_PRECISION,
+             scan_time_us, result.engine->generation,
+             result.engine->signatures);
+    json->append(numbers);
+
+    *length = json->length();
+    return json->c_str();
 }
 
 static bool virusreload_udf_init(UDF_INIT *initid, UDF_ARGS *, char *) {
@@ -347,11 +2101,24 @@ const char *virusreload_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
     }
     snprintf(outp, *length, "No need to reload ClamAV engine");
     
-    if(cl_statchkdir(&signatureStat) == SIGNATURE_CHANGE) {
-      signatureNum = reload_engine();
-      cl_statfree(&signatureStat);
-      cl_statinidir(cl_retdbdir(), &signatureStat);
-      snprintf(outp, *length, "ClamAV engine reloaded with new virus database: %d signatures", signatureNum);
+    if(engine_signatures_changed() || engine_settings_changed()) {
+      if (reload_engine(&signatureNum)) {
+        snprintf(outp, *length, "ClamAV engine reloaded with new virus database: %d signatures", signatureNum);
+      } else {
+        Engine_ref engine = acquire_engine();
+        if (!engine) {
+          mysql_error_service_printf(
+               ER_UDF_ERROR, 0, "virus_reload_engine",
+               "ClamAV engine reload failed, no engine is loaded");
+          *error = 1;
+          *is_null = 1;
+          return 0;
+        }
+        snprintf(outp, *length,
+                 "ClamAV engine reload failed, still serving generation %llu: "
+                 "%u signatures",
+                 engine->generation, engine->signatures);
+      }
     }
 
     *length = strlen(outp);
@@ -359,18 +2126,593 @@ const char *virusreload_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
 }
 	
 
+/*
+ * State of one virus_scan_batch() group, kept in initid->ptr
+ */
+struct Batch_udf {
+  Scan_batch batch;
+  bool allowed;
+  std::string user;
+  std::string host;
+  std::string summary;
+
+  Batch_udf() : batch(2 * scan_threads) {}
+  /* Pending scans reference user and host */
+  ~Batch_udf() { batch.wait(); }
+};
+
+static bool virusbatch_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                                char *message) {
+  if (args->arg_count != 1) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_batch() requires exactly one argument");
+    return true;
+  }
+  args->arg_type[0] = STRING_RESULT;
+
+  const char* name = "utf8mb4";
+  char *value = const_cast<char*>(name);
+  if (mysql_service_mysql_udf_metadata->result_set(
+          initid, "charset",
+          const_cast<char *>(value))) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
+    return true;
+  }
+
+  MYSQL_THD thd;
+  mysql_service_mysql_current_thread_reader->get(&thd);
+
+  Batch_udf *state = new Batch_udf();
+  state->allowed = have_virus_scan_privilege(thd);
+  if (state->allowed) {
+    MYSQL_LEX_CSTRING user;
+    MYSQL_LEX_CSTRING host;
+    get_user_host(thd, &user, &host);
+    state->user.assign(user.str, user.length);
+    state->host.assign(host.str, host.length);
+  }
+
+  initid->ptr = reinterpret_cast<char *>(state);
+  initid->max_length = 65535;
+  initid->maybe_null = true;
+  return false;
+}
+
+static void virusbatch_udf_deinit(UDF_INIT *initid) {
+  /* Waits for the scans still running on the pool */
+  delete reinterpret_cast<Batch_udf *>(initid->ptr);
+}
+
+static void virusbatch_udf_clear(UDF_INIT *initid, unsigned char *,
+                                 unsigned char *) {
+  reinterpret_cast<Batch_udf *>(initid->ptr)->batch.reset();
+}
+
+static void virusbatch_udf_add(UDF_INIT *initid, UDF_ARGS *args,
+                               unsigned char *, unsigned char *) {
+  Batch_udf *state = reinterpret_cast<Batch_udf *>(initid->ptr);
+
+  if (!state->allowed || args->args[0] == nullptr) return;
+
+  /* The row buffer is reused by the server, the worker gets its own copy */
+  std::string payload(args->args[0], args->lengths[0]);
+
+  state->batch.submit([state, payload] {
+    struct scan_result result = scan_data(payload.data(), payload.size(),
+                                             default_scan_profile());
+    if (!result.engine) result.return_code = CL_ENULLARG;
+    if (result.return_code == CL_VIRUS)
+      record_virus(result, state->user.c_str(), state->host.c_str());
+    state->batch.record(result.return_code, result.virus_name);
+  });
+}
+
+const char *virusbatch_udf(UDF_INIT *initid, UDF_ARGS *, char *,
+                           unsigned long *length, unsigned char *is_null,
+                           unsigned char *error) {
+  Batch_udf *state = reinterpret_cast<Batch_udf *>(initid->ptr);
+
+  if (!state->allowed) {
+    mysql_error_service_printf(
+         ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+         SCAN_PRIVILEGE_NAME);
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  state->summary = state->batch.summary();
+  *length = state->summary.length();
+  return state->summary.c_str();
+}
+
+static bool virusasync_udf_init(UDF_INIT *, UDF_ARGS *args, char *message) {
+  if (args->arg_count != 1) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_async() requires exactly one argument");
+    return true;
+  }
+  args->arg_type[0] = STRING_RESULT;
+  return false;
+}
+
+static void virusasync_udf_deinit(UDF_INIT *) {}
+
+long long virusasync_udf(UDF_INIT *, UDF_ARGS *args, unsigned char *is_null,
+                         unsigned char *error) {
+  MYSQL_THD thd;
+  mysql_service_mysql_current_thread_reader->get(&thd);
+
+  if (!have_virus_scan_privilege(thd)) {
+    mysql_error_service_printf(
+         ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+         SCAN_PRIVILEGE_NAME);
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  if (args->args[0] == nullptr) {
+    *is_null = 1;
+    return 0;
+  }
+
+  MYSQL_LEX_CSTRING user;
+  MYSQL_LEX_CSTRING host;
+  get_user_host(thd, &user, &host);
+
+  Scan_scratch_ref scratch;
+  unsigned long long id =
+      ticket_create(account_name(user, host, scratch.get()), args->lengths[0]);
+  if (id == 0) {
+    mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_async",
+                               "the asynchronous scan queue is full");
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  /* The caller may commit and go away, the worker owns a copy */
+  std::string payload(args->args[0], args->lengths[0]);
+  std::string user_name(user.str, user.length);
+  std::string host_name(host.str, host.length);
+
+  async_pool.submit([id, payload, user_name, host_name] {
+    ticket_start(id);
+
+    struct scan_result result = scan_data(payload.data(), payload.size(),
+                                             default_scan_profile());
+    if (!result.engine) {
+      ticket_finish(id, TICKET_FAILED,
+                    "error: ClamAV engine is not available");
+    } else if (result.return_code == CL_VIRUS) {
+      record_virus(result, user_name.c_str(), host_name.c_str());
+      ticket_finish(id, TICKET_DONE, result.virus_name);
+    } else if (result.return_code == CL_CLEAN) {
+      ticket_finish(id, TICKET_DONE, "clean: no virus found");
+    } else {
+      std::string verdict = std::string("error: ") +
+                            scan_strerror(result.return_code);
+      ticket_finish(id, TICKET_FAILED, verdict.c_str());
+    }
+  });
+
+  return id;
+}
+
+static bool viruswait_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                               char *message) {
+  if (args->arg_count != 2) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_wait() requires a ticket and a timeout in seconds");
+    return true;
+  }
+  args->arg_type[0] = INT_RESULT;
+  args->arg_type[1] = INT_RESULT;
+
+  const char* name = "utf8mb4";
+  char *value = const_cast<char*>(name);
+  initid->ptr = const_cast<char *>(udf_init);
+  if (mysql_service_mysql_udf_metadata->result_set(
+          initid, "charset",
+          const_cast<char *>(value))) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
+    return true;
+  }
+  return false;
+}
+
+static void viruswait_udf_deinit(__attribute__((unused)) UDF_INIT *initid) {
+  assert(initid->ptr == udf_init);
+}
+
+/*
+ * Returns the verdict of a ticket once its scan is complete, or its state
+ * ("queued" or "scanning") if the timeout expires first.
+ */
+const char *viruswait_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
+                          unsigned long *length, char *is_null, char *error) {
+  MYSQL_THD thd;
+  mysql_service_mysql_current_thread_reader->get(&thd);
+
+  if (!have_virus_scan_privilege(thd)) {
+    mysql_error_service_printf(
+         ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+         SCAN_PRIVILEGE_NAME);
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  if (args->args[0] == nullptr) {
+    *is_null = 1;
+    return 0;
+  }
+
+  long long ticket_id = *(long long *)args->args[0];
+  long long timeout =
+      args->args[1] != nullptr ? *(long long *)args->args[1] : 0;
+  timeout = std::min(std::max(timeout, 0LL), 31536000LL);
+
+  MYSQL_LEX_CSTRING user;
+  MYSQL_LEX_CSTRING host;
+  get_user_host(thd, &user, &host);
+
+  Scan_scratch_ref scratch;
+  Scan_ticket ticket;
+  if (ticket_id <= 0 ||
+      !ticket_wait(ticket_id, account_name(user, host, scratch.get()),
+                   (unsigned long long)timeout * 1000, thd, &ticket)) {
+    mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_wait",
+                               "unknown or expired ticket");
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  if (ticket.state == TICKET_DONE || ticket.state == TICKET_FAILED)
+    strncpy(outp, ticket.verdict, *length);
+  else
+    strncpy(outp, ticket_state_name(ticket.state), *length);
+
+  *length = strlen(outp);
+  return const_cast<char *>(outp);
+}
+
+static bool virusstreamopen_udf_init(UDF_INIT *, UDF_ARGS *args,
+                                     char *message) {
+  if (args->arg_count > 1) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_stream_open() takes an optional scan profile");
+    return true;
+  }
+  if (args->arg_count == 1) args->arg_type[0] = STRING_RESULT;
+  return false;
+}
+
+static void virusstreamopen_udf_deinit(UDF_INIT *) {}
+
+/*
+ * Opens a scan stream of the account and returns its id
+ */
+long long virusstreamopen_udf(UDF_INIT *, UDF_ARGS *args,
+                              unsigned char *is_null, unsigned char *error) {
+  MYSQL_THD thd;
+  mysql_service_mysql_current_thread_reader->get(&thd);
+
+  if (!have_virus_scan_privilege(thd)) {
+    mysql_error_service_printf(
+         ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+         SCAN_PRIVILEGE_NAME);
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  const Scan_profile *profile = default_scan_profile();
+  if (args->arg_count == 1 && args->args[0] != nullptr) {
+    profile = find_scan_profile(args->args[0], args->lengths[0]);
+    if (profile == nullptr) {
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_stream_open",
+           unknown_scan_profile_message());
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    }
+  }
+
+  MYSQL_LEX_CSTRING user;
+  MYSQL_LEX_CSTRING host;
+  get_user_host(thd, &user, &host);
+
+  Scan_scratch_ref scratch;
+  unsigned long long id =
+      stream_open(account_name(user, host, scratch.get()), profile);
+  if (id == 0) {
+    mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_stream_open",
+                               "too many scan streams are open");
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+  return id;
+}
+
+static bool virusstreamfeed_udf_init(UDF_INIT *, UDF_ARGS *args,
+                                     char *message) {
+  if (args->arg_count != 2) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_stream_feed() requires a stream and a chunk");
+    return true;
+  }
+  args->arg_type[0] = INT_RESULT;
+  args->arg_type[1] = STRING_RESULT;
+  return false;
+}
+
+static void virusstreamfeed_udf_deinit(UDF_INIT *) {}
+
+/*
+ * Appends a chunk to a scan stream and returns the bytes fed so far. A NULL
+ * chunk appends nothing.
+ */
+long long virusstreamfeed_udf(UDF_INIT *, UDF_ARGS *args,
+                              unsigned char *is_null, unsigned char *error) {
+  MYSQL_THD thd;
+  mysql_service_mysql_current_thread_reader->get(&thd);
+
+  if (!have_virus_scan_privilege(thd)) {
+    mysql_error_service_printf(
+         ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+         SCAN_PRIVILEGE_NAME);
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  if (args->args[0] == nullptr) {
+    *is_null = 1;
+    return 0;
+  }
+
+  MYSQL_LEX_CSTRING user;
+  MYSQL_LEX_CSTRING host;
+  get_user_host(thd, &user, &host);
+
+  Scan_scratch_ref scratch;
+  unsigned long long total = 0;
+  const char *chunk = args->args[1] != nullptr ? args->args[1] : "";
+  size_t chunk_length = args->args[1] != nullptr ? args->lengths[1] : 0;
+
+  switch (stream_feed(*(long long *)args->args[0],
+                      account_name(user, host, scratch.get()), chunk,
+                      chunk_length, &total)) {
+    case STREAM_OK:
+      return total;
+    case STREAM_BUSY:
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_stream_feed",
+                                 "the stream is being fed by another call");
+      break;
+    case STREAM_ERROR:
+      mysql_error_service_printf(
+           ER_UDF_ERROR, 0, "virus_scan_stream_feed",
+           "cannot write the stream to the server tmpdir, it is closed");
+      break;
+    default:
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_stream_feed",
+                                 "unknown or expired stream");
+      break;
+  }
+  *error = 1;
+  *is_null = 1;
+  return 0;
+}
+
+static bool virusstreamclose_udf_init(UDF_INIT *initid, UDF_ARGS *args,
+                                      char *message) {
+  if (args->arg_count != 1) {
+    snprintf(message, MYSQL_ERRMSG_SIZE,
+             "virus_scan_stream_close() requires a stream");
+    return true;
+  }
+  args->arg_type[0] = INT_RESULT;
+
+  const char* name = "utf8mb4";
+  char *value = const_cast<char*>(name);
+  initid->ptr = const_cast<char *>(udf_init);
+  if (mysql_service_mysql_udf_metadata->result_set(
+          initid, "charset",
+          const_cast<char *>(value))) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, "failed to set result charset");
+    return true;
+  }
+  return false;
+}
+
+static void virusstreamclose_udf_deinit(
+    __attribute__((unused)) UDF_INIT *initid) {
+  assert(initid->ptr == udf_init);
+}
+
+/*
+ * Scans what a stream was fed, closes it and returns the verdict, like
+ * virus_scan() does. A spilled stream is scanned from its file.
+ */
+const char *virusstreamclose_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
+                                 unsigned long *length, char *is_null,
+                                 char *error) {
+  MYSQL_THD thd;
+  mysql_service_mysql_current_thread_reader->get(&thd);
+
+  if (!have_virus_scan_privilege(thd)) {
+    mysql_error_service_printf(
+         ER_SPECIFIC_ACCESS_DENIED_ERROR, 0,
+         SCAN_PRIVILEGE_NAME);
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  if (args->args[0] == nullptr) {
+    *is_null = 1;
+    return 0;
+  }
+
+  MYSQL_LEX_CSTRING user;
+  MYSQL_LEX_CSTRING host;
+  get_user_host(thd, &user, &host);
+
+  Scan_scratch_ref scratch;
+  const char *account = account_name(user, host, scratch.get());
+  /* Before the stream is taken: a caller turned away can try again */
+  Scan_admission admission(account, thd);
+  if (!admission.admitted()) {
+    mysql_error_service_printf(
+         ER_UDF_ERROR, 0, "virus_scan_stream_close",
+         admission.killed()
+             ? "aborted: the query was killed"
+             : "too many concurrent scans, no slot freed up in time");
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  Scan_stream stream;
+  switch (stream_detach(*(long long *)args->args[0], account, &stream)) {
+    case STREAM_OK:
+      break;
+    case STREAM_BUSY:
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_stream_close",
+                                 "the stream is being fed by another call");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+    default:
+      mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_stream_close",
+                                 "unknown or expired stream");
+      *error = 1;
+      *is_null = 1;
+      return 0;
+  }
+
+  Scan_control control;
+  control.thd = thd;
+  struct scan_result result;
+  if (stream.fd >= 0) {
+    result = scan_file(stream.fd, stream.size, nullptr, stream.profile,
+                       &control);
+    close(stream.fd);
+  } else {
+    result = scan_data(stream.buffer.data(), stream.buffer.size(),
+                       stream.profile, &control);
+  }
+  if (!result.engine) {
+    mysql_error_service_printf(
+         ER_UDF_ERROR, 0, "virus_scan_stream_close",
+         get_engine_state() == ENGINE_LOADING
+             ? "ClamAV engine is loading"
+             : "ClamAV engine is not available");
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  if (result.return_code == CL_CLEAN) {
+    strncpy(outp, "clean: no virus found", *length);
+  } else if (result.return_code == CL_VIRUS) {
+    strncpy(outp, result.virus_name, *length);
+    record_virus(result, user.str, host.str);
+  } else if (aborted_verdict(result.return_code) != nullptr) {
+    strncpy(outp, aborted_verdict(result.return_code), *length);
+  } else {
+    mysql_error_service_printf(ER_UDF_ERROR, 0, "virus_scan_stream_close",
+                               scan_strerror(result.return_code));
+    *error = 1;
+    *is_null = 1;
+    return 0;
+  }
+
+  *length = strlen(outp);
+  return const_cast<char *>(outp);
+}
+
 } /* namespace udf_impl */
 
 
-static mysql_service_status_t viruscan_service_init() {
-  mysql_service_status_t result = 0;
+/*
+ * A failed INSTALL COMPONENT: the library is unloaded next, nothing of it
+ * may keep running. Everything viruscan_service_init() set up before the
+ * failure is torn down, the UDFs first so that no new call comes in.
+ */
+static mysql_service_status_t abort_service_init() {
+  if (list != nullptr) {
+    list->unregister();
+    delete list;
+    list = nullptr;
+  }
+
+  async_pool.stop();
+  shard_pool.stop();
+  scan_pool.stop();
+  stop_signature_watcher();
+  stop_engine_loader();
+  release_engine();
+
+  unregister_status_variables();
+  unregister_system_variables();
+
+  cleanup_virus_data();
+  cleanup_virus_summary();
+  cleanup_tickets();
+  cleanup_streams();
+  cleanup_cache();
+  cleanup_clean_store();
+  cleanup_admission();
+  cleanup_scratch_pool();
+
+  mysql_service_dynamic_privilege_register->unregister_privilege(
+      SCAN_PRIVILEGE_NAME, strlen(SCAN_PRIVILEGE_NAME));
 
+  mysql_mutex_destroy(&LOCK_virus_data);
+  mysql_mutex_destroy(&LOCK_engine_reload);
+  mysql_mutex_destroy(&LOCK_engine_loaded);
+  mysql_cond_destroy(&COND_engine_loaded);
+  mysql_mutex_destroy(&LOCK_database_settings);
+
+  return 1;
+}
+
+static mysql_service_status_t viruscan_service_init() {
   log_bi = mysql_service_log_builtins;
   log_bs = mysql_service_log_builtins_string;
 
   LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, "initializing...");
-  mysql_mutex_register("virus_scan", virus_data_mutex, 1);
+  mysql_mutex_register("virus_scan", virus_data_mutex,
+                       sizeof(virus_data_mutex) / sizeof(virus_data_mutex[0]));
+  mysql_cond_register("virus_scan", virus_data_cond,
+                      sizeof(virus_data_cond) / sizeof(virus_data_cond[0]));
+  mysql_mutex_init(key_mutex_engine_reload, &LOCK_engine_reload, nullptr);
+  mysql_mutex_init(key_mutex_engine_loaded, &LOCK_engine_loaded, nullptr);
+  mysql_cond_init(key_cond_engine_loaded, &COND_engine_loaded);
+  mysql_mutex_init(key_mutex_virus_data, &LOCK_virus_data, nullptr);
+  mysql_mutex_init(key_mutex_database_settings, &LOCK_database_settings,
+                   nullptr);
+  init_virus_share(&virus_st_share);
+  init_queue_share(&queue_st_share);
+  init_latency_share(&latency_st_share);
+  init_database_share(&database_st_share);
+  init_summary_share(&summary_st_share);
+  init_virus_data();
+  init_virus_summary();
+  init_cache();
+  init_admission();
   register_status_variables();
+  register_system_variables();
+  /* The values given at startup, SET GLOBAL goes through the callbacks */
+  database_strings_changed();
+  /* Needs viruscan.clean_store_file, opened before the first engine load */
+  init_clean_store();
 
   cl_error_t rv;
   rv = cl_init(CL_INIT_DEFAULT);
@@ -385,14 +2727,27 @@ static mysql_service_status_t viruscan_service_init() {
     LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, buf);
   }
 
-  struct cl_engine *cl_engine_new(void);
-  reload_engine();
+  /*
+   * Loading and compiling the signatures takes seconds, do it in the
+   * background so that INSTALL COMPONENT and the server startup don't wait.
+   */
+  start_engine_loader();
+  start_signature_watcher();
+
+  scan_pool.start(scan_threads, scan_threads * VIRUS_POOL_QUEUE_PER_THREAD);
+  /* Never blocks: there can't be more pending scans than tickets */
+  init_tickets();
+  init_streams();
+  async_pool.start(async_threads, async_queue_size);
+  /* The caller scans the first shard */
+  shard_pool.start(engine_shards > 1 ? engine_shards - 1 : 0,
+                   engine_shards * VIRUS_POOL_QUEUE_PER_THREAD);
 
   // Registration of the privilege
   if (mysql_service_dynamic_privilege_register->register_privilege(SCAN_PRIVILEGE_NAME, strlen(SCAN_PRIVILEGE_NAME))) {
           LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
                     "could not register privilege 'VIRUS_SCAN'.");
-          result = 1;
+          return abort_service_init();
   } else {
           LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG,
                     "new privilege 'VIRUS_SCAN' has been registered successfully.");
@@ -404,58 +2759,114 @@ static mysql_service_status_t viruscan_service_init() {
                        (Udf_func_any)udf_impl::viruscan_udf,
                        udf_impl::viruscan_udf_init,
                        udf_impl::viruscan_udf_deinit)) {
-    delete list;
-    return 1; /* failure: one of the UDF registrations failed */
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_json", Item_result::STRING_RESULT,
+                       (Udf_func_any)udf_impl::virusjson_udf,
+                       udf_impl::virusjson_udf_init,
+                       udf_impl::virusjson_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_file", Item_result::STRING_RESULT,
+                       (Udf_func_any)udf_impl::virusfile_udf,
+                       udf_impl::virusfile_udf_init,
+                       udf_impl::virusfile_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_directory", Item_result::STRING_RESULT,
+                       (Udf_func_any)udf_impl::virusdirectory_udf,
+                       udf_impl::virusdirectory_udf_init,
+                       udf_impl::virusdirectory_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
   }
 
   if (list->add_scalar("virus_reload_engine", Item_result::STRING_RESULT,
                        (Udf_func_any)udf_impl::virusreload_udf,
                        udf_impl::virusreload_udf_init,
                        udf_impl::virusreload_udf_deinit)) {
-    delete list;
-    return 1; /* failure: one of the UDF registrations failed */
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_async", Item_result::INT_RESULT,
+                       (Udf_func_any)udf_impl::virusasync_udf,
+                       udf_impl::virusasync_udf_init,
+                       udf_impl::virusasync_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_wait", Item_result::STRING_RESULT,
+                       (Udf_func_any)udf_impl::viruswait_udf,
+                       udf_impl::viruswait_udf_init,
+                       udf_impl::viruswait_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_stream_open", Item_result::INT_RESULT,
+                       (Udf_func_any)udf_impl::virusstreamopen_udf,
+                       udf_impl::virusstreamopen_udf_init,
+                       udf_impl::virusstreamopen_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_stream_feed", Item_result::INT_RESULT,
+                       (Udf_func_any)udf_impl::virusstreamfeed_udf,
+                       udf_impl::virusstreamfeed_udf_init,
+                       udf_impl::virusstreamfeed_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_scalar("virus_scan_stream_close", Item_result::STRING_RESULT,
+                       (Udf_func_any)udf_impl::virusstreamclose_udf,
+                       udf_impl::virusstreamclose_udf_init,
+                       udf_impl::virusstreamclose_udf_deinit)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
+  }
+
+  if (list->add_aggregate("virus_scan_batch", Item_result::STRING_RESULT,
+                          (Udf_func_any)udf_impl::virusbatch_udf,
+                          udf_impl::virusbatch_udf_init,
+                          udf_impl::virusbatch_udf_deinit,
+                          udf_impl::virusbatch_udf_add,
+                          udf_impl::virusbatch_udf_clear)) {
+    return abort_service_init(); /* one of the UDF registrations failed */
   }
 
-  mysql_mutex_init(key_mutex_virus_data, &LOCK_virus_data, nullptr);
-  init_virus_share(&virus_st_share);
-  init_virus_data();
   share_list[0] = &virus_st_share;
+  share_list[1] = &queue_st_share;
+  share_list[2] = &latency_st_share;
+  share_list[3] = &database_st_share;
+  share_list[4] = &summary_st_share;
   if (mysql_service_pfs_plugin_table_v1->add_tables(&share_list[0],
                                                  share_list_count)) {
     LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
                     "PFS table has NOT been registered successfully!");
-    mysql_mutex_destroy(&LOCK_virus_data);
-    return 1;
+    return abort_service_init();
   } else{
     LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG,
                     "PFS table has been registered successfully.");
   }
 
-  return result;
+  return 0;
 }
 
 static mysql_service_status_t viruscan_service_deinit() {
   mysql_service_status_t result = 0;
 
-  cleanup_virus_data();
-
-  cl_engine_free(engine);
-
-  unregister_status_variables();
-
-  if (mysql_service_dynamic_privilege_register->unregister_privilege(SCAN_PRIVILEGE_NAME, strlen(SCAN_PRIVILEGE_NAME))) {
-          LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
-                    "could not unregister privilege 'VIRUS_SCAN'.");
-          result = 1;
-  } else {
-          LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG,
-                    "privilege 'VIRUS_SCAN' has been unregistered successfully.");
-  }
-
+  /* Nothing is torn down while the functions can still be called */
   if (list->unregister()) return 1; /* failure: some UDFs still in use */
 
   delete list;
 
+  async_pool.stop();
+  shard_pool.stop();
+  scan_pool.stop();
+  stop_signature_watcher();
+  stop_engine_loader();
+  release_engine();
+
   if (mysql_service_pfs_plugin_table_v1->delete_tables(&share_list[0],
                                                     share_list_count)) {
     LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
@@ -466,10 +2877,34 @@ static mysql_service_status_t viruscan_service_deinit() {
                     "PFS table has been removed successfully.");
   }
 
+  unregister_status_variables();
+  unregister_system_variables();
+
+  cleanup_virus_data();
+  cleanup_virus_summary();
+  cleanup_tickets();
+  cleanup_streams();
+  cleanup_cache();
+  cleanup_clean_store();
+  cleanup_admission();
+  cleanup_scratch_pool();
+
+  if (mysql_service_dynamic_privilege_register->unregister_privilege(SCAN_PRIVILEGE_NAME, strlen(SCAN_PRIVILEGE_NAME))) {
+          LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
+                    "could not unregister privilege 'VIRUS_SCAN'.");
+          result = 1;
+  } else {
+          LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG,
+                    "privilege 'VIRUS_SCAN' has been unregistered successfully.");
+  }
 
   LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, "uninstalled.");
 
   mysql_mutex_destroy(&LOCK_virus_data);
+  mysql_mutex_destroy(&LOCK_engine_reload);
+  mysql_mutex_destroy(&LOCK_engine_loaded);
+  mysql_cond_destroy(&COND_engine_loaded);
+  mysql_mutex_destroy(&LOCK_database_settings);
 
   return result;
 }
@@ -483,17 +2918,22 @@ BEGIN_COMPONENT_REQUIRES(viruscan_service)
     REQUIRES_SERVICE(dynamic_privilege_register),
     REQUIRES_SERVICE(mysql_udf_metadata),
     REQUIRES_SERVICE(udf_registration),
+    REQUIRES_SERVICE(udf_registration_aggregate),
     REQUIRES_SERVICE(mysql_thd_security_context),
     REQUIRES_SERVICE(mysql_security_context_options),
     REQUIRES_SERVICE(global_grants_check),
     REQUIRES_SERVICE(mysql_current_thread_reader),
     REQUIRES_SERVICE(mysql_runtime_error),
     REQUIRES_SERVICE(status_variable_registration),
+    REQUIRES_SERVICE(component_sys_variable_register),
+    REQUIRES_SERVICE(component_sys_variable_unregister),
     REQUIRES_SERVICE(pfs_plugin_table_v1),
     REQUIRES_SERVICE_AS(pfs_plugin_column_integer_v1, pfs_integer),
+    REQUIRES_SERVICE_AS(pfs_plugin_column_bigint_v1, pfs_bigint),
     REQUIRES_SERVICE_AS(pfs_plugin_column_string_v2, pfs_string),
     REQUIRES_SERVICE_AS(pfs_plugin_column_timestamp_v2, pfs_timestamp),
-    REQUIRES_MYSQL_MUTEX_SERVICE, 
+    REQUIRES_MYSQL_MUTEX_SERVICE,
+    REQUIRES_MYSQL_COND_SERVICE,
 END_COMPONENT_REQUIRES();
 
 /* A list of metadata to describe the Component. */
@@ -21,6 +21,7 @@
 #include <mysql/components/component_implementation.h>
 #include <mysql/components/services/log_builtins.h> /* LogComponentErr */
 #include <mysqld_error.h>                           /* Errors */
+#include <mysql_com.h>                              /* MYSQL_ERRMSG_SIZE */
 #include <mysql/components/services/dynamic_privilege.h>
 #include <mysql/components/services/mysql_current_thread_reader.h>
 #include <mysql/components/services/udf_metadata.h>
@@ -30,18 +31,31 @@
 #include <mysql/components/services/component_status_var_service.h>
 #include <mysql/components/services/pfs_plugin_table_service.h>
 #include <mysql/components/services/mysql_mutex.h>
-
+#include <mysql/components/services/mysql_cond.h>
+#include <mysql/components/services/component_sys_var_service.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <functional>
 #include <list>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <clamav.h>
 
+#include <my_inttypes.h>
 #include <my_systime.h>
 
 extern REQUIRES_SERVICE_PLACEHOLDER(log_builtins);
 extern REQUIRES_SERVICE_PLACEHOLDER(log_builtins_string);
 extern REQUIRES_SERVICE_PLACEHOLDER(dynamic_privilege_register);
 extern REQUIRES_SERVICE_PLACEHOLDER(udf_registration);
+extern REQUIRES_SERVICE_PLACEHOLDER(udf_registration_aggregate);
 extern REQUIRES_SERVICE_PLACEHOLDER(mysql_udf_metadata);
 
 extern REQUIRES_SERVICE_PLACEHOLDER(mysql_current_thread_reader);
@@ -52,13 +66,17 @@ extern REQUIRES_SERVICE_PLACEHOLDER(global_grants_check);
 extern REQUIRES_SERVICE_PLACEHOLDER(mysql_runtime_error);
 
 extern REQUIRES_SERVICE_PLACEHOLDER(status_variable_registration);
+extern REQUIRES_SERVICE_PLACEHOLDER(component_sys_variable_register);
+extern REQUIRES_SERVICE_PLACEHOLDER(component_sys_variable_unregister);
 
 extern REQUIRES_SERVICE_PLACEHOLDER(pfs_plugin_table_v1);
 extern REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_integer_v1, pfs_integer);
+extern REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_bigint_v1, pfs_bigint);
 extern REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_string_v2, pfs_string);
 extern REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_timestamp_v2, pfs_timestamp);
 
 extern REQUIRES_MYSQL_MUTEX_SERVICE_PLACEHOLDER;
+extern REQUIRES_MYSQL_COND_SERVICE_PLACEHOLDER;
 
 
 extern SERVICE_TYPE(log_builtins) * log_bi;
@@ -68,26 +86,718 @@ extern SERVICE_TYPE(log_builtins_string) * log_bs;
 /* Global share pointer for pfs_viruscan_matches table */
 extern PFS_engine_table_share_proxy viruscan_st_share;
 
-/* Maximum number of rows in the table */
-// #define VIRUS_MAX_ROWS 1024
+/* Default number of rows in the table, see viruscan.matches_size */
 #define VIRUS_MAX_ROWS 10
-#define VIRUS_NAME_MAX_LENGTH 4 * 100
-#define USERNAME_MAX_LENGTH 4 *32
-#define HOSTNAME_MAX_LENGTH 4* 255
+/* The ring is allocated at startup, a record is about 1.5 KB */
+#define VIRUS_MATCHES_MAX_SIZE 65536
+#define VIRUS_NAME_MAX_LENGTH (4 * 100)
+#define USERNAME_MAX_LENGTH (4 * 32)
+#define HOSTNAME_MAX_LENGTH (4 * 255)
+/* user@host */
+#define VIRUS_ACCOUNT_MAX_LENGTH (USERNAME_MAX_LENGTH + HOSTNAME_MAX_LENGTH + 1)
+#define ENGINE_VERSION_MAX_LENGTH 16
+#define FILE_NAME_MAX_LENGTH 1024
+
+/*
+ * ClamAV engine limits, 0 keeps the ClamAV default. They are applied when an
+ * engine is built, so a change takes effect at the next reload.
+ */
+struct Engine_limits {
+  unsigned long long max_filesize = 0;
+  unsigned long long max_scansize = 0;
+  unsigned int max_recursion = 0;
+  unsigned int max_files = 0;
+  /* milliseconds */
+  unsigned int max_scantime = 0;
+
+  bool operator==(const Engine_limits &other) const {
+    return max_filesize == other.max_filesize &&
+           max_scansize == other.max_scansize &&
+           max_recursion == other.max_recursion &&
+           max_files == other.max_files && max_scantime == other.max_scantime;
+  }
+};
+
+/*
+  Which signature databases are loaded, see viruscan.database_directory,
+  viruscan.database_include, viruscan.database_exclude and
+  viruscan.database_options
+*/
+struct Database_settings {
+  std::string directory;
+  std::string include;
+  std::string exclude;
+  unsigned long long options = CL_DB_STDOPT;
+  /* Also build an engine with the hash databases only */
+  bool hash_engine = false;
+  /* Also split the databases across this many engines, 0 or 1 for none */
+  unsigned int shards = 0;
+
+  bool operator==(const Database_settings &other) const {
+    return directory == other.directory && include == other.include &&
+           exclude == other.exclude && options == other.options &&
+           hash_engine == other.hash_engine && shards == other.shards;
+  }
+};
+
+enum database_status { DATABASE_LOADED, DATABASE_EXCLUDED, DATABASE_FAILED };
+
+struct Database_info {
+  std::string name;
+  unsigned int signatures = 0;
+  enum database_status status = DATABASE_LOADED;
+};
+
+/*
+ * A compiled ClamAV engine. Generations are published with an atomic
+ * shared_ptr swap by reload_engine(); every scan holds a reference for its
+ * whole duration so the engine is only freed once its last reader is done.
+ */
+struct Engine_generation {
+  struct cl_engine *engine = nullptr;
+  /* Hash signatures only, nullptr unless viruscan.hash_engine is ON */
+  struct cl_engine *hash_engine = nullptr;
+  /* The databases split across engines, empty unless viruscan.engine_shards */
+  std::vector<struct cl_engine *> shards;
+  /* Resident memory the shards took when they were built, in bytes */
+  unsigned long long shard_memory = 0;
+  unsigned long long generation = 0;
+  unsigned int signatures = 0;
+  unsigned int hash_signatures = 0;
+  /* Highest version of the loaded databases, CL_ENGINE_DB_VERSION */
+  unsigned int database_version = 0;
+  /*
+   * Identifies the verdicts of this engine across restarts: the ClamAV
+   * version, the databases with their versions, settings and limits
+   */
+  unsigned long long database_tag = 0;
+  /* The limits the engine was compiled with */
+  Engine_limits limits;
+  /* The databases it was built from */
+  Database_settings database_settings;
+  std::vector<Database_info> databases;
+
+  ~Engine_generation();
+};
+
+typedef std::shared_ptr<Engine_generation> Engine_ref;
+
+/*
+ * State of one scan, given to cl_scanmap_callback() as the context of the
+ * engine callbacks. Scans without context skip them.
+ */
+struct Scan_context {
+  /*
+   * Every signature matched, CL_SCAN_GENERAL_ALLMATCHES gives them all. Only
+   * the first match_count are valid: a reused context keeps its strings
+   * and their buffers.
+   */
+  std::vector<std::string> matches;
+  size_t match_count = 0;
+  /* CL_TYPE_* of the payload itself, not of its embedded files */
+  std::string file_type;
+
+  void reset() {
+    match_count = 0;
+    file_type.clear();
+  }
+
+  void add_match(const char *name) {
+    if (match_count == matches.size())
+      matches.emplace_back(name);
+    else
+      matches[match_count].assign(name);
+    match_count++;
+  }
+};
+
+/*
+ * Scan deadline, see viruscan.scan_timeout. The engine callbacks check it
+ * and the killed state of the session before each file, the payload and
+ * the files embedded in it: a scan is cut short between two files.
+ */
+#define VIRUS_SCAN_DEFAULT_TIMEOUT 0
+
+extern unsigned int scan_timeout;
+
+enum scan_abort { SCAN_NOT_ABORTED = 0, SCAN_TIMED_OUT, SCAN_KILLED };
+
+/* The context of the engine callbacks, given to every scan */
+struct Scan_control {
+  /* Details collected for virus_scan_json(), nullptr when not wanted */
+  Scan_context *context = nullptr;
+  /* KILL QUERY of this session aborts the scan, nullptr for none */
+  MYSQL_THD thd = nullptr;
+  /* Milliseconds, 0 for no deadline */
+  unsigned int timeout_ms = scan_timeout;
+  /* steady clock, in microseconds, set when the scan starts */
+  unsigned long long deadline_us = 0;
+  /* Set by the callbacks, once set every file left is skipped */
+  enum scan_abort aborted = SCAN_NOT_ABORTED;
+};
+
+/*
+ * Sharded engines, see viruscan.engine_shards. A payload of at least
+ * viruscan.shard_min_size bytes is scanned on every shard at once.
+ */
+#define VIRUS_ENGINE_SHARDS_MAX 32
+#define VIRUS_SHARD_DEFAULT_MIN_SIZE (1024ULL * 1024)
+
+extern unsigned int engine_shards;
+extern unsigned long long shard_min_size;
+
+enum engine_state {
+  ENGINE_NOT_LOADED = 0,
+  ENGINE_LOADING,
+  ENGINE_READY,
+  ENGINE_FAILED
+};
+
+extern unsigned int signature_status;
+extern char engine_state_status[16];
+extern unsigned long long engine_load_time_ms;
+extern unsigned int engine_wait_timeout;
+extern Engine_limits engine_limits;
+extern char *database_directory;
+extern char *database_include;
+extern char *database_exclude;
+extern unsigned long long database_options;
+extern bool hash_engine;
+extern mysql_mutex_t LOCK_engine_reload;
+extern mysql_mutex_t LOCK_engine_loaded;
+extern mysql_cond_t COND_engine_loaded;
+extern PSI_mutex_key key_mutex_engine_reload;
+extern PSI_mutex_key key_mutex_engine_loaded;
+extern mysql_mutex_t LOCK_database_settings;
+extern PSI_mutex_key key_mutex_database_settings;
+extern PSI_cond_key key_cond_engine_loaded;
+
+Engine_ref acquire_engine();
+Engine_ref wait_for_engine(unsigned int timeout_ms);
+enum engine_state get_engine_state();
+bool reload_engine(unsigned int *signatures = nullptr);
+bool engine_signatures_changed();
+bool database_read(size_t index, Database_info *database);
+size_t database_count();
+const char *database_status_name(enum database_status status);
+bool engine_settings_changed();
+void release_engine();
+void start_engine_loader();
+void stop_engine_loader();
+/* Called whenever one of the database string variables is set */
+void database_strings_changed();
+Database_settings current_database_settings();
+
+/*
+ * Automatic engine reload when the signature directory changes
+ */
+#define VIRUS_AUTO_RELOAD_DEFAULT_QUIET_PERIOD 10000
+#define VIRUS_TIMESTAMP_LENGTH 20
+
+extern bool auto_reload;
+extern unsigned int auto_reload_quiet_period;
+extern char signatures_changed_at[VIRUS_TIMESTAMP_LENGTH];
+extern char engine_reloaded_at[VIRUS_TIMESTAMP_LENGTH];
+
+void format_timestamp(time_t timestamp, char *buf, size_t size);
+void start_signature_watcher();
+void stop_signature_watcher();
+
+/*
+ * Scan profiles select the ClamAV parsers and heuristics used by a scan
+ */
+#define VIRUS_PROFILE_FAST 0
+#define VIRUS_PROFILE_DEFAULT 1
+#define VIRUS_PROFILE_PARANOID 2
+#define VIRUS_PROFILE_HASH 3
+#define VIRUS_PROFILE_AUTO 4
+#define VIRUS_PROFILE_COUNT 5
+
+struct Scan_profile {
+  const char *name;
+  struct cl_scan_options options;
+  /* Runs on the hash-only engine, fails without one */
+  bool hash_only;
+  /* Narrows the parsers to the content class of the payload */
+  bool sniff;
+};
+
+extern const Scan_profile scan_profiles[VIRUS_PROFILE_COUNT];
+/* Index in scan_profiles of the profile used when none is given */
+extern unsigned long scan_profile;
+extern TYPELIB scan_profile_typelib;
+
+const Scan_profile *find_scan_profile(const char *name, size_t length);
+/* Lists the names of scan_profiles */
+const char *unknown_scan_profile_message();
+const Scan_profile *default_scan_profile();
+
+/*
+ * Content sniffing: the class of a payload told by its leading bytes, and
+ * the parsers that can apply to it
+ */
+/* Bytes read from the start of a file to sniff it */
+#define VIRUS_SNIFF_HEAD_SIZE 1024
+/* Plain text up to this size is matched against the raw signatures only */
+#define VIRUS_SNIFF_TINY_SIZE 128
+
+enum content_class {
+  CONTENT_TINY_TEXT,
+  CONTENT_TEXT,
+  CONTENT_IMAGE,
+  CONTENT_PDF,
+  CONTENT_OLE2,
+  CONTENT_OOXML,
+  CONTENT_ARCHIVE,
+  CONTENT_EXECUTABLE,
+  CONTENT_UNKNOWN,
+  CONTENT_CLASS_COUNT
+};
+
+const char *content_class_name(enum content_class content);
+enum content_class sniff_content(const char *head, size_t head_length,
+                                 size_t size);
+struct cl_scan_options scan_options(const Scan_profile *profile,
+                                    const char *head, size_t head_length,
+                                    size_t size);
+
+/*
+ * A 'hash' scan without a hash engine: there is no hash database to run it
+ * on, see viruscan.hash_engine
+ */
+#define VIRUS_ENOHASHENGINE (CL_ELAST_ERROR + 1)
+
+/* cl_strerror(), and the errors of the component */
+const char *scan_strerror(int return_code);
+
+/*
+ * Holds the data of a virus scan
+ */
+struct scan_result
+{
+  int               return_code;
+  char              virus_name[VIRUS_NAME_MAX_LENGTH];
+  /* In CL_COUNT_PRECISION blocks, as cl_scanmap_callback() counts them */
+  long unsigned int scanned;
+  /* The generation that produced the verdict */
+  Engine_ref        engine;
+  /* Size of the payload or file */
+  size_t            size = 0;
+};
+
+namespace udf_impl {
+struct scan_result scan_data(const char *data, size_t data_size,
+                             const Scan_profile *profile,
+                             Scan_control *control = nullptr);
+const char *viruscan_udf(UDF_INIT *, UDF_ARGS *args, char *outp,
+                         unsigned long *length, char *is_null, char *error);
+} /* namespace udf_impl */
+
+/*
+ * Verdict cache, keyed by the SHA-256 of the payload and its length
+ */
+#define VIRUS_CACHE_SHARDS 16
+#define VIRUS_CACHE_DIGEST_LENGTH 32
+#define VIRUS_CACHE_DEFAULT_SIZE (16ULL * 1024 * 1024)
+
+struct Cache_key {
+  unsigned char digest[VIRUS_CACHE_DIGEST_LENGTH];
+  size_t length;
+  /* Profiles don't run the same parsers, their verdicts may differ */
+  const Scan_profile *profile;
+
+  bool operator==(const Cache_key &other) const {
+    return length == other.length && profile == other.profile &&
+           memcmp(digest, other.digest, sizeof(digest)) == 0;
+  }
+};
+
+extern unsigned long long cache_size;
+extern PSI_mutex_key key_mutex_virus_cache;
+
+void init_cache();
+void cleanup_cache();
+bool cache_enabled();
+bool cache_make_key(const char *data, size_t data_size,
+                    const Scan_profile *profile, Cache_key *key);
+bool cache_lookup(const Cache_key &key, unsigned long long generation,
+                  int *return_code, char *virus_name, size_t virus_name_size);
+void cache_store(const Cache_key &key, unsigned long long generation,
+                 int return_code, const char *virus_name);
+void cache_trim();
+void cache_get_stats(unsigned long long *hits, unsigned long long *misses,
+                     unsigned long long *memory);
+
+/*
+ * Known clean payloads, kept in a memory mapped file across restarts
+ */
+#define VIRUS_STORE_DEFAULT_SIZE (64ULL * 1024 * 1024)
+
+extern char *clean_store_file;
+extern unsigned long long clean_store_size;
+extern PSI_mutex_key key_mutex_virus_store;
+extern PSI_cond_key key_cond_virus_store;
+
+void init_clean_store();
+void cleanup_clean_store();
+bool clean_store_enabled();
+bool clean_store_lookup(const Cache_key &key, unsigned long long database_tag);
+void clean_store_insert(const Cache_key &key, unsigned long long database_tag);
+void clean_store_set_tag(unsigned long long database_tag);
+void clean_store_resize();
+void clean_store_get_stats(unsigned long long *hits,
+                           unsigned long long *misses,
+                           unsigned long long *entries);
+
+/*
+ * Worker threads scanning on behalf of virus_scan_batch() and friends
+ */
+#define VIRUS_POOL_QUEUE_PER_THREAD 4
+#define VIRUS_BATCH_MAX_NAMES 10
+/* virus_scan_directory() reads files up to this size ahead as a whole */
+#define VIRUS_DIRECTORY_READAHEAD (16 * 1024 * 1024)
+
+extern unsigned int scan_threads;
+extern PSI_mutex_key key_mutex_scan_pool;
+extern PSI_cond_key key_cond_scan_pool;
+extern PSI_mutex_key key_mutex_scan_batch;
+extern PSI_cond_key key_cond_scan_batch;
+
+class Scan_pool {
+ public:
+  void start(unsigned int threads, size_t queue_size);
+  void stop();
+
+  /* Blocks while the queue is full */
+  void submit(std::function<void()> job);
+
+ private:
+  void worker();
+
+  mysql_mutex_t m_lock;
+  mysql_cond_t m_not_empty;
+  mysql_cond_t m_not_full;
+  std::deque<std::function<void()>> m_jobs;
+  std::vector<std::thread> m_workers;
+  size_t m_capacity = 0;
+  bool m_stopping = false;
+};
+
+extern Scan_pool scan_pool;
+/* Scans the shards of a payload but the first, engine_shards - 1 threads */
+extern Scan_pool shard_pool;
+
+/*
+ * Asynchronous scans, see virus_scan_async() and virus_scan_wait()
+ */
+#define VIRUS_ASYNC_DEFAULT_THREADS 2
+#define VIRUS_ASYNC_DEFAULT_QUEUE_SIZE 1024
+/* Payload bytes held by queued and running tickets, 0 for no limit */
+#define VIRUS_ASYNC_DEFAULT_QUEUE_MAX_BYTES (256ULL * 1024 * 1024)
+
+/* A session waiting for something checks KILL QUERY this often */
+#define VIRUS_KILL_CHECK_INTERVAL 100
+
+enum ticket_state {
+  TICKET_FREE = 0,
+  TICKET_QUEUED,
+  TICKET_SCANNING,
+  TICKET_DONE,
+  TICKET_FAILED
+};
+
+struct Scan_ticket {
+  unsigned long long id = 0;
+  enum ticket_state state = TICKET_FREE;
+  char verdict[VIRUS_NAME_MAX_LENGTH] = "";
+  /* Only this account may wait for the ticket */
+  char account[VIRUS_ACCOUNT_MAX_LENGTH + 1] = "";
+  unsigned long long bytes = 0;
+  /* steady clock, in microseconds */
+  unsigned long long enqueued_us = 0;
+  unsigned long long started_us = 0;
+  unsigned long long finished_us = 0;
+};
+
+extern unsigned int async_threads;
+extern unsigned int async_queue_size;
+extern unsigned long long async_queue_max_bytes;
+extern Scan_pool async_pool;
+extern PSI_mutex_key key_mutex_virus_tickets;
+extern PSI_cond_key key_cond_virus_tickets;
+
+void init_tickets();
+void cleanup_tickets();
+/*
+  Returns 0 when all the slots hold pending tickets or when bytes would take
+  the pending payloads over viruscan.async_queue_max_bytes
+*/
+unsigned long long ticket_create(const char *account,
+                                 unsigned long long bytes);
+void ticket_start(unsigned long long id);
+void ticket_finish(unsigned long long id, enum ticket_state state,
+                   const char *verdict);
+/*
+  Returns early, the ticket still pending, when thd is killed. The tickets of
+  other accounts are not found.
+*/
+bool ticket_wait(unsigned long long id, const char *account,
+                 unsigned long long timeout_ms, MYSQL_THD thd,
+                 Scan_ticket *ticket);
+bool ticket_read(size_t index, Scan_ticket *ticket);
+size_t ticket_capacity();
+const char *ticket_state_name(enum ticket_state state);
+
+/*
+ * Streaming scans, see virus_scan_stream_open(), _feed() and _close()
+ */
+#define VIRUS_STREAM_DEFAULT_BUFFER_SIZE (1024ULL * 1024)
+#define VIRUS_STREAM_DEFAULT_MAX 64
+#define VIRUS_STREAM_DEFAULT_IDLE_TIMEOUT 600
+
+enum stream_status { STREAM_OK = 0, STREAM_UNKNOWN, STREAM_BUSY, STREAM_ERROR };
+
+/* What a stream was fed, in its buffer or, past its size, in a file */
+struct Scan_stream {
+  const Scan_profile *profile = nullptr;
+  std::string buffer;
+  /* Unlinked spill file, -1 while the buffer holds everything */
+  int fd = -1;
+  unsigned long long size = 0;
+};
+
+extern unsigned long long stream_buffer_size;
+extern unsigned int max_streams;
+extern unsigned int stream_idle_timeout;
+extern PSI_mutex_key key_mutex_virus_streams;
+
+void init_streams();
+void cleanup_streams();
+/* Returns 0 when every slot holds a stream in use */
+unsigned long long stream_open(const char *account,
+                               const Scan_profile *profile);
+enum stream_status stream_feed(unsigned long long id, const char *account,
+                               const char *data, size_t length,
+                               unsigned long long *total);
+/* Hands the stream over to the caller, who closes its fd */
+enum stream_status stream_detach(unsigned long long id, const char *account,
+                                 Scan_stream *stream);
+void stream_get_stats(unsigned long long *open, unsigned long long *spilled,
+                      unsigned long long *expired);
+
+class Scan_batch {
+ public:
+  explicit Scan_batch(size_t max_in_flight, Scan_pool *pool = &scan_pool);
+  ~Scan_batch();
+
+  /* Blocks while max_in_flight jobs of this batch are pending */
+  void submit(std::function<void()> job);
+  void wait();
+
+  void record(int return_code, const char *virus_name);
+  void reset();
+  /* unit: what was scanned, "rows" or "files" */
+  std::string summary(const char *unit = "rows");
+
+ private:
+  mysql_mutex_t m_lock;
+  mysql_cond_t m_done;
+  Scan_pool *m_pool;
+  size_t m_max_in_flight;
+  size_t m_in_flight = 0;
+
+  unsigned long long m_rows = 0;
+  unsigned long long m_infected = 0;
+  unsigned long long m_errors = 0;
+  std::vector<std::string> m_virus_names;
+};
+
+/*
+ * Admission control of the scans run on connection threads, see
+ * viruscan.max_concurrent_scans and viruscan.max_account_scans
+ */
+#define VIRUS_ADMISSION_DEFAULT_TIMEOUT 10000
+
+extern unsigned int max_concurrent_scans;
+extern unsigned int max_account_scans;
+extern unsigned int admission_timeout;
+extern PSI_mutex_key key_mutex_virus_admission;
+extern PSI_cond_key key_cond_virus_admission;
+
+void init_admission();
+void cleanup_admission();
+/* Grants queued scans a slot freed by a change of the limits */
+void admission_limits_changed();
+unsigned long long admission_queue_depth();
+
+/* Holds a scan slot, waiting for it in FIFO order, until destroyed */
+class Scan_admission {
+ public:
+  /* account must outlive the admission, KILL QUERY of thd ends the wait */
+  explicit Scan_admission(const char *account, MYSQL_THD thd = nullptr);
+  ~Scan_admission();
+
+  /*
+   * false when no slot was free before viruscan.admission_timeout, or the
+   * query was killed while waiting
+   */
+  bool admitted() const { return m_admitted; }
+  bool killed() const { return m_killed; }
+
+ private:
+  const char *m_account;
+  bool m_admitted = false;
+  bool m_killed = false;
+  /* Scans are not counted while there are no limits */
+  bool m_counted = false;
+};
+
+/*
+ * Scratch state of the scans run on connection threads, taken from a fixed
+ * pool so that a steady flow of scans does not allocate
+ */
+#define VIRUS_SCRATCH_POOL_SIZE 64
+struct Scan_scratch {
+  char account[VIRUS_ACCOUNT_MAX_LENGTH + 1];
+  Scan_context context;
+};
+
+class Scan_scratch_ref {
+ public:
+  Scan_scratch_ref();
+  ~Scan_scratch_ref();
+  Scan_scratch_ref(const Scan_scratch_ref &) = delete;
+  Scan_scratch_ref &operator=(const Scan_scratch_ref &) = delete;
+
+  Scan_scratch *get() const { return m_scratch; }
+  Scan_scratch *operator->() const { return m_scratch; }
+
+ private:
+  Scan_scratch *m_scratch;
+  /* Index in the pool, or -1 for an overflow scratch of its own */
+  int m_slot;
+};
+
+void cleanup_scratch_pool();
+
+/*
+  Scan statistics, kept in VIRUS_STATS_SHARDS cache line aligned shards
+  picked by the CPU a scan runs on, and merged when they are read.
+*/
+#define VIRUS_STATS_SHARDS 16
+
+/* Log-linear latency buckets: 8 sub-buckets per power of two */
+#define VIRUS_LATENCY_SUB_BUCKET_BITS 3
+#define VIRUS_LATENCY_SUB_BUCKETS (1 << VIRUS_LATENCY_SUB_BUCKET_BITS)
+/* Latencies above 2^36 us (about 19 hours) share the last bucket */
+#define VIRUS_LATENCY_MAX_SHIFT 32
+#define VIRUS_LATENCY_BUCKETS \
+  ((VIRUS_LATENCY_MAX_SHIFT + 2) * VIRUS_LATENCY_SUB_BUCKETS)
+
+enum scan_size_class {
+  SIZE_CLASS_4K,
+  SIZE_CLASS_64K,
+  SIZE_CLASS_1M,
+  SIZE_CLASS_16M,
+  SIZE_CLASS_LARGE,
+  SIZE_CLASS_COUNT
+};
+
+enum scan_verdict {
+  VERDICT_CLEAN,
+  VERDICT_INFECTED,
+  VERDICT_ERROR,
+  /* Timed out or killed, CL_ETIMEOUT or CL_BREAK */
+  VERDICT_ABORTED,
+  VERDICT_COUNT
+};
+
+enum stats_counter {
+  STAT_SCANS,
+  STAT_BYTES_SCANNED,
+  STAT_SCANS_CLEAN,
+  STAT_SCANS_INFECTED,
+  STAT_SCAN_ERRORS,
+  STAT_SCANS_ABORTED,
+  STAT_SCAN_TIME_US,
+  STAT_VIRUS_FOUND,
+  STAT_RELOADS,
+  STAT_ADMISSION_WAIT_US,
+  STAT_ADMISSION_TIMEOUTS,
+  /* Wall time of the sharded scans, and the time their shards took */
+  STAT_SHARDED_SCANS,
+  STAT_SHARDED_SCAN_TIME_US,
+  STAT_SHARD_SCAN_TIME_US,
+  STAT_COUNT
+};
+
+struct Latency_row {
+  enum scan_size_class size_class;
+  enum scan_verdict verdict;
+  unsigned long long count;
+  unsigned long long sum_us;
+  unsigned long long p50_us;
+  unsigned long long p95_us;
+  unsigned long long p99_us;
+  unsigned long long max_us;
+  unsigned long long bytes;
+};
+
+size_t stats_shard_index();
+void stats_add(enum stats_counter counter, unsigned long long value = 1);
+unsigned long long stats_get(enum stats_counter counter);
+void record_scan(size_t bytes, int return_code, unsigned long long elapsed_us);
+bool latency_read(size_t index, Latency_row *row);
+size_t latency_row_count();
+const char *size_class_name(enum scan_size_class size_class);
+const char *verdict_name(enum scan_verdict verdict);
 
 void init_virus_data();
 void cleanup_virus_data();
 
 
+extern unsigned int matches_size;
+
+/* Fixed size, a record is copied in and out of its ring slot as is */
 struct Virus_record {
   time_t virus_timestamp;
-  std::string virus_name;
-  std::string virus_username;
-  std::string virus_hostname;
-  std::string virus_engine;
+  char virus_name[VIRUS_NAME_MAX_LENGTH + 1];
+  char virus_username[USERNAME_MAX_LENGTH + 1];
+  char virus_hostname[HOSTNAME_MAX_LENGTH + 1];
+  char virus_engine[ENGINE_VERSION_MAX_LENGTH];
   PSI_int virus_signatures;
+  /* Empty unless the payload was a file of the server */
+  char virus_file[FILE_NAME_MAX_LENGTH + 1];
+};
+
+/*
+ * performance_schema.viruscan_matches_summary: the detections aggregated by
+ * virus, user and host, in VIRUS_SUMMARY_SHARDS shards each evicting its
+ * least recently seen row when full
+ */
+#define VIRUS_SUMMARY_SHARDS 16
+#define VIRUS_SUMMARY_DEFAULT_SIZE 1024
+
+extern unsigned int matches_summary_size;
+extern PSI_mutex_key key_mutex_virus_summary;
+
+struct Summary_row {
+  char virus_name[VIRUS_NAME_MAX_LENGTH + 1];
+  char virus_username[USERNAME_MAX_LENGTH + 1];
+  char virus_hostname[HOSTNAME_MAX_LENGTH + 1];
+  unsigned long long count;
+  /* Size of the infected payloads */
+  unsigned long long bytes;
+  time_t first_seen;
+  time_t last_seen;
 };
 
+void init_virus_summary();
+void cleanup_virus_summary();
+bool read_summary_element(size_t index, Summary_row *row);
+size_t summary_capacity();
+size_t summary_element_count();
+
 class Virus_POS {
  private:
   unsigned int m_index = 0;
@@ -105,6 +815,17 @@ class Virus_POS {
   void set_after(Virus_POS *pos) { m_index = pos->m_index + 1; }
 };
 
+/*
+ * Indexes of performance_schema.viruscan_matches, in the order of the table
+ * definition
+ */
+#define VIRUS_INDEX_VIRUS 0
+#define VIRUS_INDEX_USER 1
+#define VIRUS_INDEX_HOST 2
+#define VIRUS_INDEX_COUNT 3
+/* HA_READ_KEY_EXACT */
+#define VIRUS_KEY_EXACT 0
+
 struct Virus_Table_Handle {
   /* Current position instance */
   Virus_POS m_pos;
@@ -116,19 +837,79 @@ struct Virus_Table_Handle {
 
   /* Index indicator */
   unsigned int index_num;
+  /* Key of the index read, see virus_index_read() */
+  PSI_plugin_key_string m_key;
+  char m_key_buffer[HOSTNAME_MAX_LENGTH + 1];
+  /* virus_key_hash() of an exact key, 0 to compare every row */
+  unsigned int m_key_hash;
+};
+
+struct Queue_Table_Handle {
+  /* Current position instance */
+  Virus_POS m_pos;
+  /* Next position instance */
+  Virus_POS m_next_pos;
+
+  /* Current row for the table */
+  Scan_ticket current_row;
+};
+
+struct Database_Table_Handle {
+  /* Current position instance */
+  Virus_POS m_pos;
+  /* Next position instance */
+  Virus_POS m_next_pos;
+
+  /* Current row for the table */
+  Database_info current_row;
+};
+
+struct Summary_Table_Handle {
+  /* Current position instance */
+  Virus_POS m_pos;
+  /* Next position instance */
+  Virus_POS m_next_pos;
+
+  /* Current row for the table */
+  Summary_row current_row;
+};
+
+struct Latency_Table_Handle {
+  /* Current position instance */
+  Virus_POS m_pos;
+  /* Next position instance */
+  Virus_POS m_next_pos;
+
+  /* Current row for the table */
+  Latency_row current_row;
 };
 
 void init_virus_share(PFS_engine_table_share_proxy *share);
+void init_queue_share(PFS_engine_table_share_proxy *share);
+void init_latency_share(PFS_engine_table_share_proxy *share);
+void init_database_share(PFS_engine_table_share_proxy *share);
+void init_summary_share(PFS_engine_table_share_proxy *share);
 
 extern PFS_engine_table_share_proxy virus_st_share;
+extern PFS_engine_table_share_proxy queue_st_share;
+extern PFS_engine_table_share_proxy latency_st_share;
+extern PFS_engine_table_share_proxy database_st_share;
+extern PFS_engine_table_share_proxy summary_st_share;
 
 extern PFS_engine_table_share_proxy *share_list[];
 extern unsigned int share_list_count;
 
-static mysql_mutex_t LOCK_virus_data;
 extern PSI_mutex_key key_mutex_virus_data;
 extern PSI_mutex_info virus_data_mutex[];
 
-extern void addVirus_element(time_t virus_timestamp,
-                    std::string virus_name, std::string virus_username, std::string virus_hostname,
-                    std::string virus_engine, PSI_int virus_signatures);
+extern void addVirus_element(time_t virus_timestamp, const char *virus_name,
+                             const char *virus_username,
+                             const char *virus_hostname,
+                             const char *virus_engine,
+                             PSI_int virus_signatures,
+                             const char *virus_file,
+                             unsigned long long virus_bytes);
+bool read_virus_element(size_t index, Virus_record *record);
+size_t virus_element_count();
+unsigned int virus_key_hash(const char *value, size_t length);
+bool virus_key_may_match(size_t index, unsigned int key, unsigned int hash);
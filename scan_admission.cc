@@ -0,0 +1,192 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+#include <mysql/plugin.h> /* thd_killed */
+
+#include <unordered_map>
+
+/*
+  Scan admission control
+
+  At most viruscan.max_concurrent_scans scans run on connection threads at
+  once, and at most viruscan.max_account_scans for one account. The other
+  callers wait in arrival order; a waiter whose account is at its cap lets
+  the next ones go first instead of blocking the queue. A caller still
+  waiting after viruscan.admission_timeout milliseconds gives up, and so
+  does a caller whose query is killed.
+
+  0 disables a limit. With both disabled, scans don't take the lock at all.
+
+  The per-account counters are kept when they drop to 0, and looked up
+  through a key string reused under the lock: once an account has been
+  seen, admitting its scans does not allocate.
+*/
+
+unsigned int max_concurrent_scans = 0;
+unsigned int max_account_scans = 0;
+unsigned int admission_timeout = VIRUS_ADMISSION_DEFAULT_TIMEOUT;
+
+struct Admission_waiter {
+  const char *account;
+  bool granted = false;
+};
+
+static mysql_mutex_t LOCK_admission;
+static mysql_cond_t COND_admission;
+/* Protected by LOCK_admission */
+static std::list<Admission_waiter *> admission_queue;
+static std::unordered_map<std::string, unsigned int> account_scans;
+static std::string account_key;
+static unsigned int running_scans = 0;
+
+void init_admission() {
+  mysql_mutex_init(key_mutex_virus_admission, &LOCK_admission, nullptr);
+  mysql_cond_init(key_cond_virus_admission, &COND_admission);
+}
+
+void cleanup_admission() {
+  account_scans.clear();
+  account_key.clear();
+  account_key.shrink_to_fit();
+  mysql_cond_destroy(&COND_admission);
+  mysql_mutex_destroy(&LOCK_admission);
+}
+
+/* Caller holds LOCK_admission */
+static unsigned int &account_running_scans(const char *account) {
+  account_key.assign(account);
+  auto it = account_scans.find(account_key);
+  if (it == account_scans.end())
+    it = account_scans.emplace(account_key, 0).first;
+  return it->second;
+}
+
+/* Caller holds LOCK_admission */
+static bool can_run(const char *account) {
+  if (max_concurrent_scans > 0 && running_scans >= max_concurrent_scans)
+    return false;
+  if (max_account_scans > 0 &&
+      account_running_scans(account) >= max_account_scans)
+    return false;
+  return true;
+}
+
+/* Caller holds LOCK_admission */
+static void start_scan(const char *account) {
+  running_scans++;
+  account_running_scans(account)++;
+}
+
+/* Caller holds LOCK_admission */
+static void grant_waiters() {
+  bool granted = false;
+
+  for (auto it = admission_queue.begin(); it != admission_queue.end();) {
+    if (max_concurrent_scans > 0 && running_scans >= max_concurrent_scans)
+      break;
+    if (!can_run((*it)->account)) {
+      ++it; /* its account is at its cap, the next waiter may go */
+      continue;
+    }
+    start_scan((*it)->account);
+    (*it)->granted = true;
+    it = admission_queue.erase(it);
+    granted = true;
+  }
+
+  if (granted) mysql_cond_broadcast(&COND_admission);
+}
+
+void admission_limits_changed() {
+  mysql_mutex_lock(&LOCK_admission);
+  grant_waiters();
+  mysql_mutex_unlock(&LOCK_admission);
+}
+
+unsigned long long admission_queue_depth() {
+  mysql_mutex_lock(&LOCK_admission);
+  unsigned long long depth = admission_queue.size();
+  mysql_mutex_unlock(&LOCK_admission);
+  return depth;
+}
+
+Scan_admission::Scan_admission(const char *account, MYSQL_THD thd)
+    : m_account(account) {
+  if (max_concurrent_scans == 0 && max_account_scans == 0) {
+    m_admitted = true;
+    return;
+  }
+
+  mysql_mutex_lock(&LOCK_admission);
+  if (admission_queue.empty() && can_run(m_account)) {
+    start_scan(m_account);
+    m_admitted = m_counted = true;
+    mysql_mutex_unlock(&LOCK_admission);
+    return;
+  }
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point deadline =
+      start + std::chrono::milliseconds(admission_timeout);
+  Admission_waiter waiter;
+  waiter.account = m_account;
+  admission_queue.push_back(&waiter);
+  grant_waiters();
+
+  /* In slices, so that KILL QUERY is noticed */
+  while (!waiter.granted) {
+    long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - std::chrono::steady_clock::now())
+                         .count();
+    m_killed = thd != nullptr && thd_killed(thd);
+    if (left <= 0 || m_killed) {
+      admission_queue.remove(&waiter);
+      break;
+    }
+    struct timespec abstime;
+    set_timespec_nsec(
+        &abstime,
+        std::min<long long>(left, VIRUS_KILL_CHECK_INTERVAL) * 1000000ULL);
+    mysql_cond_timedwait(&COND_admission, &LOCK_admission, &abstime);
+  }
+  m_admitted = m_counted = waiter.granted;
+  if (m_admitted) m_killed = false;
+  mysql_mutex_unlock(&LOCK_admission);
+
+  stats_add(STAT_ADMISSION_WAIT_US,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+  if (!m_admitted && !m_killed) stats_add(STAT_ADMISSION_TIMEOUTS);
+}
+
+Scan_admission::~Scan_admission() {
+  if (!m_counted) return;
+
+  mysql_mutex_lock(&LOCK_admission);
+  running_scans--;
+  account_running_scans(m_account)--;
+  grant_waiters();
+  mysql_mutex_unlock(&LOCK_admission);
+}
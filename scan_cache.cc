@@ -0,0 +1,223 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+#include <unordered_map>
+
+/*
+  Verdict cache
+
+  Maps the SHA-256 of a payload (with its length and the scan profile) to the
+  verdict returned by ClamAV. Every entry is tagged with the engine generation that produced it:
+  an entry from an older generation is a miss, so reload_engine() invalidates
+  the whole cache without touching it.
+
+  The cache is split in VIRUS_CACHE_SHARDS independent LRU lists, each with
+  its own mutex and an equal part of the memory budget. Once a shard is
+  full, a new verdict reuses the list and hash map nodes of the entry it
+  evicts instead of freeing them and allocating new ones.
+*/
+
+/* Approximate cost of the list and hash map nodes holding an entry */
+#define VIRUS_CACHE_NODE_OVERHEAD 64
+
+unsigned long long cache_size = VIRUS_CACHE_DEFAULT_SIZE;
+
+struct Cache_key_hash {
+  size_t operator()(const Cache_key &key) const {
+    size_t h;
+    memcpy(&h, key.digest, sizeof(h));
+    return h ^ key.length;
+  }
+};
+
+struct Cache_entry {
+  Cache_key key;
+  unsigned long long generation;
+  int return_code;
+  std::string virus_name;
+};
+
+typedef std::list<Cache_entry> Cache_lru;
+
+struct Cache_shard {
+  mysql_mutex_t lock;
+  /* Most recently used entry first */
+  Cache_lru lru;
+  std::unordered_map<Cache_key, Cache_lru::iterator, Cache_key_hash> index;
+  unsigned long long memory = 0;
+  unsigned long long hits = 0;
+  unsigned long long misses = 0;
+};
+
+static Cache_shard cache_shards[VIRUS_CACHE_SHARDS];
+
+static unsigned long long cache_entry_cost(const Cache_entry &entry) {
+  return sizeof(Cache_entry) + entry.virus_name.size() +
+         VIRUS_CACHE_NODE_OVERHEAD;
+}
+
+static Cache_shard &cache_shard_for(const Cache_key &key) {
+  /* The first bytes of the digest are used by the hash map */
+  return cache_shards[key.digest[VIRUS_CACHE_DIGEST_LENGTH - 1] %
+                      VIRUS_CACHE_SHARDS];
+}
+
+/* Caller holds shard->lock */
+static void cache_evict(Cache_shard *shard, unsigned long long budget) {
+  while (shard->memory > budget && !shard->lru.empty()) {
+    Cache_entry &victim = shard->lru.back();
+    shard->memory -= cache_entry_cost(victim);
+    shard->index.erase(victim.key);
+    shard->lru.pop_back();
+  }
+}
+
+void init_cache() {
+  for (Cache_shard &shard : cache_shards) {
+    mysql_mutex_init(key_mutex_virus_cache, &shard.lock, nullptr);
+    shard.memory = 0;
+    shard.hits = 0;
+    shard.misses = 0;
+  }
+}
+
+void cleanup_cache() {
+  for (Cache_shard &shard : cache_shards) {
+    mysql_mutex_lock(&shard.lock);
+    shard.index.clear();
+    shard.lru.clear();
+    shard.memory = 0;
+    mysql_mutex_unlock(&shard.lock);
+    mysql_mutex_destroy(&shard.lock);
+  }
+}
+
+bool cache_enabled() { return cache_size > 0; }
+
+bool cache_make_key(const char *data, size_t data_size,
+                    const Scan_profile *profile, Cache_key *key) {
+  unsigned int digest_length = sizeof(key->digest);
+
+  key->length = data_size;
+  key->profile = profile;
+  return cl_hash_data("sha256", data, data_size, key->digest,
+                      &digest_length) != nullptr &&
+         digest_length == VIRUS_CACHE_DIGEST_LENGTH;
+}
+
+bool cache_lookup(const Cache_key &key, unsigned long long generation,
+                  int *return_code, char *virus_name, size_t virus_name_size) {
+  Cache_shard &shard = cache_shard_for(key);
+  bool found = false;
+
+  mysql_mutex_lock(&shard.lock);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    Cache_lru::iterator entry = it->second;
+    if (entry->generation == generation) {
+      *return_code = entry->return_code;
+      snprintf(virus_name, virus_name_size, "%s", entry->virus_name.c_str());
+      shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+      found = true;
+    } else {
+      /* Verdict from a previous engine generation */
+      shard.memory -= cache_entry_cost(*entry);
+      shard.lru.erase(entry);
+      shard.index.erase(it);
+    }
+  }
+  if (found)
+    shard.hits++;
+  else
+    shard.misses++;
+  mysql_mutex_unlock(&shard.lock);
+
+  return found;
+}
+
+void cache_store(const Cache_key &key, unsigned long long generation,
+                 int return_code, const char *virus_name) {
+  Cache_shard &shard = cache_shard_for(key);
+  unsigned long long budget = cache_size / VIRUS_CACHE_SHARDS;
+  const char *name = virus_name != nullptr ? virus_name : "";
+
+  mysql_mutex_lock(&shard.lock);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    /* Refresh the entry in place */
+    Cache_entry &entry = *it->second;
+    shard.memory -= cache_entry_cost(entry);
+    entry.generation = generation;
+    entry.return_code = return_code;
+    entry.virus_name.assign(name);
+    shard.memory += cache_entry_cost(entry);
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  } else if (!shard.lru.empty() &&
+             shard.memory + sizeof(Cache_entry) + strlen(name) +
+                     VIRUS_CACHE_NODE_OVERHEAD >
+                 budget) {
+    /* Full: the least recently used entry becomes the new one */
+    Cache_lru::iterator victim = std::prev(shard.lru.end());
+    auto node = shard.index.extract(victim->key);
+    shard.memory -= cache_entry_cost(*victim);
+    victim->key = key;
+    victim->generation = generation;
+    victim->return_code = return_code;
+    victim->virus_name.assign(name);
+    shard.memory += cache_entry_cost(*victim);
+    shard.lru.splice(shard.lru.begin(), shard.lru, victim);
+    node.key() = key;
+    shard.index.insert(std::move(node));
+  } else {
+    shard.lru.push_front(Cache_entry{key, generation, return_code, name});
+    shard.index.emplace(key, shard.lru.begin());
+    shard.memory += cache_entry_cost(shard.lru.front());
+  }
+
+  cache_evict(&shard, budget);
+  mysql_mutex_unlock(&shard.lock);
+}
+
+void cache_trim() {
+  unsigned long long budget = cache_size / VIRUS_CACHE_SHARDS;
+
+  for (Cache_shard &shard : cache_shards) {
+    mysql_mutex_lock(&shard.lock);
+    cache_evict(&shard, budget);
+    mysql_mutex_unlock(&shard.lock);
+  }
+}
+
+void cache_get_stats(unsigned long long *hits, unsigned long long *misses,
+                     unsigned long long *memory) {
+  *hits = *misses = *memory = 0;
+
+  for (Cache_shard &shard : cache_shards) {
+    mysql_mutex_lock(&shard.lock);
+    *hits += shard.hits;
+    *misses += shard.misses;
+    *memory += shard.memory;
+    mysql_mutex_unlock(&shard.lock);
+  }
+}
@@ -0,0 +1,861 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+#include <mysql/plugin.h> /* thd_killed */
+
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#define SIGNATURE_CHANGE 1
+
+/*
+  ENGINE generations
+*/
+
+unsigned int signature_status = 0;
+char engine_state_status[16] = "not loaded";
+unsigned long long engine_load_time_ms = 0;
+char engine_reloaded_at[VIRUS_TIMESTAMP_LENGTH] = "";
+
+/* How long virus_scan() waits for the first engine, in milliseconds */
+unsigned int engine_wait_timeout = 0;
+
+/* Deadline of a scan in milliseconds, 0 for none */
+unsigned int scan_timeout = VIRUS_SCAN_DEFAULT_TIMEOUT;
+
+Engine_limits engine_limits;
+
+/* nullptr or empty: the ClamAV default, cl_retdbdir() */
+char *database_directory = nullptr;
+/* Comma separated database names, file names or types, empty for all */
+char *database_include = nullptr;
+char *database_exclude = nullptr;
+unsigned long long database_options = CL_DB_STDOPT;
+bool hash_engine = false;
+
+/* Engines the databases are also split across, 0 or 1 for none */
+unsigned int engine_shards = 0;
+/* Smaller payloads are scanned on the whole engine */
+unsigned long long shard_min_size = VIRUS_SHARD_DEFAULT_MIN_SIZE;
+Scan_pool shard_pool;
+
+/*
+  SCAN profiles
+*/
+
+/* Structured data heuristics flag credit card and SSN numbers, not malware */
+#define VIRUS_PARANOID_HEURISTICS                \
+  (~0U & ~(CL_SCAN_HEURISTIC_STRUCTURED |        \
+           CL_SCAN_HEURISTIC_STRUCTURED_SSN_NORMAL | \
+           CL_SCAN_HEURISTIC_STRUCTURED_SSN_STRIPPED | \
+           CL_SCAN_HEURISTIC_STRUCTURED_CC))
+
+/* { general, parse, heuristic, mail, dev } */
+const Scan_profile scan_profiles[VIRUS_PROFILE_COUNT] = {
+    /* Raw signatures and executables only, stop at the first match */
+    {"fast", {0, CL_SCAN_PARSE_PE | CL_SCAN_PARSE_ELF, 0, 0, 0}, false,
+     false},
+    /* All the parsers, all the matches */
+    {"default", {CL_SCAN_GENERAL_ALLMATCHES, ~0U, 0, 0, 0}, false, false},
+    /* Everything, heuristic alerts included */
+    {"paranoid",
+     {CL_SCAN_GENERAL_ALLMATCHES | CL_SCAN_GENERAL_HEURISTICS, ~0U,
+      VIRUS_PARANOID_HEURISTICS, 0, 0},
+     false, false},
+    /* Known bad files only: the payload hashes, no parser */
+    {"hash", {0, 0, 0, 0, 0}, true, false},
+    /* default, with the parsers the sniffed content class can use */
+    {"auto", {CL_SCAN_GENERAL_ALLMATCHES, ~0U, 0, 0, 0}, false, true}};
+
+unsigned long scan_profile = VIRUS_PROFILE_DEFAULT;
+
+static const char *scan_profile_names[] = {"fast", "default", "paranoid",
+                                           "hash", "auto", nullptr};
+TYPELIB scan_profile_typelib = {VIRUS_PROFILE_COUNT, "scan_profile_typelib",
+                                scan_profile_names, nullptr};
+
+const Scan_profile *find_scan_profile(const char *name, size_t length) {
+  for (const Scan_profile &profile : scan_profiles) {
+    if (strlen(profile.name) == length &&
+        strncasecmp(profile.name, name, length) == 0)
+      return &profile;
+  }
+  return nullptr;
+}
+
+const char *unknown_scan_profile_message() {
+  static const std::string message = [] {
+    std::string text = "unknown scan profile, use ";
+    for (size_t i = 0; i < VIRUS_PROFILE_COUNT; i++) {
+      if (i > 0) text += i + 1 < VIRUS_PROFILE_COUNT ? ", " : " or ";
+      text += std::string("'") + scan_profiles[i].name + "'";
+    }
+    return text;
+  }();
+  return message.c_str();
+}
+
+const Scan_profile *default_scan_profile() {
+  return &scan_profiles[scan_profile < VIRUS_PROFILE_COUNT
+                            ? scan_profile
+                            : VIRUS_PROFILE_DEFAULT];
+}
+
+mysql_mutex_t LOCK_engine_reload;
+
+/* Signalled every time a load completes, protects engine_state */
+mysql_mutex_t LOCK_engine_loaded;
+mysql_cond_t COND_engine_loaded;
+
+static enum engine_state engine_load_state = ENGINE_NOT_LOADED;
+
+/* Builds the first engine without holding up INSTALL COMPONENT */
+static std::thread engine_loader;
+
+/*
+ * The published engine. Only ever accessed through std::atomic_load and
+ * std::atomic_store so that scans never wait for a reload.
+ */
+static Engine_ref current_engine;
+
+/* Protected by LOCK_engine_reload */
+static unsigned long long last_generation = 0;
+static struct cl_stat signatureStat;
+static bool signatureStat_loaded = false;
+
+Engine_generation::~Engine_generation() {
+  if (engine != nullptr) cl_engine_free(engine);
+  if (hash_engine != nullptr) cl_engine_free(hash_engine);
+  for (struct cl_engine *shard : shards) cl_engine_free(shard);
+}
+
+Engine_ref acquire_engine() { return std::atomic_load(&current_engine); }
+
+static void set_engine_state(enum engine_state state) {
+  static const char *names[] = {"not loaded", "loading", "ready", "failed"};
+
+  mysql_mutex_lock(&LOCK_engine_loaded);
+  engine_load_state = state;
+  snprintf(engine_state_status, sizeof(engine_state_status), "%s",
+           names[state]);
+  if (state != ENGINE_LOADING) mysql_cond_broadcast(&COND_engine_loaded);
+  mysql_mutex_unlock(&LOCK_engine_loaded);
+}
+
+enum engine_state get_engine_state() {
+  enum engine_state state;
+
+  mysql_mutex_lock(&LOCK_engine_loaded);
+  state = engine_load_state;
+  mysql_mutex_unlock(&LOCK_engine_loaded);
+
+  return state;
+}
+
+Engine_ref wait_for_engine(unsigned int timeout_ms) {
+  Engine_ref engine = acquire_engine();
+  if (engine || timeout_ms == 0) return engine;
+
+  struct timespec abstime;
+  set_timespec_nsec(&abstime, timeout_ms * 1000000ULL);
+
+  mysql_mutex_lock(&LOCK_engine_loaded);
+  while (!(engine = acquire_engine()) && engine_load_state == ENGINE_LOADING) {
+    if (mysql_cond_timedwait(&COND_engine_loaded, &LOCK_engine_loaded,
+                             &abstime) != 0)
+      break;
+  }
+  mysql_mutex_unlock(&LOCK_engine_loaded);
+
+  return engine ? engine : acquire_engine();
+}
+
+/*
+ * Build and compile a new engine off to the side. The published generation
+ * keeps serving scans while this runs.
+ */
+static void apply_engine_limits(struct cl_engine *new_engine,
+                                const Engine_limits &limits) {
+  const struct {
+    enum cl_engine_field field;
+    const char *name;
+    long long value;
+  } settings[] = {
+      {CL_ENGINE_MAX_FILESIZE, "max_filesize", (long long)limits.max_filesize},
+      {CL_ENGINE_MAX_SCANSIZE, "max_scansize", (long long)limits.max_scansize},
+      {CL_ENGINE_MAX_RECURSION, "max_recursion", limits.max_recursion},
+      {CL_ENGINE_MAX_FILES, "max_files", limits.max_files},
+      {CL_ENGINE_MAX_SCANTIME, "max_scantime", limits.max_scantime},
+  };
+  char buf[1024];
+
+  for (const auto &setting : settings) {
+    if (setting.value == 0) continue; /* keep the ClamAV default */
+    cl_error_t rv =
+        cl_engine_set_num(new_engine, setting.field, setting.value);
+    if (CL_SUCCESS != rv) {
+      snprintf(buf, 1024, "cannot set clamav engine %s to %lld: %s",
+               setting.name, setting.value, cl_strerror(rv));
+      LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    }
+  }
+}
+
+/*
+  SIGNATURE databases
+
+  The databases of the directory are loaded one by one, so that they can be
+  filtered and their signatures counted. A database is selected by its file
+  name ("daily.cvd"), its name ("daily") or its type ("hdb"); the types only
+  apply to unpacked databases, a .cvd holds all of them.
+*/
+
+static const char *database_extensions[] = {
+    "cvd", "cld", "cud", "db",  "hdb", "hdu", "hsb",  "hsu", "mdb", "mdu",
+    "msb", "msu", "ndb", "ndu", "ldb", "ldu", "sdb",  "zmd", "rmd", "pdb",
+    "gdb", "wdb", "cbc", "ftm", "cfg", "cdb", "cat",  "crb", "idb", "ioc",
+    "yar", "yara", "pwdb", "imp", "ign", "ign2", "fp", "sfp"};
+
+/* Whole file hashes (MD5, SHA1, SHA256) and PE section hashes */
+static const char *hash_database_extensions[] = {
+    "hdb", "hdu", "hsb", "hsu", "mdb", "mdu", "msb", "msu", "fp", "sfp"};
+
+/* Allow lists go first, they must be known before the signatures they mute */
+static const char *database_allow_extensions[] = {"ign", "ign2", "fp", "sfp",
+                                                  "cfg"};
+
+/*
+  SET GLOBAL frees the previous value of a PLUGIN_VAR_MEMALLOC string, only
+  its update callback may read it. The loader and the watcher read these
+  copies instead.
+*/
+mysql_mutex_t LOCK_database_settings;
+static std::string database_directory_copy;
+static std::string database_include_copy;
+static std::string database_exclude_copy;
+
+void database_strings_changed() {
+  mysql_mutex_lock(&LOCK_database_settings);
+  database_directory_copy =
+      database_directory != nullptr ? database_directory : "";
+  database_include_copy = database_include != nullptr ? database_include : "";
+  database_exclude_copy = database_exclude != nullptr ? database_exclude : "";
+  mysql_mutex_unlock(&LOCK_database_settings);
+}
+
+Database_settings current_database_settings() {
+  Database_settings settings;
+
+  mysql_mutex_lock(&LOCK_database_settings);
+  settings.directory = database_directory_copy;
+  settings.include = database_include_copy;
+  settings.exclude = database_exclude_copy;
+  mysql_mutex_unlock(&LOCK_database_settings);
+  if (settings.directory.empty()) settings.directory = cl_retdbdir();
+  settings.options = database_options;
+  settings.hash_engine = hash_engine;
+  settings.shards = engine_shards;
+  return settings;
+}
+
+static const char *database_extension(const std::string &file) {
+  size_t dot = file.rfind('.');
+  return dot == std::string::npos ? nullptr : file.c_str() + dot + 1;
+}
+
+template <size_t N>
+static bool has_extension(const std::string &file,
+                          const char *const (&extensions)[N]) {
+  const char *extension = database_extension(file);
+  if (extension == nullptr) return false;
+
+  for (const char *known : extensions)
+    if (strcasecmp(extension, known) == 0) return true;
+  return false;
+}
+
+/* Is the database in the comma separated list of names, files and types */
+static bool database_listed(const std::string &list, const std::string &file) {
+  std::string name = file.substr(0, file.find('.'));
+  const char *extension = database_extension(file);
+  size_t start = 0;
+
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+
+    std::string entry = list.substr(start, end - start);
+    entry.erase(0, entry.find_first_not_of(" \t"));
+    entry.erase(entry.find_last_not_of(" \t") + 1);
+    if (!entry.empty() && entry[0] == '.') entry.erase(0, 1);
+
+    if (!entry.empty() &&
+        (strcasecmp(entry.c_str(), file.c_str()) == 0 ||
+         strcasecmp(entry.c_str(), name.c_str()) == 0 ||
+         (extension != nullptr && strcasecmp(entry.c_str(), extension) == 0)))
+      return true;
+
+    start = end + 1;
+  }
+  return false;
+}
+
+static std::vector<Database_info> list_databases(
+    const Database_settings &settings) {
+  std::vector<Database_info> databases;
+  DIR *dir = opendir(settings.directory.c_str());
+  struct dirent *entry;
+
+  if (dir == nullptr) return databases;
+
+  while ((entry = readdir(dir)) != nullptr) {
+    Database_info database;
+    database.name = entry->d_name;
+    if (!has_extension(database.name, database_extensions)) continue;
+
+    if ((!settings.include.empty() &&
+         !database_listed(settings.include, database.name)) ||
+        database_listed(settings.exclude, database.name))
+      database.status = DATABASE_EXCLUDED;
+    databases.push_back(database);
+  }
+  closedir(dir);
+
+  std::sort(databases.begin(), databases.end(),
+            [](const Database_info &a, const Database_info &b) {
+              bool a_allow = has_extension(a.name, database_allow_extensions);
+              bool b_allow = has_extension(b.name, database_allow_extensions);
+              if (a_allow != b_allow) return a_allow;
+              return a.name < b.name;
+            });
+
+  return databases;
+}
+
+const char *database_status_name(enum database_status status) {
+  static const char *names[] = {"loaded", "excluded", "failed"};
+  return names[status];
+}
+
+const char *scan_strerror(int return_code) {
+  if (return_code == VIRUS_ENOHASHENGINE)
+    return "the 'hash' profile needs viruscan.hash_engine = ON and unpacked "
+           "hash databases";
+  return cl_strerror((cl_error_t)return_code);
+}
+
+/*
+ * Engine callbacks, context is the Scan_control of the scan
+ */
+static void on_virus_found(int, const char *virus_name, void *context) {
+  Scan_control *control = static_cast<Scan_control *>(context);
+
+  if (control == nullptr || control->context == nullptr ||
+      virus_name == nullptr)
+    return;
+  control->context->add_match(virus_name);
+}
+
+/*
+ * CL_BREAK tells ClamAV to skip the file as if it were clean: once a scan is
+ * aborted, every file left is skipped and cl_scanmap_callback() returns
+ * soon. scan_map() turns the verdict into CL_ETIMEOUT or CL_BREAK.
+ */
+static bool scan_aborted(Scan_control *control) {
+  if (control->aborted != SCAN_NOT_ABORTED) return true;
+
+  if (control->thd != nullptr && thd_killed(control->thd))
+    control->aborted = SCAN_KILLED;
+  else if (control->deadline_us != 0 &&
+           (unsigned long long)std::chrono::duration_cast<
+               std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+                   .count() >= control->deadline_us)
+    control->aborted = SCAN_TIMED_OUT;
+  return control->aborted != SCAN_NOT_ABORTED;
+}
+
+/* Before a file is hashed for the engine cache */
+static cl_error_t on_pre_cache(int, const char *, void *context) {
+  Scan_control *control = static_cast<Scan_control *>(context);
+
+  if (control != nullptr && scan_aborted(control)) return CL_BREAK;
+  return CL_CLEAN;
+}
+
+static cl_error_t on_pre_scan(int, const char *type, void *context) {
+  Scan_control *control = static_cast<Scan_control *>(context);
+
+  if (control == nullptr) return CL_CLEAN;
+  if (scan_aborted(control)) return CL_BREAK;
+
+  /* The first file is the payload, the next ones are embedded in it */
+  Scan_context *scan = control->context;
+  if (scan != nullptr && type != nullptr && scan->file_type.empty())
+    scan->file_type = type;
+  return CL_CLEAN;
+}
+
+/*
+ * An engine holding only the hash databases: no Aho-Corasick trie to run,
+ * a scan is the hashes of the payload and a lookup. Hash types can only be
+ * told apart in unpacked databases, see sigtool --unpack.
+ */
+static struct cl_engine *build_hash_engine(
+    const Database_settings &settings, const Engine_limits &limits,
+    const std::vector<Database_info> &databases, unsigned int *signatureNum) {
+  cl_error_t rv;
+  char buf[1024];
+  bool found = false;
+  struct cl_engine *new_engine = cl_engine_new();
+
+  if (new_engine == nullptr) return nullptr;
+
+  apply_engine_limits(new_engine, limits);
+  cl_engine_set_clcb_virus_found(new_engine, on_virus_found);
+  cl_engine_set_clcb_pre_cache(new_engine, on_pre_cache);
+  cl_engine_set_clcb_pre_scan(new_engine, on_pre_scan);
+
+  for (const Database_info &database : databases) {
+    if (database.status == DATABASE_EXCLUDED ||
+        !has_extension(database.name, hash_database_extensions))
+      continue;
+
+    std::string path = settings.directory + "/" + database.name;
+    rv = cl_load(path.c_str(), new_engine, signatureNum,
+                 (unsigned int)settings.options);
+    if (CL_SUCCESS != rv) {
+      snprintf(buf, 1024, "failure loading clamav hash database %s: %s",
+               database.name.c_str(), cl_strerror(rv));
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    }
+    found = true;
+  }
+
+  if (!found) {
+    snprintf(buf, 1024,
+             "no hash database (.hdb, .hsb, .mdb, ...) in %s, scans with "
+             "the 'hash' profile fail",
+             settings.directory.c_str());
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    cl_engine_free(new_engine);
+    return nullptr;
+  }
+
+  rv = cl_engine_compile(new_engine);
+  if (CL_SUCCESS != rv) {
+    snprintf(buf, 1024, "cannot create clamav hash engine: %s",
+             cl_strerror(rv));
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    cl_engine_free(new_engine);
+    return nullptr;
+  }
+
+  return new_engine;
+}
+
+static struct cl_engine *build_engine(const Database_settings &settings,
+                                      const Engine_limits &limits,
+                                      unsigned int *signatureNum,
+                                      std::vector<Database_info> *databases) {
+  cl_error_t rv;
+  char buf[1024];
+  struct cl_engine *new_engine = cl_engine_new();
+
+  if (new_engine == nullptr) {
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
+                    "cannot allocate a new clamav engine");
+    return nullptr;
+  }
+
+  apply_engine_limits(new_engine, limits);
+  cl_engine_set_clcb_virus_found(new_engine, on_virus_found);
+  cl_engine_set_clcb_pre_cache(new_engine, on_pre_cache);
+  cl_engine_set_clcb_pre_scan(new_engine, on_pre_scan);
+
+  *databases = list_databases(settings);
+  if (databases->empty()) {
+    snprintf(buf, 1024, "no clamav database found in %s",
+             settings.directory.c_str());
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+  }
+
+  for (Database_info &database : *databases) {
+    if (database.status == DATABASE_EXCLUDED) continue;
+
+    std::string path = settings.directory + "/" + database.name;
+    rv = cl_load(path.c_str(), new_engine, &database.signatures,
+                 (unsigned int)settings.options);
+    if (CL_SUCCESS != rv) {
+      snprintf(buf, 1024, "failure loading clamav database %s: %s",
+               database.name.c_str(), cl_strerror(rv));
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+      database.status = DATABASE_FAILED;
+    }
+    *signatureNum += database.signatures;
+  }
+
+  rv = cl_engine_compile(new_engine);
+  if (CL_SUCCESS != rv) {
+    snprintf(buf, 1024, "cannot create clamav engine: %s", cl_strerror(rv));
+    LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    cl_engine_free(new_engine);
+    return nullptr;
+  }
+
+  return new_engine;
+}
+
+/*
+  ENGINE shards
+
+  The databases are spread over the shards by size, the largest first to
+  the lightest shard, so that the shards take about as long to scan a
+  payload. A .cvd is one database: unpack them with sigtool --unpack for a
+  finer spread. The allow lists and the configuration go to every shard.
+  Each shard is a whole engine, built next to the one it splits: the shards
+  roughly double the memory of the signatures.
+*/
+
+/* Resident memory of the server in bytes, 0 when unknown */
+static unsigned long long resident_memory() {
+#ifdef __linux__
+  unsigned long long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  if (statm == nullptr) return 0;
+  if (fscanf(statm, "%llu %llu", &pages, &resident) != 2) resident = 0;
+  fclose(statm);
+  return resident * (unsigned long long)sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+static void free_shards(std::vector<struct cl_engine *> *shards) {
+  for (struct cl_engine *shard : *shards) cl_engine_free(shard);
+  shards->clear();
+}
+
+/* The databases the whole engine loaded, split across settings.shards */
+static bool build_shards(const Database_settings &settings,
+                         const Engine_limits &limits,
+                         const std::vector<Database_info> &databases,
+                         std::vector<struct cl_engine *> *shards) {
+  cl_error_t rv;
+  char buf[1024];
+  /* size of the file, index in databases */
+  std::vector<std::pair<unsigned long long, size_t>> by_size;
+
+  for (size_t i = 0; i < databases.size(); i++) {
+    if (databases[i].status != DATABASE_LOADED ||
+        has_extension(databases[i].name, database_allow_extensions))
+      continue;
+
+    std::string path = settings.directory + "/" + databases[i].name;
+    struct stat st;
+    by_size.emplace_back(stat(path.c_str(), &st) == 0 ? st.st_size : 0, i);
+  }
+
+  size_t count = std::min<size_t>(
+      {settings.shards, by_size.size(), VIRUS_ENGINE_SHARDS_MAX});
+  if (count < 2) {
+    snprintf(buf, 1024,
+             "viruscan.engine_shards is %u but there are %zu databases to "
+             "split, scans use the whole engine",
+             settings.shards, by_size.size());
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    return false;
+  }
+
+  std::sort(by_size.begin(), by_size.end(),
+            std::greater<std::pair<unsigned long long, size_t>>());
+  std::vector<unsigned long long> load(count, 0);
+  std::vector<std::vector<size_t>> assigned(count);
+  for (const auto &database : by_size) {
+    size_t lightest =
+        std::min_element(load.begin(), load.end()) - load.begin();
+    load[lightest] += database.first;
+    assigned[lightest].push_back(database.second);
+  }
+
+  for (size_t shard = 0; shard < count; shard++) {
+    struct cl_engine *new_engine = cl_engine_new();
+    if (new_engine == nullptr) {
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG,
+                      "cannot allocate a clamav engine shard");
+      free_shards(shards);
+      return false;
+    }
+    shards->push_back(new_engine);
+
+    apply_engine_limits(new_engine, limits);
+    cl_engine_set_clcb_virus_found(new_engine, on_virus_found);
+    cl_engine_set_clcb_pre_cache(new_engine, on_pre_cache);
+    cl_engine_set_clcb_pre_scan(new_engine, on_pre_scan);
+
+    /* databases lists the allow lists first, the order cl_load() needs */
+    std::vector<size_t> &indexes = assigned[shard];
+    for (size_t i = 0; i < databases.size(); i++) {
+      if (databases[i].status == DATABASE_LOADED &&
+          has_extension(databases[i].name, database_allow_extensions))
+        indexes.push_back(i);
+    }
+    std::sort(indexes.begin(), indexes.end());
+
+    for (size_t index : indexes) {
+      std::string path = settings.directory + "/" + databases[index].name;
+      unsigned int signatureNum = 0;
+      rv = cl_load(path.c_str(), new_engine, &signatureNum,
+                   (unsigned int)settings.options);
+      if (CL_SUCCESS != rv) {
+        /* A shard without it would miss what the whole engine finds */
+        snprintf(buf, 1024,
+                 "failure loading clamav database %s in shard %zu: %s",
+                 databases[index].name.c_str(), shard, cl_strerror(rv));
+        LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+        free_shards(shards);
+        return false;
+      }
+    }
+
+    rv = cl_engine_compile(new_engine);
+    if (CL_SUCCESS != rv) {
+      snprintf(buf, 1024, "cannot create clamav engine shard %zu: %s", shard,
+               cl_strerror(rv));
+      LogComponentErr(ERROR_LEVEL, ER_LOG_PRINTF_MSG, buf);
+      free_shards(shards);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* FNV-1a, the tag only has to change when the verdicts may change */
+static unsigned long long tag_add(unsigned long long tag, const void *data,
+                                  size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+
+  for (size_t i = 0; i < size; i++) {
+    tag ^= bytes[i];
+    tag *= 1099511628211ULL;
+  }
+  return tag;
+}
+
+static unsigned long long database_tag(const Engine_generation &generation) {
+  unsigned long long tag = 14695981039346656037ULL;
+  const Engine_limits &limits = generation.limits;
+  long long database_time =
+      cl_engine_get_num(generation.engine, CL_ENGINE_DB_TIME, nullptr);
+  const char *version = cl_retver();
+
+  tag = tag_add(tag, version, strlen(version) + 1);
+  tag = tag_add(tag, &generation.database_version,
+                sizeof(generation.database_version));
+  tag = tag_add(tag, &database_time, sizeof(database_time));
+  tag = tag_add(tag, &generation.database_settings.options,
+                sizeof(generation.database_settings.options));
+  for (const Database_info &database : generation.databases) {
+    if (database.status == DATABASE_EXCLUDED) continue;
+    tag = tag_add(tag, database.name.c_str(), database.name.size() + 1);
+    tag = tag_add(tag, &database.signatures, sizeof(database.signatures));
+  }
+  tag = tag_add(tag, &limits.max_filesize, sizeof(limits.max_filesize));
+  tag = tag_add(tag, &limits.max_scansize, sizeof(limits.max_scansize));
+  tag = tag_add(tag, &limits.max_recursion, sizeof(limits.max_recursion));
+  tag = tag_add(tag, &limits.max_files, sizeof(limits.max_files));
+  tag = tag_add(tag, &limits.max_scantime, sizeof(limits.max_scantime));
+
+  /* 0 is the tag of an empty clean store */
+  return tag != 0 ? tag : 1;
+}
+
+/*
+ * Build and publish a new engine generation. On failure the previous one,
+ * if any, keeps serving the scans: false is returned, with its signatures.
+ */
+bool reload_engine(unsigned int *signatures) {
+  unsigned int signatureNum = 0;
+  char buf[1024];
+
+  mysql_mutex_lock(&LOCK_engine_reload);
+  set_engine_state(ENGINE_LOADING);
+  auto start = std::chrono::steady_clock::now();
+
+  Database_settings settings = current_database_settings();
+  const char *signatureDir = settings.directory.c_str();
+
+  /*
+   * Snapshot the directory before loading so that a database update landing
+   * during cl_load() is still detected by the next virus_reload_engine().
+   */
+  if (signatureStat_loaded) cl_statfree(&signatureStat);
+  memset(&signatureStat, 0, sizeof(struct cl_stat));
+  cl_statinidir(signatureDir, &signatureStat);
+  signatureStat_loaded = true;
+
+  Engine_limits limits = engine_limits;
+  std::vector<Database_info> databases;
+  struct cl_engine *new_engine =
+      build_engine(settings, limits, &signatureNum, &databases);
+  engine_load_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  if (new_engine == nullptr) {
+    /*
+     * Keep serving scans with the previous generation, if any. The snapshot
+     * is dropped so that the next virus_reload_engine() retries even though
+     * the databases did not change.
+     */
+    cl_statfree(&signatureStat);
+    signatureStat_loaded = false;
+    set_engine_state(acquire_engine() ? ENGINE_READY : ENGINE_FAILED);
+    if (signatures != nullptr) *signatures = signature_status;
+    mysql_mutex_unlock(&LOCK_engine_reload);
+    return false;
+  }
+
+  Engine_ref generation = std::make_shared<Engine_generation>();
+  generation->engine = new_engine;
+  if (settings.hash_engine)
+    generation->hash_engine = build_hash_engine(
+        settings, limits, databases, &generation->hash_signatures);
+  if (settings.shards > 1) {
+    unsigned long long resident = resident_memory();
+    auto shards_start = std::chrono::steady_clock::now();
+    if (build_shards(settings, limits, databases, &generation->shards)) {
+      unsigned long long grown = resident_memory();
+      generation->shard_memory = grown > resident ? grown - resident : 0;
+      snprintf(buf, 1024,
+               "clamav engine split in %zu shards in %llu ms, resident "
+               "memory grew by %llu MB",
+               generation->shards.size(),
+               (unsigned long long)
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - shards_start)
+                       .count(),
+               generation->shard_memory / (1024 * 1024));
+      LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    }
+  }
+  generation->generation = ++last_generation;
+  generation->signatures = signatureNum;
+  generation->limits = limits;
+  generation->database_settings = settings;
+  generation->databases = std::move(databases);
+  generation->database_version = (unsigned int)cl_engine_get_num(
+      new_engine, CL_ENGINE_DB_VERSION, nullptr);
+  generation->database_tag = database_tag(*generation);
+
+  /* Clean verdicts of the previous databases are no longer hits */
+  clean_store_set_tag(generation->database_tag);
+
+  /*
+   * Publish the new generation. Scans still running on the previous one keep
+   * their own reference; it is freed when the last of them returns.
+   */
+  std::atomic_store(&current_engine, generation);
+  signature_status = signatureNum;
+  set_engine_state(ENGINE_READY);
+  stats_add(STAT_RELOADS);
+  format_timestamp(time(nullptr), engine_reloaded_at,
+                   sizeof(engine_reloaded_at));
+
+  mysql_mutex_unlock(&LOCK_engine_reload);
+
+  snprintf(buf, 1024,
+           "clamav engine generation %llu loaded with signatureNum %d from %s "
+           "in %llu ms",
+           generation->generation, signatureNum, signatureDir,
+           engine_load_time_ms);
+  LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, buf);
+  if (generation->hash_engine != nullptr) {
+    snprintf(buf, 1024, "clamav hash engine loaded with signatureNum %u",
+             generation->hash_signatures);
+    LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, buf);
+  }
+  if (signatures != nullptr) *signatures = signatureNum;
+  return true;
+}
+
+bool engine_signatures_changed() {
+  bool changed;
+
+  mysql_mutex_lock(&LOCK_engine_reload);
+  changed = !signatureStat_loaded ||
+            cl_statchkdir(&signatureStat) == SIGNATURE_CHANGE;
+  mysql_mutex_unlock(&LOCK_engine_reload);
+
+  return changed;
+}
+
+/* Without an engine, a reload is always worth a try */
+bool engine_settings_changed() {
+  Engine_ref engine = acquire_engine();
+  return !engine ||
+         !(engine->limits == engine_limits &&
+           engine->database_settings == current_database_settings());
+}
+
+bool database_read(size_t index, Database_info *database) {
+  Engine_ref engine = acquire_engine();
+  if (!engine || index >= engine->databases.size()) return false;
+
+  *database = engine->databases[index];
+  return true;
+}
+
+size_t database_count() {
+  Engine_ref engine = acquire_engine();
+  return engine ? engine->databases.size() : 0;
+}
+
+void release_engine() {
+  std::atomic_store(&current_engine, Engine_ref());
+
+  mysql_mutex_lock(&LOCK_engine_reload);
+  if (signatureStat_loaded) cl_statfree(&signatureStat);
+  signatureStat_loaded = false;
+  mysql_mutex_unlock(&LOCK_engine_reload);
+}
+
+void start_engine_loader() {
+  set_engine_state(ENGINE_LOADING);
+  engine_loader = std::thread([] { reload_engine(); });
+}
+
+void stop_engine_loader() {
+  if (engine_loader.joinable()) {
+    /* cl_load() cannot be interrupted, wait for it to complete */
+    engine_loader.join();
+  }
+}
@@ -22,67 +22,409 @@
 
 #include <components/viruscan/scan.h>
 
-#include <array>
+#include <atomic>
 
 REQUIRES_SERVICE_PLACEHOLDER(pfs_plugin_table_v1);
 REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_integer_v1, pfs_integer);
+REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_bigint_v1, pfs_bigint);
 REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_string_v2, pfs_string);
 REQUIRES_SERVICE_PLACEHOLDER_AS(pfs_plugin_column_timestamp_v2, pfs_timestamp);
 
 /*
   DATA
+
+  A preallocated ring of viruscan.matches_size slots. Writers claim a slot
+  with an atomic counter and never take a mutex. Each slot is guarded by a
+  sequence lock: its sequence is odd while a writer fills it, and a reader
+  retries its copy when the sequence moved under it. Writers only contend
+  when more than matches_size detections are being recorded at once.
+*/
+
+unsigned int matches_size = VIRUS_MAX_ROWS;
+
+struct alignas(64) Virus_slot {
+  /* 0 when never written, odd while being written */
+  std::atomic<unsigned long long> sequence{0};
+  Virus_record record;
+};
+
+static Virus_slot *virus_ring = nullptr;
+static size_t virus_ring_size = 0;
+
+/*
+  The virus_key_hash() of the VIRUS, USER and HOST of every slot, kept apart
+  from the records: an index lookup walks this array and only copies the
+  records whose hash matches the key.
 */
+struct Virus_keys {
+  std::atomic<unsigned int> hash[VIRUS_INDEX_COUNT];
+};
 
-static std::array<Virus_record *, VIRUS_MAX_ROWS> virus_array;
+static Virus_keys *virus_key_ring = nullptr;
 
-/* Next available index for new record to be stored in global record array. */
-static size_t virus_next_available_index = 0;
+/* Number of records ever added, the next one goes to slot % size */
+static std::atomic<unsigned long long> virus_next_available_index{0};
 
 void init_virus_data() {
-  mysql_mutex_lock(&LOCK_virus_data);
+  virus_ring_size = matches_size;
+  virus_ring = new Virus_slot[virus_ring_size];
+  virus_key_ring = new Virus_keys[virus_ring_size];
+  for (size_t i = 0; i < virus_ring_size; i++)
+    for (std::atomic<unsigned int> &hash : virus_key_ring[i].hash) hash = 0;
   virus_next_available_index = 0;
-  virus_array.fill(nullptr);
-  mysql_mutex_unlock(&LOCK_virus_data);
 }
 
 void cleanup_virus_data() {
-  mysql_mutex_lock(&LOCK_virus_data);
-  for (Virus_record *virus : virus_array) {
-    delete virus;
+  delete[] virus_ring;
+  delete[] virus_key_ring;
+  virus_ring = nullptr;
+  virus_key_ring = nullptr;
+  virus_ring_size = 0;
+}
+
+/* Copy a NUL terminated string, without cutting a UTF-8 sequence in two */
+static void copy_field(char *dest, size_t size, const char *source) {
+  size_t length = source != nullptr ? strlen(source) : 0;
+
+  if (length >= size) {
+    length = size - 1;
+    while (length > 0 && (source[length] & 0xC0) == 0x80) length--;
   }
-  mysql_mutex_unlock(&LOCK_virus_data);
+  if (length > 0) memcpy(dest, source, length);
+  dest[length] = '\0';
+}
+
+/*
+  SUMMARY
+
+  The ring forgets a detection after matches_size more, the summary keeps a
+  row per virus, user and host. It is a fixed size hash map split in
+  VIRUS_SUMMARY_SHARDS shards, each with its own mutex, an array of entries
+  chained in hash buckets and in a least recently seen list: an outbreak
+  from many clients evicts the oldest rows of a shard, it never allocates.
+*/
+
+unsigned int matches_summary_size = VIRUS_SUMMARY_DEFAULT_SIZE;
+
+#define SUMMARY_NONE (-1)
+
+struct Summary_entry {
+  Summary_row row;
+  unsigned int hash;
+  bool used;
+  /* Next entry of the bucket, or of the free list */
+  int hash_next;
+  /* Least recently seen list, most recent first */
+  int lru_prev;
+  int lru_next;
+};
+
+struct Summary_shard {
+  mysql_mutex_t lock;
+  Summary_entry *entries = nullptr;
+  int *buckets = nullptr;
+  unsigned int bucket_mask = 0;
+  int free_list = SUMMARY_NONE;
+  int lru_head = SUMMARY_NONE;
+  int lru_tail = SUMMARY_NONE;
+  unsigned int used = 0;
+};
+
+static Summary_shard summary_shards[VIRUS_SUMMARY_SHARDS];
+/* Entries per shard */
+static unsigned int summary_shard_size = 0;
+
+void init_virus_summary() {
+  summary_shard_size =
+      (matches_summary_size + VIRUS_SUMMARY_SHARDS - 1) / VIRUS_SUMMARY_SHARDS;
+  unsigned int buckets = 1;
+  while (buckets < summary_shard_size) buckets *= 2;
+
+  for (Summary_shard &shard : summary_shards) {
+    mysql_mutex_init(key_mutex_virus_summary, &shard.lock, nullptr);
+    shard.entries = new Summary_entry[summary_shard_size];
+    shard.buckets = new int[buckets];
+    shard.bucket_mask = buckets - 1;
+    std::fill(shard.buckets, shard.buckets + buckets, SUMMARY_NONE);
+    for (unsigned int i = 0; i < summary_shard_size; i++) {
+      shard.entries[i].used = false;
+      shard.entries[i].hash_next =
+          i + 1 < summary_shard_size ? (int)i + 1 : SUMMARY_NONE;
+    }
+    shard.free_list = 0;
+    shard.lru_head = shard.lru_tail = SUMMARY_NONE;
+    shard.used = 0;
+  }
+}
+
+void cleanup_virus_summary() {
+  for (Summary_shard &shard : summary_shards) {
+    mysql_mutex_destroy(&shard.lock);
+    delete[] shard.entries;
+    delete[] shard.buckets;
+    shard.entries = nullptr;
+    shard.buckets = nullptr;
+  }
+  summary_shard_size = 0;
+}
+
+/* FNV-1a of the key, as truncated in the row */
+static unsigned int summary_hash(const Summary_row &key) {
+  unsigned int hash = 2166136261U;
+
+  for (const char *field :
+       {key.virus_name, key.virus_username, key.virus_hostname}) {
+    for (const char *c = field; *c != '\0'; c++) {
+      hash ^= (unsigned char)*c;
+      hash *= 16777619U;
+    }
+    /* The terminating NUL, ("ab", "c") is not ("a", "bc") */
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static bool summary_key_equal(const Summary_row &a, const Summary_row &b) {
+  return strcmp(a.virus_name, b.virus_name) == 0 &&
+         strcmp(a.virus_username, b.virus_username) == 0 &&
+         strcmp(a.virus_hostname, b.virus_hostname) == 0;
+}
+
+/* Caller holds shard->lock */
+static void summary_lru_unlink(Summary_shard *shard, int index) {
+  Summary_entry &entry = shard->entries[index];
+
+  if (entry.lru_prev != SUMMARY_NONE)
+    shard->entries[entry.lru_prev].lru_next = entry.lru_next;
+  else
+    shard->lru_head = entry.lru_next;
+  if (entry.lru_next != SUMMARY_NONE)
+    shard->entries[entry.lru_next].lru_prev = entry.lru_prev;
+  else
+    shard->lru_tail = entry.lru_prev;
+}
+
+/* Caller holds shard->lock */
+static void summary_lru_push(Summary_shard *shard, int index) {
+  Summary_entry &entry = shard->entries[index];
+
+  entry.lru_prev = SUMMARY_NONE;
+  entry.lru_next = shard->lru_head;
+  if (shard->lru_head != SUMMARY_NONE)
+    shard->entries[shard->lru_head].lru_prev = index;
+  else
+    shard->lru_tail = index;
+  shard->lru_head = index;
+}
+
+/* Take the least recently seen entry out. Caller holds shard->lock */
+static int summary_evict(Summary_shard *shard) {
+  int index = shard->lru_tail;
+  Summary_entry &entry = shard->entries[index];
+  int *link = &shard->buckets[entry.hash >> 4 & shard->bucket_mask];
+
+  while (*link != index) link = &shard->entries[*link].hash_next;
+  *link = entry.hash_next;
+  summary_lru_unlink(shard, index);
+  entry.used = false;
+  shard->used--;
+  return index;
+}
+
+static void summary_add(time_t virus_timestamp, const char *virus_name,
+                        const char *virus_username, const char *virus_hostname,
+                        unsigned long long virus_bytes) {
+  if (summary_shard_size == 0) return;
+
+  Summary_row key;
+  copy_field(key.virus_name, sizeof(key.virus_name), virus_name);
+  copy_field(key.virus_username, sizeof(key.virus_username), virus_username);
+  copy_field(key.virus_hostname, sizeof(key.virus_hostname), virus_hostname);
+  unsigned int hash = summary_hash(key);
+  /* The low bits pick the shard, the next ones the bucket */
+  Summary_shard &shard = summary_shards[hash % VIRUS_SUMMARY_SHARDS];
+  int *bucket = &shard.buckets[hash >> 4 & shard.bucket_mask];
+
+  mysql_mutex_lock(&shard.lock);
+  int index = *bucket;
+  while (index != SUMMARY_NONE &&
+         !(shard.entries[index].hash == hash &&
+           summary_key_equal(shard.entries[index].row, key)))
+    index = shard.entries[index].hash_next;
+
+  if (index != SUMMARY_NONE) {
+    Summary_row &row = shard.entries[index].row;
+    row.count++;
+    row.bytes += virus_bytes;
+    row.last_seen = std::max(row.last_seen, virus_timestamp);
+    summary_lru_unlink(&shard, index);
+  } else {
+    if (shard.free_list != SUMMARY_NONE) {
+      index = shard.free_list;
+      shard.free_list = shard.entries[index].hash_next;
+    } else {
+      index = summary_evict(&shard);
+    }
+
+    Summary_entry &entry = shard.entries[index];
+    entry.row = key;
+    entry.row.count = 1;
+    entry.row.bytes = virus_bytes;
+    entry.row.first_seen = entry.row.last_seen = virus_timestamp;
+    entry.hash = hash;
+    entry.used = true;
+    entry.hash_next = *bucket;
+    *bucket = index;
+    shard.used++;
+  }
+  summary_lru_push(&shard, index);
+  mysql_mutex_unlock(&shard.lock);
+}
+
+bool read_summary_element(size_t index, Summary_row *row) {
+  if (summary_shard_size == 0 ||
+      index >= (size_t)summary_shard_size * VIRUS_SUMMARY_SHARDS)
+    return false;
+
+  Summary_shard &shard = summary_shards[index / summary_shard_size];
+  bool found;
+
+  mysql_mutex_lock(&shard.lock);
+  const Summary_entry &entry = shard.entries[index % summary_shard_size];
+  found = entry.used;
+  if (found) *row = entry.row;
+  mysql_mutex_unlock(&shard.lock);
+
+  return found;
+}
+
+size_t summary_capacity() {
+  return (size_t)summary_shard_size * VIRUS_SUMMARY_SHARDS;
+}
+
+size_t summary_element_count() {
+  size_t count = 0;
+
+  for (Summary_shard &shard : summary_shards) {
+    if (shard.entries == nullptr) continue;
+    mysql_mutex_lock(&shard.lock);
+    count += shard.used;
+    mysql_mutex_unlock(&shard.lock);
+  }
+  return count;
 }
 
 /*
   DATA collection
 */
 
-void addVirus_element(time_t virus_timestamp, std::string virus_name,
-                      std::string virus_username, std::string virus_hostname,
-                      std::string virus_engine, PSI_int virus_signatures) {
-  size_t index;
-  Virus_record *record;
+void addVirus_element(time_t virus_timestamp, const char *virus_name,
+                      const char *virus_username, const char *virus_hostname,
+                      const char *virus_engine, PSI_int virus_signatures,
+                      const char *virus_file, unsigned long long virus_bytes) {
+  summary_add(virus_timestamp, virus_name, virus_username, virus_hostname,
+              virus_bytes);
+
+  if (virus_ring == nullptr) return;
+
+  Virus_slot &slot =
+      virus_ring[virus_next_available_index.fetch_add(1) % virus_ring_size];
+
+  /* Take the slot: make its sequence odd */
+  unsigned long long sequence = slot.sequence.load(std::memory_order_relaxed);
+  for (;;) {
+    if ((sequence & 1) == 0 &&
+        slot.sequence.compare_exchange_weak(sequence, sequence + 1,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed))
+      break;
+    if (sequence & 1) {
+      std::this_thread::yield();
+      sequence = slot.sequence.load(std::memory_order_relaxed);
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  Virus_record &record = slot.record;
+  record.virus_timestamp = virus_timestamp;
+  copy_field(record.virus_name, sizeof(record.virus_name), virus_name);
+  copy_field(record.virus_username, sizeof(record.virus_username),
+             virus_username);
+  copy_field(record.virus_hostname, sizeof(record.virus_hostname),
+             virus_hostname);
+  copy_field(record.virus_engine, sizeof(record.virus_engine), virus_engine);
+  record.virus_signatures = virus_signatures;
+  copy_field(record.virus_file, sizeof(record.virus_file), virus_file);
+
+  Virus_keys &keys = virus_key_ring[&slot - virus_ring];
+  keys.hash[VIRUS_INDEX_VIRUS].store(
+      virus_key_hash(record.virus_name, strlen(record.virus_name)),
+      std::memory_order_relaxed);
+  keys.hash[VIRUS_INDEX_USER].store(
+      virus_key_hash(record.virus_username, strlen(record.virus_username)),
+      std::memory_order_relaxed);
+  keys.hash[VIRUS_INDEX_HOST].store(
+      virus_key_hash(record.virus_hostname, strlen(record.virus_hostname)),
+      std::memory_order_relaxed);
 
-  mysql_mutex_lock(&LOCK_virus_data);
+  /* Publish: back to even */
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool read_virus_element(size_t index, Virus_record *record) {
+  if (index >= virus_ring_size) return false;
 
-  index = virus_next_available_index++ % VIRUS_MAX_ROWS;
-  record = virus_array[index];
+  Virus_slot &slot = virus_ring[index];
+  for (;;) {
+    unsigned long long before = slot.sequence.load(std::memory_order_acquire);
+    if (before == 0) return false; /* never written */
+    if (before & 1) {
+      std::this_thread::yield();
+      continue;
+    }
 
-  if (record != nullptr) {
-    delete record;
+    memcpy(record, &slot.record, sizeof(Virus_record));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == before) return true;
   }
+}
+
+size_t virus_element_count() {
+  return std::min<unsigned long long>(virus_next_available_index.load(),
+                                      virus_ring_size);
+}
+
+/*
+  Case insensitive FNV-1a of a column value, trailing spaces ignored like the
+  column collation does. Values that are not plain ASCII hash to 0: the
+  collation may find them equal to a different spelling, they are always
+  compared.
+*/
+unsigned int virus_key_hash(const char *value, size_t length) {
+  unsigned int hash = 2166136261U;
 
-  record = new Virus_record;
-  record->virus_timestamp = virus_timestamp;
-  record->virus_name = virus_name;
-  record->virus_username = virus_username;
-  record->virus_hostname = virus_hostname;
-  record->virus_engine = virus_engine;
-  record->virus_signatures = virus_signatures;
+  while (length > 0 && value[length - 1] == ' ') length--;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = value[i];
+    if (c >= 0x80) return 0;
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    hash ^= c;
+    hash *= 16777619U;
+  }
+  return hash != 0 ? hash : 1;
+}
 
-  virus_array[index] = record;
+/*
+  False when the record of a slot can't match a key of hash. A slot being
+  rewritten may give a stale answer, the rows returned are compared anyway.
+*/
+bool virus_key_may_match(size_t index, unsigned int key, unsigned int hash) {
+  if (hash == 0 || index >= virus_ring_size) return true;
 
-  mysql_mutex_unlock(&LOCK_virus_data);
+  unsigned int slot_hash =
+      virus_key_ring[index].hash[key].load(std::memory_order_relaxed);
+  return slot_hash == 0 || slot_hash == hash;
 }
 
 /*
@@ -90,16 +432,16 @@ void addVirus_element(time_t virus_timestamp, std::string virus_name,
 */
 
 /* Collection of table shares to be added to performance schema */
-PFS_engine_table_share_proxy *share_list[1] = {nullptr};
-unsigned int share_list_count = 1;
+PFS_engine_table_share_proxy *share_list[5] = {nullptr, nullptr, nullptr,
+                                                nullptr, nullptr};
+unsigned int share_list_count = 5;
 
 /* Global share pointer for a table */
 PFS_engine_table_share_proxy virus_st_share;
-
-int virus_delete_all_rows(void) {
-  cleanup_virus_data();
-  return 0;
-}
+PFS_engine_table_share_proxy queue_st_share;
+PFS_engine_table_share_proxy latency_st_share;
+PFS_engine_table_share_proxy database_st_share;
+PFS_engine_table_share_proxy summary_st_share;
 
 PSI_table_handle *virus_open_table(PSI_pos **pos) {
   Virus_Table_Handle *temp = new Virus_Table_Handle();
@@ -112,27 +454,14 @@ void virus_close_table(PSI_table_handle *handle) {
   delete temp;
 }
 
-static void copy_record_virus(Virus_record *dest, const Virus_record *source) {
-  dest->virus_timestamp = source->virus_timestamp;
-  dest->virus_name = source->virus_name;
-  dest->virus_username = source->virus_username;
-  dest->virus_hostname = source->virus_hostname;
-  dest->virus_engine = source->virus_engine;
-  dest->virus_signatures = source->virus_signatures;
-  return;
-}
-
 /* Define implementation of PFS_engine_table_proxy. */
 int virus_rnd_next(PSI_table_handle *handle) {
   Virus_Table_Handle *h = (Virus_Table_Handle *)handle;
-  h->m_pos.set_at(&h->m_next_pos);
-  size_t index = h->m_pos.get_index();
 
-  if (index < virus_array.size()) {
-    Virus_record *record = virus_array[index];
-    if (record != nullptr) {
-      /* Make the current row from records_array buffer */
-      copy_record_virus(&h->current_row, record);
+  /* Skip the slots that were never written */
+  for (h->m_pos.set_at(&h->m_next_pos); h->m_pos.get_index() < matches_size;
+       h->m_pos.set_after(&h->m_pos)) {
+    if (read_virus_element(h->m_pos.get_index(), &h->current_row)) {
       h->m_next_pos.set_after(&h->m_pos);
       return 0;
     }
@@ -146,17 +475,7 @@ int virus_rnd_init(PSI_table_handle *, bool) { return 0; }
 /* Set position of a cursor on a specific index */
 int virus_rnd_pos(PSI_table_handle *handle) {
   Virus_Table_Handle *h = (Virus_Table_Handle *)handle;
-  size_t index = h->m_pos.get_index();
-
-  if (index < virus_array.size()) {
-    Virus_record *record = virus_array[index];
-
-    if (record != nullptr) {
-      /* Make the current row from records_array buffer */
-      copy_record_virus(&h->current_row, record);
-    }
-  }
-
+  read_virus_element(h->m_pos.get_index(), &h->current_row);
   return 0;
 }
 
@@ -168,6 +487,72 @@ void virus_reset_position(PSI_table_handle *handle) {
   return;
 }
 
+int virus_index_init(PSI_table_handle *handle, unsigned int idx, bool,
+                     PSI_index_handle **index) {
+  static const char *key_names[VIRUS_INDEX_COUNT] = {"VIRUS", "USER", "HOST"};
+  Virus_Table_Handle *h = (Virus_Table_Handle *)handle;
+
+  if (idx >= VIRUS_INDEX_COUNT) return PFS_HA_ERR_WRONG_COMMAND;
+
+  h->index_num = idx;
+  h->m_key.m_name = key_names[idx];
+  h->m_key.m_value_buffer = h->m_key_buffer;
+  h->m_key.m_value_buffer_capacity = sizeof(h->m_key_buffer);
+  h->m_key.m_value_buffer_length = 0;
+  h->m_key_hash = 0;
+  *index = (PSI_index_handle *)h;
+  return 0;
+}
+
+int virus_index_read(PSI_index_handle *index, PSI_key_reader *reader,
+                     unsigned int, int find_flag) {
+  Virus_Table_Handle *h = (Virus_Table_Handle *)index;
+
+  pfs_string->read_key_string(reader, &h->m_key, find_flag);
+
+  /* Only an exact key can skip rows on their hash */
+  h->m_key_hash =
+      !h->m_key.m_is_null && h->m_key.m_find_flags == VIRUS_KEY_EXACT
+          ? virus_key_hash(h->m_key.m_value_buffer,
+                           h->m_key.m_value_buffer_length)
+          : 0;
+  return 0;
+}
+
+static bool virus_key_matches(Virus_Table_Handle *h) {
+  const char *value;
+
+  switch (h->index_num) {
+    case VIRUS_INDEX_VIRUS:
+      value = h->current_row.virus_name;
+      break;
+    case VIRUS_INDEX_USER:
+      value = h->current_row.virus_username;
+      break;
+    default:
+      value = h->current_row.virus_hostname;
+      break;
+  }
+  return pfs_string->match_key_string(false, value, strlen(value), &h->m_key);
+}
+
+int virus_index_next(PSI_table_handle *handle) {
+  Virus_Table_Handle *h = (Virus_Table_Handle *)handle;
+
+  for (h->m_pos.set_at(&h->m_next_pos); h->m_pos.get_index() < matches_size;
+       h->m_pos.set_after(&h->m_pos)) {
+    if (virus_key_may_match(h->m_pos.get_index(), h->index_num,
+                            h->m_key_hash) &&
+        read_virus_element(h->m_pos.get_index(), &h->current_row) &&
+        virus_key_matches(h)) {
+      h->m_next_pos.set_after(&h->m_pos);
+      return 0;
+    }
+  }
+
+  return PFS_HA_ERR_END_OF_FILE;
+}
+
 /* Read current row from the current_row and display them in the table */
 int virus_read_column_value(PSI_table_handle *handle, PSI_field *field,
                             unsigned int index) {
@@ -178,23 +563,26 @@ int virus_read_column_value(PSI_table_handle *handle, PSI_field *field,
       pfs_timestamp->set2(field, (h->current_row.virus_timestamp * 1000000));
       break;
     case 1: /* VIRUS */
-      pfs_string->set_varchar_utf8mb4(field, h->current_row.virus_name.c_str());
+      pfs_string->set_varchar_utf8mb4(field, h->current_row.virus_name);
       break;
     case 2: /* USER */
       pfs_string->set_varchar_utf8mb4(field,
-                                      h->current_row.virus_username.c_str());
+                                      h->current_row.virus_username);
       break;
     case 3: /* HOST */
       pfs_string->set_varchar_utf8mb4(field,
-                                      h->current_row.virus_hostname.c_str());
+                                      h->current_row.virus_hostname);
       break;
     case 4: /* CLAMVERSION */
       pfs_string->set_varchar_utf8mb4(field,
-                                      h->current_row.virus_engine.c_str());
+                                      h->current_row.virus_engine);
       break;
     case 5: /* SIGNATURES */
       pfs_integer->set(field, h->current_row.virus_signatures);
       break;
+    case 6: /* FILE, empty for payloads */
+      pfs_string->set_varchar_utf8mb4(field, h->current_row.virus_file);
+      break;
     default: /* We should never reach here */
       assert(0);
       break;
@@ -202,7 +590,7 @@ int virus_read_column_value(PSI_table_handle *handle, PSI_field *field,
   return 0;
 }
 
-unsigned long long virus_get_row_count(void) { return VIRUS_MAX_ROWS; }
+unsigned long long virus_get_row_count(void) { return virus_element_count(); }
 
 void init_virus_share(PFS_engine_table_share_proxy *share) {
   /* Instantiate and initialize PFS_engine_table_share_proxy */
@@ -210,7 +598,9 @@ void init_virus_share(PFS_engine_table_share_proxy *share) {
   share->m_table_name_length = 16;
   share->m_table_definition =
       "`LOGGED` timestamp, `VIRUS` VARCHAR(100), `USER` VARCHAR(32), "
-      "`HOST` VARCHAR(255), `CLAMVERSION` VARCHAR(10), `SIGNATURES` INT";
+      "`HOST` VARCHAR(255), `CLAMVERSION` VARCHAR(10), `SIGNATURES` INT, "
+      "`FILE` VARCHAR(1024), KEY `VIRUS` (`VIRUS`), KEY `USER` (`USER`), "
+      "KEY `HOST` (`HOST`)";
   share->m_ref_length = sizeof(Virus_POS);
   share->m_acl = READONLY;
   share->get_row_count = virus_get_row_count;
@@ -218,8 +608,9 @@ void init_virus_share(PFS_engine_table_share_proxy *share) {
 
   /* Initialize PFS_engine_table_proxy */
   share->m_proxy_engine_table = {virus_rnd_next, virus_rnd_init, virus_rnd_pos,
-                                 nullptr, nullptr, nullptr,
-                                 virus_read_column_value, virus_reset_position,
+                                 virus_index_init, virus_index_read,
+                                 virus_index_next, virus_read_column_value,
+                                 virus_reset_position,
                                  /* READONLY TABLE */
                                  nullptr, /* write_column_value */
                                  nullptr, /* write_row_values */
@@ -228,3 +619,420 @@ void init_virus_share(PFS_engine_table_share_proxy *share) {
                                  nullptr, /* delete_row_values */
                                  virus_open_table, virus_close_table};
 }
+
+/*
+  DATA access for performance_schema.viruscan_scan_queue
+*/
+
+PSI_table_handle *queue_open_table(PSI_pos **pos) {
+  Queue_Table_Handle *temp = new Queue_Table_Handle();
+  *pos = (PSI_pos *)(&temp->m_pos);
+  return (PSI_table_handle *)temp;
+}
+
+void queue_close_table(PSI_table_handle *handle) {
+  Queue_Table_Handle *temp = (Queue_Table_Handle *)handle;
+  delete temp;
+}
+
+int queue_rnd_next(PSI_table_handle *handle) {
+  Queue_Table_Handle *h = (Queue_Table_Handle *)handle;
+
+  /* Skip the slots that never held a ticket */
+  for (h->m_pos.set_at(&h->m_next_pos); h->m_pos.get_index() < ticket_capacity();
+       h->m_pos.set_after(&h->m_pos)) {
+    if (ticket_read(h->m_pos.get_index(), &h->current_row)) {
+      h->m_next_pos.set_after(&h->m_pos);
+      return 0;
+    }
+  }
+
+  return PFS_HA_ERR_END_OF_FILE;
+}
+
+int queue_rnd_init(PSI_table_handle *, bool) { return 0; }
+
+int queue_rnd_pos(PSI_table_handle *handle) {
+  Queue_Table_Handle *h = (Queue_Table_Handle *)handle;
+  ticket_read(h->m_pos.get_index(), &h->current_row);
+  return 0;
+}
+
+void queue_reset_position(PSI_table_handle *handle) {
+  Queue_Table_Handle *h = (Queue_Table_Handle *)handle;
+  h->m_pos.reset();
+  h->m_next_pos.reset();
+  return;
+}
+
+int queue_read_column_value(PSI_table_handle *handle, PSI_field *field,
+                            unsigned int index) {
+  Queue_Table_Handle *h = (Queue_Table_Handle *)handle;
+  const Scan_ticket &row = h->current_row;
+
+  switch (index) {
+    case 0: /* TICKET */
+      pfs_bigint->set_unsigned(field, {row.id, false});
+      break;
+    case 1: /* STATE */
+      pfs_string->set_varchar_utf8mb4(field, ticket_state_name(row.state));
+      break;
+    case 2: /* VERDICT */
+      pfs_string->set_varchar_utf8mb4(field, row.verdict);
+      break;
+    case 3: /* BYTES */
+      pfs_bigint->set_unsigned(field, {row.bytes, false});
+      break;
+    case 4: /* QUEUE_TIME, in microseconds */
+      pfs_bigint->set_unsigned(
+          field, {row.started_us ? row.started_us - row.enqueued_us : 0,
+                  row.started_us == 0});
+      break;
+    case 5: /* SCAN_TIME, in microseconds */
+      pfs_bigint->set_unsigned(
+          field, {row.finished_us ? row.finished_us - row.started_us : 0,
+                  row.finished_us == 0});
+      break;
+    default: /* We should never reach here */
+      assert(0);
+      break;
+  }
+  return 0;
+}
+
+unsigned long long queue_get_row_count(void) { return ticket_capacity(); }
+
+void init_queue_share(PFS_engine_table_share_proxy *share) {
+  share->m_table_name = "viruscan_scan_queue";
+  share->m_table_name_length = 19;
+  share->m_table_definition =
+      "`TICKET` BIGINT UNSIGNED, `STATE` VARCHAR(10), `VERDICT` VARCHAR(100), "
+      "`BYTES` BIGINT UNSIGNED, `QUEUE_TIME` BIGINT UNSIGNED, "
+      "`SCAN_TIME` BIGINT UNSIGNED";
+  share->m_ref_length = sizeof(Virus_POS);
+  share->m_acl = READONLY;
+  share->get_row_count = queue_get_row_count;
+  share->delete_all_rows = nullptr; /* READONLY TABLE */
+
+  share->m_proxy_engine_table = {queue_rnd_next, queue_rnd_init, queue_rnd_pos,
+                                 nullptr, nullptr, nullptr,
+                                 queue_read_column_value, queue_reset_position,
+                                 /* READONLY TABLE */
+                                 nullptr, /* write_column_value */
+                                 nullptr, /* write_row_values */
+                                 nullptr, /* update_column_value */
+                                 nullptr, /* update_row_values */
+                                 nullptr, /* delete_row_values */
+                                 queue_open_table, queue_close_table};
+}
+
+/*
+  DATA access for performance_schema.viruscan_scan_latency
+*/
+
+PSI_table_handle *latency_open_table(PSI_pos **pos) {
+  Latency_Table_Handle *temp = new Latency_Table_Handle();
+  *pos = (PSI_pos *)(&temp->m_pos);
+  return (PSI_table_handle *)temp;
+}
+
+void latency_close_table(PSI_table_handle *handle) {
+  Latency_Table_Handle *temp = (Latency_Table_Handle *)handle;
+  delete temp;
+}
+
+int latency_rnd_next(PSI_table_handle *handle) {
+  Latency_Table_Handle *h = (Latency_Table_Handle *)handle;
+  h->m_pos.set_at(&h->m_next_pos);
+
+  if (latency_read(h->m_pos.get_index(), &h->current_row)) {
+    h->m_next_pos.set_after(&h->m_pos);
+    return 0;
+  }
+
+  return PFS_HA_ERR_END_OF_FILE;
+}
+
+int latency_rnd_init(PSI_table_handle *, bool) { return 0; }
+
+int latency_rnd_pos(PSI_table_handle *handle) {
+  Latency_Table_Handle *h = (Latency_Table_Handle *)handle;
+  latency_read(h->m_pos.get_index(), &h->current_row);
+  return 0;
+}
+
+void latency_reset_position(PSI_table_handle *handle) {
+  Latency_Table_Handle *h = (Latency_Table_Handle *)handle;
+  h->m_pos.reset();
+  h->m_next_pos.reset();
+  return;
+}
+
+int latency_read_column_value(PSI_table_handle *handle, PSI_field *field,
+                              unsigned int index) {
+  Latency_Table_Handle *h = (Latency_Table_Handle *)handle;
+  const Latency_row &row = h->current_row;
+
+  switch (index) {
+    case 0: /* SIZE_CLASS */
+      pfs_string->set_varchar_utf8mb4(field, size_class_name(row.size_class));
+      break;
+    case 1: /* VERDICT */
+      pfs_string->set_varchar_utf8mb4(field, verdict_name(row.verdict));
+      break;
+    case 2: /* COUNT_SCAN */
+      pfs_bigint->set_unsigned(field, {row.count, false});
+      break;
+    case 3: /* SUM_TIME, in microseconds */
+      pfs_bigint->set_unsigned(field, {row.sum_us, false});
+      break;
+    case 4: /* P50_TIME */
+      pfs_bigint->set_unsigned(field, {row.p50_us, row.count == 0});
+      break;
+    case 5: /* P95_TIME */
+      pfs_bigint->set_unsigned(field, {row.p95_us, row.count == 0});
+      break;
+    case 6: /* P99_TIME */
+      pfs_bigint->set_unsigned(field, {row.p99_us, row.count == 0});
+      break;
+    case 7: /* MAX_TIME */
+      pfs_bigint->set_unsigned(field, {row.max_us, row.count == 0});
+      break;
+    case 8: /* BYTES_SCANNED */
+      pfs_bigint->set_unsigned(field, {row.bytes, false});
+      break;
+    default: /* We should never reach here */
+      assert(0);
+      break;
+  }
+  return 0;
+}
+
+unsigned long long latency_get_row_count(void) { return latency_row_count(); }
+
+void init_latency_share(PFS_engine_table_share_proxy *share) {
+  share->m_table_name = "viruscan_scan_latency";
+  share->m_table_name_length = 21;
+  share->m_table_definition =
+      "`SIZE_CLASS` VARCHAR(8), `VERDICT` VARCHAR(10), "
+      "`COUNT_SCAN` BIGINT UNSIGNED, `SUM_TIME` BIGINT UNSIGNED, "
+      "`P50_TIME` BIGINT UNSIGNED, `P95_TIME` BIGINT UNSIGNED, "
+      "`P99_TIME` BIGINT UNSIGNED, `MAX_TIME` BIGINT UNSIGNED, "
+      "`BYTES_SCANNED` BIGINT UNSIGNED";
+  share->m_ref_length = sizeof(Virus_POS);
+  share->m_acl = READONLY;
+  share->get_row_count = latency_get_row_count;
+  share->delete_all_rows = nullptr; /* READONLY TABLE */
+
+  share->m_proxy_engine_table = {latency_rnd_next, latency_rnd_init,
+                                 latency_rnd_pos, nullptr, nullptr, nullptr,
+                                 latency_read_column_value,
+                                 latency_reset_position,
+                                 /* READONLY TABLE */
+                                 nullptr, /* write_column_value */
+                                 nullptr, /* write_row_values */
+                                 nullptr, /* update_column_value */
+                                 nullptr, /* update_row_values */
+                                 nullptr, /* delete_row_values */
+                                 latency_open_table, latency_close_table};
+}
+
+/*
+  DATA access for performance_schema.viruscan_databases, the databases of
+  the engine generation serving scans
+*/
+
+PSI_table_handle *database_open_table(PSI_pos **pos) {
+  Database_Table_Handle *temp = new Database_Table_Handle();
+  *pos = (PSI_pos *)(&temp->m_pos);
+  return (PSI_table_handle *)temp;
+}
+
+void database_close_table(PSI_table_handle *handle) {
+  Database_Table_Handle *temp = (Database_Table_Handle *)handle;
+  delete temp;
+}
+
+int database_rnd_next(PSI_table_handle *handle) {
+  Database_Table_Handle *h = (Database_Table_Handle *)handle;
+  h->m_pos.set_at(&h->m_next_pos);
+
+  if (database_read(h->m_pos.get_index(), &h->current_row)) {
+    h->m_next_pos.set_after(&h->m_pos);
+    return 0;
+  }
+
+  return PFS_HA_ERR_END_OF_FILE;
+}
+
+int database_rnd_init(PSI_table_handle *, bool) { return 0; }
+
+int database_rnd_pos(PSI_table_handle *handle) {
+  Database_Table_Handle *h = (Database_Table_Handle *)handle;
+  database_read(h->m_pos.get_index(), &h->current_row);
+  return 0;
+}
+
+void database_reset_position(PSI_table_handle *handle) {
+  Database_Table_Handle *h = (Database_Table_Handle *)handle;
+  h->m_pos.reset();
+  h->m_next_pos.reset();
+  return;
+}
+
+int database_read_column_value(PSI_table_handle *handle, PSI_field *field,
+                               unsigned int index) {
+  Database_Table_Handle *h = (Database_Table_Handle *)handle;
+  const Database_info &row = h->current_row;
+
+  switch (index) {
+    case 0: /* DATABASE */
+      pfs_string->set_varchar_utf8mb4(field, row.name.c_str());
+      break;
+    case 1: /* STATUS */
+      pfs_string->set_varchar_utf8mb4(field, database_status_name(row.status));
+      break;
+    case 2: /* SIGNATURES */
+      pfs_bigint->set_unsigned(field, {row.signatures, false});
+      break;
+    default: /* We should never reach here */
+      assert(0);
+      break;
+  }
+  return 0;
+}
+
+unsigned long long database_get_row_count(void) { return database_count(); }
+
+void init_database_share(PFS_engine_table_share_proxy *share) {
+  share->m_table_name = "viruscan_databases";
+  share->m_table_name_length = 18;
+  share->m_table_definition =
+      "`DATABASE` VARCHAR(255), `STATUS` VARCHAR(10), "
+      "`SIGNATURES` BIGINT UNSIGNED";
+  share->m_ref_length = sizeof(Virus_POS);
+  share->m_acl = READONLY;
+  share->get_row_count = database_get_row_count;
+  share->delete_all_rows = nullptr; /* READONLY TABLE */
+
+  share->m_proxy_engine_table = {database_rnd_next, database_rnd_init,
+                                 database_rnd_pos, nullptr, nullptr, nullptr,
+                                 database_read_column_value,
+                                 database_reset_position,
+                                 /* READONLY TABLE */
+                                 nullptr, /* write_column_value */
+                                 nullptr, /* write_row_values */
+                                 nullptr, /* update_column_value */
+                                 nullptr, /* update_row_values */
+                                 nullptr, /* delete_row_values */
+                                 database_open_table, database_close_table};
+}
+
+/*
+  DATA access for performance_schema.viruscan_matches_summary
+*/
+
+PSI_table_handle *summary_open_table(PSI_pos **pos) {
+  Summary_Table_Handle *temp = new Summary_Table_Handle();
+  *pos = (PSI_pos *)(&temp->m_pos);
+  return (PSI_table_handle *)temp;
+}
+
+void summary_close_table(PSI_table_handle *handle) {
+  Summary_Table_Handle *temp = (Summary_Table_Handle *)handle;
+  delete temp;
+}
+
+int summary_rnd_next(PSI_table_handle *handle) {
+  Summary_Table_Handle *h = (Summary_Table_Handle *)handle;
+
+  /* Skip the free entries */
+  for (h->m_pos.set_at(&h->m_next_pos);
+       h->m_pos.get_index() < summary_capacity();
+       h->m_pos.set_after(&h->m_pos)) {
+    if (read_summary_element(h->m_pos.get_index(), &h->current_row)) {
+      h->m_next_pos.set_after(&h->m_pos);
+      return 0;
+    }
+  }
+
+  return PFS_HA_ERR_END_OF_FILE;
+}
+
+int summary_rnd_init(PSI_table_handle *, bool) { return 0; }
+
+int summary_rnd_pos(PSI_table_handle *handle) {
+  Summary_Table_Handle *h = (Summary_Table_Handle *)handle;
+  read_summary_element(h->m_pos.get_index(), &h->current_row);
+  return 0;
+}
+
+void summary_reset_position(PSI_table_handle *handle) {
+  Summary_Table_Handle *h = (Summary_Table_Handle *)handle;
+  h->m_pos.reset();
+  h->m_next_pos.reset();
+  return;
+}
+
+int summary_read_column_value(PSI_table_handle *handle, PSI_field *field,
+                              unsigned int index) {
+  Summary_Table_Handle *h = (Summary_Table_Handle *)handle;
+  const Summary_row &row = h->current_row;
+
+  switch (index) {
+    case 0: /* VIRUS */
+      pfs_string->set_varchar_utf8mb4(field, row.virus_name);
+      break;
+    case 1: /* USER */
+      pfs_string->set_varchar_utf8mb4(field, row.virus_username);
+      break;
+    case 2: /* HOST */
+      pfs_string->set_varchar_utf8mb4(field, row.virus_hostname);
+      break;
+    case 3: /* COUNT_MATCHES */
+      pfs_bigint->set_unsigned(field, {row.count, false});
+      break;
+    case 4: /* SUM_BYTES */
+      pfs_bigint->set_unsigned(field, {row.bytes, false});
+      break;
+    case 5: /* FIRST_SEEN */
+      pfs_timestamp->set2(field, row.first_seen * 1000000);
+      break;
+    case 6: /* LAST_SEEN */
+      pfs_timestamp->set2(field, row.last_seen * 1000000);
+      break;
+    default: /* We should never reach here */
+      assert(0);
+      break;
+  }
+  return 0;
+}
+
+unsigned long long summary_get_row_count(void) {
+  return summary_element_count();
+}
+
+void init_summary_share(PFS_engine_table_share_proxy *share) {
+  share->m_table_name = "viruscan_matches_summary";
+  share->m_table_name_length = 24;
+  share->m_table_definition =
+      "`VIRUS` VARCHAR(100), `USER` VARCHAR(32), `HOST` VARCHAR(255), "
+      "`COUNT_MATCHES` BIGINT UNSIGNED, `SUM_BYTES` BIGINT UNSIGNED, "
+      "`FIRST_SEEN` timestamp, `LAST_SEEN` timestamp";
+  share->m_ref_length = sizeof(Virus_POS);
+  share->m_acl = READONLY;
+  share->get_row_count = summary_get_row_count;
+  share->delete_all_rows = nullptr; /* READONLY TABLE */
+
+  share->m_proxy_engine_table = {summary_rnd_next, summary_rnd_init,
+                                 summary_rnd_pos, nullptr, nullptr, nullptr,
+                                 summary_read_column_value,
+                                 summary_reset_position,
+                                 /* READONLY TABLE */
+                                 nullptr, /* write_column_value */
+                                 nullptr, /* write_row_values */
+                                 nullptr, /* update_column_value */
+                                 nullptr, /* update_row_values */
+                                 nullptr, /* delete_row_values */
+                                 summary_open_table, summary_close_table};
+}
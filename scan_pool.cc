@@ -0,0 +1,177 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+/*
+  Scan worker pool
+
+  A fixed set of threads sharing the published engine. The job queue is
+  bounded: submit() blocks while it is full, so a producer can never buffer
+  more payloads than the pool is able to scan.
+*/
+
+unsigned int scan_threads = 0;
+
+Scan_pool scan_pool;
+
+void Scan_pool::start(unsigned int threads, size_t queue_size) {
+  mysql_mutex_init(key_mutex_scan_pool, &m_lock, nullptr);
+  mysql_cond_init(key_cond_scan_pool, &m_not_empty);
+  mysql_cond_init(key_cond_scan_pool, &m_not_full);
+  m_capacity = queue_size;
+  m_stopping = false;
+
+  for (unsigned int i = 0; i < threads; i++)
+    m_workers.emplace_back(&Scan_pool::worker, this);
+}
+
+void Scan_pool::stop() {
+  mysql_mutex_lock(&m_lock);
+  m_stopping = true;
+  mysql_cond_broadcast(&m_not_empty);
+  mysql_cond_broadcast(&m_not_full);
+  mysql_mutex_unlock(&m_lock);
+
+  /* Workers drain the queue before exiting */
+  for (std::thread &worker : m_workers) worker.join();
+  m_workers.clear();
+
+  mysql_cond_destroy(&m_not_full);
+  mysql_cond_destroy(&m_not_empty);
+  mysql_mutex_destroy(&m_lock);
+}
+
+void Scan_pool::submit(std::function<void()> job) {
+  mysql_mutex_lock(&m_lock);
+  while (m_jobs.size() >= m_capacity && !m_stopping)
+    mysql_cond_wait(&m_not_full, &m_lock);
+
+  if (m_stopping || m_workers.empty()) {
+    /* Nobody left to run it, do it on the caller thread */
+    mysql_mutex_unlock(&m_lock);
+    job();
+    return;
+  }
+
+  m_jobs.push_back(std::move(job));
+  mysql_cond_signal(&m_not_empty);
+  mysql_mutex_unlock(&m_lock);
+}
+
+void Scan_pool::worker() {
+  for (;;) {
+    mysql_mutex_lock(&m_lock);
+    while (m_jobs.empty() && !m_stopping)
+      mysql_cond_wait(&m_not_empty, &m_lock);
+
+    if (m_jobs.empty()) {
+      mysql_mutex_unlock(&m_lock);
+      return;
+    }
+
+    std::function<void()> job = std::move(m_jobs.front());
+    m_jobs.pop_front();
+    mysql_cond_signal(&m_not_full);
+    mysql_mutex_unlock(&m_lock);
+
+    job();
+  }
+}
+
+/*
+  Batch of scans submitted to a pool, and the summary of their verdicts
+*/
+
+Scan_batch::Scan_batch(size_t max_in_flight, Scan_pool *pool)
+    : m_pool(pool), m_max_in_flight(max_in_flight) {
+  mysql_mutex_init(key_mutex_scan_batch, &m_lock, nullptr);
+  mysql_cond_init(key_cond_scan_batch, &m_done);
+}
+
+Scan_batch::~Scan_batch() {
+  wait();
+  mysql_cond_destroy(&m_done);
+  mysql_mutex_destroy(&m_lock);
+}
+
+void Scan_batch::submit(std::function<void()> job) {
+  mysql_mutex_lock(&m_lock);
+  while (m_in_flight >= m_max_in_flight) mysql_cond_wait(&m_done, &m_lock);
+  m_in_flight++;
+  mysql_mutex_unlock(&m_lock);
+
+  m_pool->submit([this, job] {
+    job();
+
+    mysql_mutex_lock(&m_lock);
+    m_in_flight--;
+    mysql_cond_broadcast(&m_done);
+    mysql_mutex_unlock(&m_lock);
+  });
+}
+
+void Scan_batch::wait() {
+  mysql_mutex_lock(&m_lock);
+  while (m_in_flight > 0) mysql_cond_wait(&m_done, &m_lock);
+  mysql_mutex_unlock(&m_lock);
+}
+
+void Scan_batch::record(int return_code, const char *virus_name) {
+  mysql_mutex_lock(&m_lock);
+  m_rows++;
+  if (return_code == CL_VIRUS) {
+    m_infected++;
+    bool known = false;
+    for (const std::string &name : m_virus_names)
+      if (name == virus_name) known = true;
+    if (!known && m_virus_names.size() < VIRUS_BATCH_MAX_NAMES)
+      m_virus_names.push_back(virus_name);
+  } else if (return_code != CL_CLEAN) {
+    m_errors++;
+  }
+  mysql_mutex_unlock(&m_lock);
+}
+
+void Scan_batch::reset() {
+  wait();
+
+  mysql_mutex_lock(&m_lock);
+  m_rows = m_infected = m_errors = 0;
+  m_virus_names.clear();
+  mysql_mutex_unlock(&m_lock);
+}
+
+std::string Scan_batch::summary(const char *unit) {
+  wait();
+
+  mysql_mutex_lock(&m_lock);
+  std::string summary = std::string(unit) + " scanned: " +
+                        std::to_string(m_rows) +
+                        ", infected: " + std::to_string(m_infected) +
+                        ", errors: " + std::to_string(m_errors);
+  for (size_t i = 0; i < m_virus_names.size(); i++)
+    summary += (i == 0 ? ", viruses: " : ", ") + m_virus_names[i];
+  mysql_mutex_unlock(&m_lock);
+
+  return summary;
+}
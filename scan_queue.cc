@@ -0,0 +1,178 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+#include <mysql/plugin.h> /* thd_killed */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+/*
+  Asynchronous scan tickets
+
+  virus_scan_async() returns a ticket id right away, the scan itself runs on
+  the async_pool workers. Tickets live in a fixed ring of
+  viruscan.async_queue_size slots, ticket N using slot N % size. Completed
+  tickets are overwritten oldest first; a slot whose ticket is still queued
+  or scanning is never reused, which bounds the number of pending payloads.
+  Their size is bounded too, by viruscan.async_queue_max_bytes.
+
+  A ticket belongs to the account that created it, virus_scan_wait() on the
+  ticket of another account reports it as unknown.
+*/
+
+unsigned int async_threads = VIRUS_ASYNC_DEFAULT_THREADS;
+unsigned int async_queue_size = VIRUS_ASYNC_DEFAULT_QUEUE_SIZE;
+unsigned long long async_queue_max_bytes = VIRUS_ASYNC_DEFAULT_QUEUE_MAX_BYTES;
+
+Scan_pool async_pool;
+
+static mysql_mutex_t LOCK_tickets;
+static mysql_cond_t COND_tickets;
+static std::vector<Scan_ticket> tickets;
+static unsigned long long next_ticket = 1;
+/* Bytes of the queued and scanning tickets */
+static unsigned long long pending_bytes = 0;
+
+static unsigned long long now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+const char *ticket_state_name(enum ticket_state state) {
+  static const char *names[] = {"free", "queued", "scanning", "done",
+                                "error"};
+  return names[state];
+}
+
+void init_tickets() {
+  mysql_mutex_init(key_mutex_virus_tickets, &LOCK_tickets, nullptr);
+  mysql_cond_init(key_cond_virus_tickets, &COND_tickets);
+  tickets.assign(async_queue_size, Scan_ticket());
+  next_ticket = 1;
+  pending_bytes = 0;
+}
+
+void cleanup_tickets() {
+  tickets.clear();
+  tickets.shrink_to_fit();
+  mysql_cond_destroy(&COND_tickets);
+  mysql_mutex_destroy(&LOCK_tickets);
+}
+
+unsigned long long ticket_create(const char *account,
+                                 unsigned long long bytes) {
+  unsigned long long id = 0;
+
+  mysql_mutex_lock(&LOCK_tickets);
+  Scan_ticket &slot = tickets[next_ticket % tickets.size()];
+  bool over_budget = async_queue_max_bytes != 0 &&
+                     pending_bytes + bytes > async_queue_max_bytes;
+  if (slot.state != TICKET_QUEUED && slot.state != TICKET_SCANNING &&
+      !over_budget) {
+    id = next_ticket++;
+    slot = Scan_ticket();
+    slot.id = id;
+    slot.state = TICKET_QUEUED;
+    snprintf(slot.account, sizeof(slot.account), "%s", account);
+    slot.bytes = bytes;
+    slot.enqueued_us = now_us();
+    pending_bytes += bytes;
+  }
+  mysql_mutex_unlock(&LOCK_tickets);
+
+  return id;
+}
+
+void ticket_start(unsigned long long id) {
+  mysql_mutex_lock(&LOCK_tickets);
+  Scan_ticket &slot = tickets[id % tickets.size()];
+  if (slot.id == id) {
+    slot.state = TICKET_SCANNING;
+    slot.started_us = now_us();
+  }
+  mysql_mutex_unlock(&LOCK_tickets);
+}
+
+void ticket_finish(unsigned long long id, enum ticket_state state,
+                   const char *verdict) {
+  mysql_mutex_lock(&LOCK_tickets);
+  Scan_ticket &slot = tickets[id % tickets.size()];
+  if (slot.id == id) {
+    if (slot.state == TICKET_QUEUED || slot.state == TICKET_SCANNING)
+      pending_bytes -= std::min(pending_bytes, slot.bytes);
+    slot.state = state;
+    slot.finished_us = now_us();
+    snprintf(slot.verdict, sizeof(slot.verdict), "%s", verdict);
+  }
+  mysql_cond_broadcast(&COND_tickets);
+  mysql_mutex_unlock(&LOCK_tickets);
+}
+
+bool ticket_wait(unsigned long long id, const char *account,
+                 unsigned long long timeout_ms, MYSQL_THD thd,
+                 Scan_ticket *ticket) {
+  bool found = false;
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+
+  mysql_mutex_lock(&LOCK_tickets);
+  for (;;) {
+    const Scan_ticket &slot = tickets[id % tickets.size()];
+    found = id != 0 && slot.id == id && strcmp(slot.account, account) == 0;
+    if (!found || slot.state == TICKET_DONE || slot.state == TICKET_FAILED)
+      break;
+
+    /* In slices, so that KILL QUERY is noticed */
+    long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - std::chrono::steady_clock::now())
+                         .count();
+    if (left <= 0 || (thd != nullptr && thd_killed(thd))) break;
+    struct timespec abstime;
+    set_timespec_nsec(
+        &abstime,
+        std::min<long long>(left, VIRUS_KILL_CHECK_INTERVAL) * 1000000ULL);
+    mysql_cond_timedwait(&COND_tickets, &LOCK_tickets, &abstime);
+  }
+  if (found) *ticket = tickets[id % tickets.size()];
+  mysql_mutex_unlock(&LOCK_tickets);
+
+  return found;
+}
+
+bool ticket_read(size_t index, Scan_ticket *ticket) {
+  bool found = false;
+
+  mysql_mutex_lock(&LOCK_tickets);
+  if (index < tickets.size() && tickets[index].state != TICKET_FREE) {
+    *ticket = tickets[index];
+    found = true;
+  }
+  mysql_mutex_unlock(&LOCK_tickets);
+
+  return found;
+}
+
+size_t ticket_capacity() { return tickets.size(); }
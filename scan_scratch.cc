@@ -0,0 +1,82 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+/*
+  Scan scratch pool
+
+  A scan run on a connection thread needs an account name for the admission
+  control and, for virus_scan_json(), a Scan_context. They are taken from
+  VIRUS_SCRATCH_POOL_SIZE preallocated scratches instead of the heap: the
+  strings of a returned scratch keep their buffers, so once warm a scan
+  does not allocate.
+
+  Not thread_local: the component can be uninstalled while the server
+  threads live on, and their thread_local destructors would then run code
+  that is no longer mapped. A scratch is claimed with an atomic flag,
+  starting at the slots of the CPU the caller runs on. When they are all
+  taken, the caller gets one of its own from the heap.
+*/
+
+struct alignas(64) Scratch_slot {
+  std::atomic<bool> busy{false};
+  Scan_scratch scratch;
+};
+
+static Scratch_slot scratch_pool[VIRUS_SCRATCH_POOL_SIZE];
+
+Scan_scratch_ref::Scan_scratch_ref() : m_scratch(nullptr), m_slot(-1) {
+  size_t first = stats_shard_index() *
+                 (VIRUS_SCRATCH_POOL_SIZE / VIRUS_STATS_SHARDS);
+
+  for (size_t i = 0; i < VIRUS_SCRATCH_POOL_SIZE; i++) {
+    size_t slot = (first + i) % VIRUS_SCRATCH_POOL_SIZE;
+    if (!scratch_pool[slot].busy.load(std::memory_order_relaxed) &&
+        !scratch_pool[slot].busy.exchange(true, std::memory_order_acquire)) {
+      m_scratch = &scratch_pool[slot].scratch;
+      m_slot = (int)slot;
+      break;
+    }
+  }
+  if (m_scratch == nullptr) m_scratch = new Scan_scratch();
+
+  m_scratch->account[0] = '\0';
+  m_scratch->context.reset();
+}
+
+Scan_scratch_ref::~Scan_scratch_ref() {
+  if (m_slot < 0)
+    delete m_scratch;
+  else
+    scratch_pool[m_slot].busy.store(false, std::memory_order_release);
+}
+
+/* The pool is static, give the memory of its strings back */
+void cleanup_scratch_pool() {
+  for (Scratch_slot &slot : scratch_pool) {
+    slot.scratch.context.matches.clear();
+    slot.scratch.context.matches.shrink_to_fit();
+    slot.scratch.context.file_type.clear();
+    slot.scratch.context.file_type.shrink_to_fit();
+  }
+}
@@ -0,0 +1,220 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+#include <cstring>
+
+/*
+  Content sniffing
+
+  The auto profile looks at the first bytes of a payload before ClamAV does
+  and leaves out the parsers that cannot apply to its class. A leaf format,
+  text, an image or an executable, keeps the parsers of what can hide in it
+  (an archive appended to an image, an installer in an executable); a
+  container, a PDF, an Office document or an archive, can hold anything and
+  keeps them all, as does a payload of no known class. Plain text is only
+  text when every byte of it is: a script followed by a tarball is unknown.
+  Small enough, plain text is matched against the raw signatures only.
+
+  The class is the only thing sniffed: ClamAV still types the payload and
+  its embedded files itself, within the parsers left.
+*/
+
+/* The image parsers came with ClamAV 0.104 */
+#ifndef CL_SCAN_PARSE_IMAGE
+#define CL_SCAN_PARSE_IMAGE 0
+#endif
+#ifndef CL_SCAN_PARSE_IMAGE_FUZZY_HASH
+#define CL_SCAN_PARSE_IMAGE_FUZZY_HASH 0
+#endif
+
+/* Parsers a class can use, in the order of enum content_class */
+static constexpr unsigned int content_parsers[CONTENT_CLASS_COUNT] = {
+    /* tiny_text */
+    0,
+    /* text: markup, mail with its attachments, a PDF within */
+    CL_SCAN_PARSE_HTML | CL_SCAN_PARSE_MAIL | CL_SCAN_PARSE_XMLDOCS |
+        CL_SCAN_PARSE_PDF,
+    /* image: and whatever is appended to it */
+    CL_SCAN_PARSE_IMAGE | CL_SCAN_PARSE_IMAGE_FUZZY_HASH |
+        CL_SCAN_PARSE_ARCHIVE | CL_SCAN_PARSE_PE | CL_SCAN_PARSE_ELF,
+    /* pdf */
+    ~0U,
+    /* ole2 */
+    ~0U,
+    /* ooxml */
+    ~0U,
+    /* archive */
+    ~0U,
+    /* executable: self-extracting archives and installers */
+    CL_SCAN_PARSE_PE | CL_SCAN_PARSE_ELF | CL_SCAN_PARSE_ARCHIVE,
+    /* unknown */
+    ~0U};
+
+static const char *content_class_names[CONTENT_CLASS_COUNT] = {
+    "tiny_text", "text",    "image",      "pdf",    "ole2",
+    "ooxml",     "archive", "executable", "unknown"};
+
+struct Magic {
+  const char *bytes;
+  size_t length;
+  enum content_class content;
+};
+
+#define MAGIC(bytes, content) \
+  { bytes, sizeof(bytes) - 1, content }
+
+/* Matched at the start of the payload, first match wins */
+static const Magic magics[] = {
+    MAGIC("\xFF\xD8\xFF", CONTENT_IMAGE),
+    MAGIC("\x89PNG\r\n\x1A\n", CONTENT_IMAGE),
+    MAGIC("GIF87a", CONTENT_IMAGE),
+    MAGIC("GIF89a", CONTENT_IMAGE),
+    MAGIC("II*\0", CONTENT_IMAGE),
+    MAGIC("MM\0*", CONTENT_IMAGE),
+    MAGIC("\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", CONTENT_OLE2),
+    MAGIC("PK\x03\x04", CONTENT_ARCHIVE),
+    MAGIC("PK\x05\x06", CONTENT_ARCHIVE),
+    MAGIC("Rar!\x1A\x07", CONTENT_ARCHIVE),
+    MAGIC("7z\xBC\xAF\x27\x1C", CONTENT_ARCHIVE),
+    MAGIC("\x1F\x8B", CONTENT_ARCHIVE),
+    MAGIC("BZh", CONTENT_ARCHIVE),
+    MAGIC("\xFD" "7zXZ\0", CONTENT_ARCHIVE),
+    MAGIC("MSCF", CONTENT_ARCHIVE),
+    MAGIC("\x7F" "ELF", CONTENT_EXECUTABLE),
+    MAGIC("MZ", CONTENT_EXECUTABLE),
+    MAGIC("\xFE\xED\xFA\xCE", CONTENT_EXECUTABLE),
+    MAGIC("\xFE\xED\xFA\xCF", CONTENT_EXECUTABLE),
+    MAGIC("\xCE\xFA\xED\xFE", CONTENT_EXECUTABLE),
+    MAGIC("\xCF\xFA\xED\xFE", CONTENT_EXECUTABLE)};
+
+#undef MAGIC
+
+/* Text ClamAV decodes into embedded files: RTF objects, BinHex */
+static const char *text_containers[] = {
+    "{\\rt", "(This file must be converted with BinHex"};
+
+/* The first entry of an Office Open XML document names its content types */
+static const char ooxml_entry[] = "[Content_Types].xml";
+
+static bool has_prefix(const char *head, size_t head_length, const char *bytes,
+                       size_t length) {
+  return head_length >= length && memcmp(head, bytes, length) == 0;
+}
+
+/* ClamAV takes a PDF header anywhere in the first kilobyte */
+static bool is_pdf(const char *head, size_t head_length) {
+  static const char pdf[] = "%PDF-";
+  size_t length = head_length < 1024 ? head_length : 1024;
+
+  for (const char *at = head;
+       (at = (const char *)memchr(at, '%', length - (at - head))) != nullptr;
+       at++) {
+    if (has_prefix(at, length - (at - head), pdf, sizeof(pdf) - 1))
+      return true;
+  }
+  return false;
+}
+
+/*
+ * No NUL and no control character but the whitespaces, UTF-8 is text. Looked
+ * at a page at a time: the loop over a page has no exit and vectorizes.
+ */
+static bool is_text(const char *data, size_t length) {
+  const unsigned char *bytes = (const unsigned char *)data;
+
+  for (size_t page = 0; page < length; page += 4096) {
+    size_t end = length - page < 4096 ? length : page + 4096;
+    bool text = true;
+
+    for (size_t i = page; i < end; i++) {
+      unsigned char c = bytes[i];
+      text &= (c >= 0x20 && c != 0x7F) ||
+              (c >= '\t' && c <= '\r' && c != '\v');
+    }
+    if (!text) return false;
+  }
+  return true;
+}
+
+/* An executable header has NULs in it, "MZ" may just be how a text starts */
+static bool is_executable(const char *head, size_t head_length) {
+  return memchr(head, '\0', head_length < 64 ? head_length : 64) != nullptr;
+}
+
+/* A ZIP whose first entry is [Content_Types].xml */
+static bool is_ooxml(const char *head, size_t head_length) {
+  static const size_t name = 30;
+
+  return head_length >= name + sizeof(ooxml_entry) - 1 &&
+         memcmp(head, "PK\x03\x04", 4) == 0 &&
+         memcmp(head + name, ooxml_entry, sizeof(ooxml_entry) - 1) == 0;
+}
+
+const char *content_class_name(enum content_class content) {
+  return content < CONTENT_CLASS_COUNT ? content_class_names[content]
+                                       : "unknown";
+}
+
+/*
+ * The class of a payload of size bytes from its first head_length bytes.
+ * Only a payload held whole in head can be told text.
+ */
+enum content_class sniff_content(const char *head, size_t head_length,
+                                 size_t size) {
+  if (is_pdf(head, head_length)) return CONTENT_PDF;
+
+  for (const Magic &magic : magics) {
+    if (!has_prefix(head, head_length, magic.bytes, magic.length)) continue;
+    if (magic.content == CONTENT_EXECUTABLE &&
+        !is_executable(head, head_length))
+      break;
+    if (magic.content == CONTENT_ARCHIVE && is_ooxml(head, head_length))
+      return CONTENT_OOXML;
+    return magic.content;
+  }
+
+  if (head_length < size || !is_text(head, head_length))
+    return CONTENT_UNKNOWN;
+
+  for (const char *container : text_containers) {
+    if (has_prefix(head, head_length, container, strlen(container)))
+      return CONTENT_UNKNOWN;
+  }
+
+  return size <= VIRUS_SNIFF_TINY_SIZE ? CONTENT_TINY_TEXT : CONTENT_TEXT;
+}
+
+/*
+ * The ClamAV options of a scan with profile, narrowed to the parsers of the
+ * sniffed class when the profile sniffs. Never widens the profile.
+ */
+struct cl_scan_options scan_options(const Scan_profile *profile,
+                                    const char *head, size_t head_length,
+                                    size_t size) {
+  struct cl_scan_options options = profile->options;
+
+  if (profile->sniff)
+    options.parse &= content_parsers[sniff_content(head, head_length, size)];
+  return options;
+}
@@ -0,0 +1,198 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+#include <atomic>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*
+  Scan statistics
+
+  Every scan lands in the shard of the CPU it runs on, so concurrent scans
+  update different cache lines. Counters are relaxed atomics: a thread may
+  be migrated between picking its shard and updating it, which costs a
+  shared cache line now and then but never loses a count. Readers sum the
+  shards; a row may be slightly behind the scans running while it is read.
+*/
+
+struct Latency_cell {
+  std::atomic<unsigned long long> count{0};
+  std::atomic<unsigned long long> sum_us{0};
+  std::atomic<unsigned long long> max_us{0};
+  std::atomic<unsigned long long> bytes{0};
+  std::atomic<unsigned int> buckets[VIRUS_LATENCY_BUCKETS] = {};
+};
+
+struct alignas(64) Stats_shard {
+  std::atomic<unsigned long long> counters[STAT_COUNT] = {};
+  Latency_cell latency[SIZE_CLASS_COUNT][VERDICT_COUNT];
+};
+
+static Stats_shard stats_shards[VIRUS_STATS_SHARDS];
+
+size_t stats_shard_index() {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0) return cpu % VIRUS_STATS_SHARDS;
+#endif
+  return std::hash<std::thread::id>()(std::this_thread::get_id()) %
+         VIRUS_STATS_SHARDS;
+}
+
+const char *size_class_name(enum scan_size_class size_class) {
+  static const char *names[] = {"<4K", "<64K", "<1M", "<16M", ">=16M"};
+  return names[size_class];
+}
+
+const char *verdict_name(enum scan_verdict verdict) {
+  static const char *names[] = {"clean", "infected", "error", "aborted"};
+  return names[verdict];
+}
+
+static enum scan_size_class size_class_of(size_t bytes) {
+  if (bytes < 4 * 1024) return SIZE_CLASS_4K;
+  if (bytes < 64 * 1024) return SIZE_CLASS_64K;
+  if (bytes < 1024 * 1024) return SIZE_CLASS_1M;
+  if (bytes < 16 * 1024 * 1024) return SIZE_CLASS_16M;
+  return SIZE_CLASS_LARGE;
+}
+
+static enum scan_verdict verdict_of(int return_code) {
+  if (return_code == CL_CLEAN) return VERDICT_CLEAN;
+  if (return_code == CL_VIRUS) return VERDICT_INFECTED;
+  if (return_code == CL_ETIMEOUT || return_code == CL_BREAK)
+    return VERDICT_ABORTED;
+  return VERDICT_ERROR;
+}
+
+/*
+  Values below 2 * VIRUS_LATENCY_SUB_BUCKETS have a bucket each. Above, a
+  power of two is split in VIRUS_LATENCY_SUB_BUCKETS buckets, so a bucket is
+  never wider than 1/8th of its lower bound.
+*/
+static size_t latency_bucket(unsigned long long us) {
+  if (us < 2 * VIRUS_LATENCY_SUB_BUCKETS) return us;
+
+  int shift = 63 - __builtin_clzll(us) - VIRUS_LATENCY_SUB_BUCKET_BITS;
+  if (shift > VIRUS_LATENCY_MAX_SHIFT) return VIRUS_LATENCY_BUCKETS - 1;
+  return shift * VIRUS_LATENCY_SUB_BUCKETS + (us >> shift);
+}
+
+/* Highest value falling in a bucket */
+static unsigned long long latency_bucket_upper(size_t bucket) {
+  if (bucket < 2 * VIRUS_LATENCY_SUB_BUCKETS) return bucket;
+
+  size_t shift = bucket / VIRUS_LATENCY_SUB_BUCKETS - 1;
+  unsigned long long mantissa =
+      bucket % VIRUS_LATENCY_SUB_BUCKETS + VIRUS_LATENCY_SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void stats_add(enum stats_counter counter, unsigned long long value) {
+  stats_shards[stats_shard_index()].counters[counter].fetch_add(
+      value, std::memory_order_relaxed);
+}
+
+unsigned long long stats_get(enum stats_counter counter) {
+  unsigned long long total = 0;
+
+  for (const Stats_shard &shard : stats_shards)
+    total += shard.counters[counter].load(std::memory_order_relaxed);
+  return total;
+}
+
+void record_scan(size_t bytes, int return_code,
+                 unsigned long long elapsed_us) {
+  static const enum stats_counter verdict_counters[] = {
+      STAT_SCANS_CLEAN, STAT_SCANS_INFECTED, STAT_SCAN_ERRORS,
+      STAT_SCANS_ABORTED};
+  enum scan_verdict verdict = verdict_of(return_code);
+  Stats_shard &shard = stats_shards[stats_shard_index()];
+  Latency_cell &cell = shard.latency[size_class_of(bytes)][verdict];
+
+  shard.counters[STAT_SCANS].fetch_add(1, std::memory_order_relaxed);
+  shard.counters[STAT_BYTES_SCANNED].fetch_add(bytes,
+                                               std::memory_order_relaxed);
+  shard.counters[STAT_SCAN_TIME_US].fetch_add(elapsed_us,
+                                              std::memory_order_relaxed);
+  shard.counters[verdict_counters[verdict]].fetch_add(
+      1, std::memory_order_relaxed);
+
+  cell.count.fetch_add(1, std::memory_order_relaxed);
+  cell.sum_us.fetch_add(elapsed_us, std::memory_order_relaxed);
+  cell.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  cell.buckets[latency_bucket(elapsed_us)].fetch_add(
+      1, std::memory_order_relaxed);
+
+  unsigned long long max = cell.max_us.load(std::memory_order_relaxed);
+  while (elapsed_us > max &&
+         !cell.max_us.compare_exchange_weak(max, elapsed_us,
+                                            std::memory_order_relaxed))
+    ;
+}
+
+size_t latency_row_count() { return SIZE_CLASS_COUNT * VERDICT_COUNT; }
+
+bool latency_read(size_t index, Latency_row *row) {
+  if (index >= latency_row_count()) return false;
+
+  unsigned int buckets[VIRUS_LATENCY_BUCKETS] = {};
+  unsigned long long total = 0;
+
+  *row = Latency_row();
+  row->size_class = (enum scan_size_class)(index / VERDICT_COUNT);
+  row->verdict = (enum scan_verdict)(index % VERDICT_COUNT);
+
+  for (const Stats_shard &shard : stats_shards) {
+    const Latency_cell &cell = shard.latency[row->size_class][row->verdict];
+    row->count += cell.count.load(std::memory_order_relaxed);
+    row->sum_us += cell.sum_us.load(std::memory_order_relaxed);
+    row->bytes += cell.bytes.load(std::memory_order_relaxed);
+    row->max_us =
+        std::max(row->max_us, cell.max_us.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < VIRUS_LATENCY_BUCKETS; i++)
+      buckets[i] += cell.buckets[i].load(std::memory_order_relaxed);
+  }
+
+  for (size_t i = 0; i < VIRUS_LATENCY_BUCKETS; i++) total += buckets[i];
+  if (total == 0) return true;
+
+  /* Percentiles are reported as the upper bound of their bucket */
+  const unsigned long long ranks[] = {(total * 50 + 99) / 100,
+                                      (total * 95 + 99) / 100,
+                                      (total * 99 + 99) / 100};
+  unsigned long long *values[] = {&row->p50_us, &row->p95_us, &row->p99_us};
+  unsigned long long seen = 0;
+  size_t next = 0;
+
+  for (size_t i = 0; i < VIRUS_LATENCY_BUCKETS && next < 3; i++) {
+    seen += buckets[i];
+    while (next < 3 && seen >= ranks[next])
+      *values[next++] = std::min(latency_bucket_upper(i), row->max_us);
+  }
+
+  return true;
+}
@@ -0,0 +1,528 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+  Clean store
+
+  The verdict cache is lost when the server restarts, the clean store is not:
+  it keeps the SHA-256 of the payloads found clean in a file mapped in memory,
+  viruscan.clean_store_file. The file is a Store_header followed by a power of
+  two number of Store_slot, an open addressing table with linear probing
+  sized after viruscan.clean_store_size.
+
+  Every slot is tagged with the database tag of the engine that scanned the
+  payload (see Engine_generation::database_tag) and the header keeps the tag
+  of the current engine. reload_engine() only changes the header tag: the
+  slots of the previous databases become misses, and are dropped when the
+  table fills up and is compacted.
+
+  Slots are written in place, the checksum last: a slot whose checksum does
+  not match, torn by a crash, is an empty slot. Compaction and resizing write
+  a new file next to the store and rename() it over, the store is either the
+  old or the new file. They are run by a maintainer thread, never by a scan:
+  a scan finding the table full asks for a compaction and does not store its
+  verdict, and the lookups only wait for the entries to be copied, not for
+  the new file to reach the disk.
+*/
+
+#define VIRUS_STORE_MAGIC "VSCLEAN1"
+#define VIRUS_STORE_FORMAT 1
+/* Smaller tables are not worth a file */
+#define VIRUS_STORE_MIN_SLOTS 64
+/* Compact, then stop storing, when 3/4 of the slots are used */
+#define VIRUS_STORE_MAX_USED(capacity) ((capacity) / 4 * 3)
+
+char *clean_store_file = nullptr;
+unsigned long long clean_store_size = VIRUS_STORE_DEFAULT_SIZE;
+
+struct Store_header {
+  char magic[8];
+  uint32_t format;
+  uint32_t slot_size;
+  uint64_t capacity;
+  /* Database tag of the current engine, 0 before the first one */
+  uint64_t tag;
+  uint64_t reserved[4];
+};
+
+struct Store_slot {
+  unsigned char digest[VIRUS_CACHE_DIGEST_LENGTH];
+  uint64_t length;
+  uint64_t tag;
+  /* Index in scan_profiles[] */
+  uint32_t profile;
+  /* Written last, see slot_checksum() */
+  uint32_t check;
+};
+
+static_assert(sizeof(Store_header) == 64, "the store header is 64 bytes");
+static_assert(sizeof(Store_slot) == 56, "store slots are 56 bytes");
+
+struct Clean_store {
+  mysql_mutex_t lock;
+  int fd = -1;
+  size_t map_size = 0;
+  /* nullptr when the store is not open */
+  Store_header *header = nullptr;
+  Store_slot *slots = nullptr;
+  /* Valid slots, the stale ones included */
+  uint64_t used = 0;
+  /* Compaction freed nothing, wait for the next engine */
+  bool full = false;
+  /* Work for the maintainer, cleared once it is done */
+  bool compact = false;
+  bool resize = false;
+  bool stopping = false;
+  mysql_cond_t wake;
+  unsigned long long hits = 0;
+  unsigned long long misses = 0;
+};
+
+static Clean_store store;
+static std::atomic<bool> store_open(false);
+static std::thread store_maintainer;
+
+/* Never 0: a zeroed slot is empty */
+static uint32_t slot_checksum(const Store_slot &slot) {
+  uint32_t check = 2166136261U;
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&slot);
+
+  for (size_t i = 0; i < offsetof(Store_slot, check); i++) {
+    check ^= bytes[i];
+    check *= 16777619U;
+  }
+  return check != 0 ? check : 1;
+}
+
+static bool slot_valid(const Store_slot &slot) {
+  return slot.check != 0 && slot.check == slot_checksum(slot);
+}
+
+static uint32_t profile_index(const Cache_key &key) {
+  return (uint32_t)(key.profile - scan_profiles);
+}
+
+static void slot_write(Store_slot *slot, const Cache_key &key, uint64_t tag) {
+  slot->check = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(slot->digest, key.digest, sizeof(slot->digest));
+  slot->length = key.length;
+  slot->tag = tag;
+  slot->profile = profile_index(key);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->check = slot_checksum(*slot);
+}
+
+/* The slot holding the payload, or the empty slot ending its probe sequence */
+static Store_slot *store_probe(Store_slot *slots, uint64_t capacity,
+                               const unsigned char *digest, uint64_t length,
+                               uint32_t profile) {
+  uint64_t mask = capacity - 1;
+  uint64_t i;
+
+  /* The digest is already uniformly distributed */
+  memcpy(&i, digest, sizeof(i));
+  for (uint64_t probes = 0; probes < capacity; probes++, i++) {
+    Store_slot *slot = &slots[i & mask];
+    if (!slot_valid(*slot) ||
+        (slot->length == length && slot->profile == profile &&
+         memcmp(slot->digest, digest, sizeof(slot->digest)) == 0))
+      return slot;
+  }
+  return nullptr;
+}
+
+/* Largest table fitting in size bytes, 0 if too small */
+static uint64_t store_capacity(unsigned long long size) {
+  uint64_t slots, capacity = 1;
+
+  if (size < sizeof(Store_header)) return 0;
+  slots = (size - sizeof(Store_header)) / sizeof(Store_slot);
+  while (capacity * 2 <= slots) capacity *= 2;
+  return capacity >= VIRUS_STORE_MIN_SLOTS ? capacity : 0;
+}
+
+static size_t store_file_size(uint64_t capacity) {
+  return sizeof(Store_header) + capacity * sizeof(Store_slot);
+}
+
+static void store_log(enum loglevel level, const char *message,
+                      const char *path) {
+  char buf[1024];
+  snprintf(buf, sizeof(buf), "%s %s: %s", message, path, strerror(errno));
+  LogComponentErr(level, ER_LOG_PRINTF_MSG, buf);
+}
+
+/* Caller holds store.lock */
+static void store_unmap() {
+  if (store.header != nullptr) munmap(store.header, store.map_size);
+  if (store.fd >= 0) close(store.fd);
+  store.fd = -1;
+  store.map_size = 0;
+  store.header = nullptr;
+  store.slots = nullptr;
+  store.used = 0;
+  store_open.store(false);
+}
+
+/* Caller holds store.lock */
+static void store_close() {
+  if (store.header != nullptr) msync(store.header, store.map_size, MS_SYNC);
+  store_unmap();
+}
+
+/*
+ * Write a new store of capacity slots holding the entries of the current
+ * one tagged with tag, and rename it over the current one. The current store
+ * is kept when it fails. Only the copy of the entries holds store.lock, the
+ * scans go on while the new file is written out: what they insert meanwhile
+ * is not in the new store. Run by the maintainer, or before it starts.
+ */
+static bool store_rebuild(uint64_t capacity, uint64_t tag) {
+  std::string path = clean_store_file;
+  std::string temporary = path + ".tmp";
+  size_t size = store_file_size(capacity);
+  uint64_t used = 0;
+  void *map;
+
+  int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0640);
+  if (fd < 0) {
+    store_log(ERROR_LEVEL, "cannot create clean store", temporary.c_str());
+    return false;
+  }
+  if (ftruncate(fd, size) != 0 ||
+      (map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+    store_log(ERROR_LEVEL, "cannot size clean store", temporary.c_str());
+    close(fd);
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  Store_header *header = static_cast<Store_header *>(map);
+  Store_slot *slots = reinterpret_cast<Store_slot *>(header + 1);
+  memcpy(header->magic, VIRUS_STORE_MAGIC, sizeof(header->magic));
+  header->format = VIRUS_STORE_FORMAT;
+  header->slot_size = sizeof(Store_slot);
+  header->capacity = capacity;
+  header->tag = tag;
+
+  /* Stale entries are left behind, and what a smaller table can't hold */
+  mysql_mutex_lock(&store.lock);
+  for (uint64_t i = 0; store.header != nullptr && i < store.header->capacity &&
+                       used < VIRUS_STORE_MAX_USED(capacity);
+       i++) {
+    const Store_slot &slot = store.slots[i];
+    if (!slot_valid(slot) || slot.tag != tag) continue;
+    *store_probe(slots, capacity, slot.digest, slot.length, slot.profile) =
+        slot;
+    used++;
+  }
+  mysql_mutex_unlock(&store.lock);
+
+  /* The new store must be on disk before it replaces the old one */
+  if (msync(map, size, MS_SYNC) != 0 ||
+      rename(temporary.c_str(), path.c_str()) != 0) {
+    store_log(ERROR_LEVEL, "cannot write clean store", path.c_str());
+    munmap(map, size);
+    close(fd);
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  /* The old file is already unlinked, unmapped once the scans let it go */
+  mysql_mutex_lock(&store.lock);
+  Store_header *old_header = store.header;
+  size_t old_size = store.map_size;
+  int old_fd = store.fd;
+  /* An engine loaded while the file was written */
+  if (old_header != nullptr) header->tag = old_header->tag;
+  store.fd = fd;
+  store.map_size = size;
+  store.header = header;
+  store.slots = slots;
+  store.used = used;
+  store.full = false;
+  store_open.store(true);
+  mysql_mutex_unlock(&store.lock);
+
+  if (old_header != nullptr) munmap(old_header, old_size);
+  if (old_fd >= 0) close(old_fd);
+  return true;
+}
+
+/* Map the existing store, false if there is none or it is not valid */
+static bool store_map(const char *path) {
+  struct stat st;
+  void *map;
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+
+  if (fd < 0) return false;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Store_header) ||
+      (map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0)) == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  Store_header *header = static_cast<Store_header *>(map);
+  if (memcmp(header->magic, VIRUS_STORE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->format != VIRUS_STORE_FORMAT ||
+      header->slot_size != sizeof(Store_slot) || header->capacity == 0 ||
+      (header->capacity & (header->capacity - 1)) != 0 ||
+      store_file_size(header->capacity) != (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    close(fd);
+    return false;
+  }
+
+  uint64_t used = 0;
+  Store_slot *slots = reinterpret_cast<Store_slot *>(header + 1);
+  for (uint64_t i = 0; i < header->capacity; i++)
+    if (slot_valid(slots[i])) used++;
+
+  mysql_mutex_lock(&store.lock);
+  store.fd = fd;
+  store.map_size = st.st_size;
+  store.header = header;
+  store.slots = slots;
+  store.used = used;
+  store.full = false;
+  store_open.store(true);
+  mysql_mutex_unlock(&store.lock);
+  return true;
+}
+
+/* Opens the store, run by the maintainer or before it starts */
+static void store_load() {
+  char buf[1024];
+  uint64_t capacity = store_capacity(clean_store_size);
+
+  if (capacity == 0) {
+    snprintf(buf, sizeof(buf),
+             "viruscan.clean_store_size %llu is too small, the clean store is "
+             "disabled",
+             clean_store_size);
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    return;
+  }
+
+  if (!store_map(clean_store_file)) {
+    if (access(clean_store_file, F_OK) == 0) {
+      snprintf(buf, sizeof(buf), "clean store %s is not valid, recreating it",
+               clean_store_file);
+      LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG, buf);
+    }
+    store_rebuild(capacity, 0);
+  } else if (store.header->capacity != capacity) {
+    store_rebuild(capacity, store.header->tag);
+  }
+
+  if (store.header != nullptr) {
+    snprintf(buf, sizeof(buf), "clean store %s opened with %llu entries",
+             clean_store_file, (unsigned long long)store.used);
+    LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG, buf);
+  }
+}
+
+/* Drops the stale entries, gives up until the next engine if none */
+static void store_compact() {
+  mysql_mutex_lock(&store.lock);
+  if (store.header == nullptr) {
+    mysql_mutex_unlock(&store.lock);
+    return;
+  }
+  uint64_t capacity = store.header->capacity;
+  uint64_t tag = store.header->tag;
+  mysql_mutex_unlock(&store.lock);
+
+  bool rebuilt = store_rebuild(capacity, tag);
+
+  mysql_mutex_lock(&store.lock);
+  if (!rebuilt || store.used >= VIRUS_STORE_MAX_USED(capacity))
+    store.full = true;
+  mysql_mutex_unlock(&store.lock);
+}
+
+/* After a change of viruscan.clean_store_size */
+static void store_resize() {
+  if (store.header == nullptr) {
+    if (clean_store_file != nullptr && *clean_store_file != '\0')
+      store_load();
+    return;
+  }
+
+  uint64_t capacity = store_capacity(clean_store_size);
+  mysql_mutex_lock(&store.lock);
+  uint64_t current = store.header->capacity;
+  uint64_t tag = store.header->tag;
+  mysql_mutex_unlock(&store.lock);
+
+  if (capacity == 0)
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG,
+                    "viruscan.clean_store_size is too small, the clean "
+                    "store keeps its size");
+  else if (capacity != current)
+    store_rebuild(capacity, tag);
+}
+
+/*
+ * The only thread changing the mapping once the store is open: it reads
+ * store.header without the lock.
+ */
+static void store_maintain() {
+  mysql_mutex_lock(&store.lock);
+  for (;;) {
+    while (!store.stopping && !store.compact && !store.resize)
+      mysql_cond_wait(&store.wake, &store.lock);
+    if (store.stopping) break;
+
+    bool resize = store.resize;
+    mysql_mutex_unlock(&store.lock);
+    if (resize)
+      store_resize();
+    else
+      store_compact();
+    mysql_mutex_lock(&store.lock);
+
+    if (resize)
+      store.resize = false;
+    else
+      store.compact = false;
+  }
+  mysql_mutex_unlock(&store.lock);
+}
+
+void init_clean_store() {
+  mysql_mutex_init(key_mutex_virus_store, &store.lock, nullptr);
+  mysql_cond_init(key_cond_virus_store, &store.wake);
+  store.hits = 0;
+  store.misses = 0;
+  store.compact = store.resize = store.stopping = false;
+
+  if (clean_store_file != nullptr && *clean_store_file != '\0') store_load();
+
+  store_maintainer = std::thread(store_maintain);
+}
+
+void cleanup_clean_store() {
+  mysql_mutex_lock(&store.lock);
+  store.stopping = true;
+  mysql_cond_signal(&store.wake);
+  mysql_mutex_unlock(&store.lock);
+  /* A rebuild already started completes first */
+  if (store_maintainer.joinable()) store_maintainer.join();
+
+  mysql_mutex_lock(&store.lock);
+  store_close();
+  mysql_mutex_unlock(&store.lock);
+  mysql_cond_destroy(&store.wake);
+  mysql_mutex_destroy(&store.lock);
+}
+
+bool clean_store_enabled() { return store_open.load(std::memory_order_relaxed); }
+
+bool clean_store_lookup(const Cache_key &key, unsigned long long database_tag) {
+  bool found = false;
+
+  mysql_mutex_lock(&store.lock);
+  if (store.header != nullptr && store.header->tag == database_tag) {
+    Store_slot *slot =
+        store_probe(store.slots, store.header->capacity, key.digest,
+                    key.length, profile_index(key));
+    found = slot != nullptr && slot_valid(*slot) && slot->tag == database_tag;
+  }
+  if (found)
+    store.hits++;
+  else
+    store.misses++;
+  mysql_mutex_unlock(&store.lock);
+
+  return found;
+}
+
+void clean_store_insert(const Cache_key &key, unsigned long long database_tag) {
+  mysql_mutex_lock(&store.lock);
+  /* Scans still running on a previous engine are not stored */
+  if (store.header == nullptr || store.header->tag != database_tag ||
+      store.full) {
+    mysql_mutex_unlock(&store.lock);
+    return;
+  }
+
+  uint64_t capacity = store.header->capacity;
+  if (store.used >= VIRUS_STORE_MAX_USED(capacity)) {
+    /* Not worth the wait: the verdict is left out */
+    if (!store.compact) {
+      store.compact = true;
+      mysql_cond_signal(&store.wake);
+    }
+    mysql_mutex_unlock(&store.lock);
+    return;
+  }
+
+  Store_slot *slot = store_probe(store.slots, capacity, key.digest, key.length,
+                                 profile_index(key));
+  if (slot != nullptr) {
+    bool empty = !slot_valid(*slot);
+    if (empty || slot->tag != database_tag) slot_write(slot, key, database_tag);
+    if (empty) store.used++;
+  }
+  mysql_mutex_unlock(&store.lock);
+}
+
+void clean_store_set_tag(unsigned long long database_tag) {
+  mysql_mutex_lock(&store.lock);
+  if (store.header != nullptr && store.header->tag != database_tag) {
+    store.header->tag = database_tag;
+    store.full = false;
+  }
+  mysql_mutex_unlock(&store.lock);
+}
+
+/* Done by the maintainer, SET GLOBAL does not wait for it */
+void clean_store_resize() {
+  mysql_mutex_lock(&store.lock);
+  store.resize = true;
+  mysql_cond_signal(&store.wake);
+  mysql_mutex_unlock(&store.lock);
+}
+
+void clean_store_get_stats(unsigned long long *hits,
+                           unsigned long long *misses,
+                           unsigned long long *entries) {
+  mysql_mutex_lock(&store.lock);
+  *hits = store.hits;
+  *misses = store.misses;
+  *entries = store.used;
+  mysql_mutex_unlock(&store.lock);
+}
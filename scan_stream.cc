@@ -0,0 +1,258 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+  Streaming scans
+
+  virus_scan_stream_open() returns a stream id, virus_scan_stream_feed()
+  appends chunks to the stream and virus_scan_stream_close() scans what was
+  fed. A stream keeps at most viruscan.stream_buffer_size bytes in memory:
+  the chunk that would overflow its buffer moves it to an unlinked file of
+  the server tmpdir, and the scan reads that file through
+  cl_fmap_open_handle() like virus_scan_file() does. A value of any size is
+  scanned without being held in memory as a whole.
+
+  Streams live in viruscan.max_streams slots, stream ids encode their slot,
+  and belong to the account that opened them. A stream left open by a client
+  that went away is reclaimed by an open once it has not been fed for
+  viruscan.stream_idle_timeout seconds.
+*/
+
+unsigned long long stream_buffer_size = VIRUS_STREAM_DEFAULT_BUFFER_SIZE;
+unsigned int max_streams = VIRUS_STREAM_DEFAULT_MAX;
+unsigned int stream_idle_timeout = VIRUS_STREAM_DEFAULT_IDLE_TIMEOUT;
+
+struct Stream_slot {
+  /* 0 for a free slot */
+  unsigned long long id = 0;
+  /* A feed is writing to the stream, nothing else touches it meanwhile */
+  bool busy = false;
+  std::string account;
+  Scan_stream stream;
+  /* steady clock, in microseconds */
+  unsigned long long used_us = 0;
+};
+
+static mysql_mutex_t LOCK_streams;
+static std::vector<Stream_slot> streams;
+static unsigned long long next_stream = 1;
+static unsigned long long streams_spilled = 0;
+static unsigned long long streams_expired = 0;
+
+static unsigned long long now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void init_streams() {
+  mysql_mutex_init(key_mutex_virus_streams, &LOCK_streams, nullptr);
+  streams.assign(max_streams, Stream_slot());
+  next_stream = 1;
+  streams_spilled = 0;
+  streams_expired = 0;
+}
+
+static void stream_release(Stream_slot *slot) {
+  if (slot->stream.fd >= 0) close(slot->stream.fd);
+  /* Gives the buffer memory back */
+  *slot = Stream_slot();
+}
+
+void cleanup_streams() {
+  for (Stream_slot &slot : streams) stream_release(&slot);
+  streams.clear();
+  streams.shrink_to_fit();
+  mysql_mutex_destroy(&LOCK_streams);
+}
+
+/* The slot of a stream of the account, LOCK_streams held */
+static Stream_slot *find_stream(unsigned long long id, const char *account) {
+  if (streams.empty()) return nullptr;
+
+  Stream_slot &slot = streams[id % streams.size()];
+  if (slot.id != id || id == 0 || slot.account != account) return nullptr;
+  return &slot;
+}
+
+unsigned long long stream_open(const char *account,
+                               const Scan_profile *profile) {
+  unsigned long long now = now_us();
+  unsigned long long idle_us = stream_idle_timeout * 1000000ULL;
+  Stream_slot *free_slot = nullptr, *oldest = nullptr;
+  unsigned long long id = 0;
+
+  mysql_mutex_lock(&LOCK_streams);
+  for (Stream_slot &slot : streams) {
+    if (slot.id == 0) {
+      free_slot = &slot;
+      break;
+    }
+    if (!slot.busy && now - slot.used_us >= idle_us &&
+        (oldest == nullptr || slot.used_us < oldest->used_us))
+      oldest = &slot;
+  }
+  if (free_slot == nullptr && oldest != nullptr) {
+    stream_release(oldest);
+    streams_expired++;
+    free_slot = oldest;
+  }
+  if (free_slot != nullptr) {
+    id = next_stream++ * streams.size() + (free_slot - streams.data());
+    free_slot->id = id;
+    free_slot->account = account;
+    free_slot->stream.profile = profile;
+    free_slot->used_us = now;
+  }
+  mysql_mutex_unlock(&LOCK_streams);
+
+  return id;
+}
+
+static bool write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+/* Moves the buffer of a stream to a new file of the server tmpdir */
+static bool stream_spill(Scan_stream *stream) {
+  char tmpdir[PATH_MAX + 1];
+  char *value = tmpdir;
+  size_t length = sizeof(tmpdir) - 1;
+
+  if (mysql_service_component_sys_variable_register->get_variable(
+          "mysql_server", "tmpdir", (void **)&value, &length))
+    return false;
+
+  /* tmpdir may list several directories, the first one is used */
+  std::string path(value, length);
+  path = path.substr(0, path.find(':'));
+  if (path.empty()) path = P_tmpdir;
+  path += "/viruscan_stream_XXXXXX";
+
+  int fd = mkostemp(&path[0], O_CLOEXEC);
+  if (fd < 0) return false;
+  /* Nothing is left behind, whatever happens to the server */
+  unlink(path.c_str());
+
+  if (!write_all(fd, stream->buffer.data(), stream->buffer.size())) {
+    close(fd);
+    return false;
+  }
+  stream->fd = fd;
+  std::string().swap(stream->buffer);
+  return true;
+}
+
+enum stream_status stream_feed(unsigned long long id, const char *account,
+                               const char *data, size_t length,
+                               unsigned long long *total) {
+  Stream_slot *slot;
+
+  mysql_mutex_lock(&LOCK_streams);
+  slot = find_stream(id, account);
+  if (slot == nullptr || slot->busy) {
+    mysql_mutex_unlock(&LOCK_streams);
+    return slot == nullptr ? STREAM_UNKNOWN : STREAM_BUSY;
+  }
+  slot->busy = true;
+  mysql_mutex_unlock(&LOCK_streams);
+
+  /* The slot is ours until busy is cleared */
+  Scan_stream *stream = &slot->stream;
+  bool spilled = false, written = true;
+  if (stream->fd < 0 && stream->buffer.size() + length > stream_buffer_size)
+    written = spilled = stream_spill(stream);
+  if (written && stream->fd >= 0)
+    written = write_all(stream->fd, data, length);
+  else if (written) {
+    /* Grow by doubling, never past stream_buffer_size */
+    size_t needed = stream->buffer.size() + length;
+    if (needed > stream->buffer.capacity())
+      stream->buffer.reserve(std::min<size_t>(
+          stream_buffer_size,
+          std::max<size_t>(needed, 2 * stream->buffer.capacity())));
+    stream->buffer.append(data, length);
+  }
+  if (written) stream->size += length;
+
+  mysql_mutex_lock(&LOCK_streams);
+  if (spilled) streams_spilled++;
+  *total = stream->size;
+  /* A stream that lost data can't be scanned any more */
+  if (written) {
+    slot->busy = false;
+    slot->used_us = now_us();
+  } else
+    stream_release(slot);
+  mysql_mutex_unlock(&LOCK_streams);
+
+  return written ? STREAM_OK : STREAM_ERROR;
+}
+
+enum stream_status stream_detach(unsigned long long id, const char *account,
+                                 Scan_stream *stream) {
+  enum stream_status status = STREAM_OK;
+
+  mysql_mutex_lock(&LOCK_streams);
+  Stream_slot *slot = find_stream(id, account);
+  if (slot == nullptr)
+    status = STREAM_UNKNOWN;
+  else if (slot->busy)
+    status = STREAM_BUSY;
+  else {
+    *stream = std::move(slot->stream);
+    /* The caller owns the file now */
+    slot->stream.fd = -1;
+    stream_release(slot);
+  }
+  mysql_mutex_unlock(&LOCK_streams);
+
+  return status;
+}
+
+void stream_get_stats(unsigned long long *open, unsigned long long *spilled,
+                      unsigned long long *expired) {
+  mysql_mutex_lock(&LOCK_streams);
+  *open = 0;
+  for (const Stream_slot &slot : streams)
+    if (slot.id != 0) (*open)++;
+  *spilled = streams_spilled;
+  *expired = streams_expired;
+  mysql_mutex_unlock(&LOCK_streams);
+}
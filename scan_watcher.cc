@@ -0,0 +1,203 @@
+/* Copyright (c) 2017, 2022, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2.0,
+  as published by the Free Software Foundation.
+
+  This program is also distributed with certain software (including
+  but not limited to OpenSSL) that is licensed under separate terms,
+  as designated in a particular file or component or in included license
+  documentation.  The authors of MySQL hereby grant you an additional
+  permission to link the program and your derivative works with the
+  separately licensed software that they have included with MySQL.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License, version 2.0, for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+#include <components/viruscan/scan.h>
+
+#include <time.h>
+
+#include <atomic>
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/*
+  Signature directory watcher
+
+  freshclam replaces several database files in a row. The watcher waits for
+  the directory to stay quiet for viruscan.auto_reload_quiet_period
+  milliseconds, checks with cl_statchkdir() that the databases really
+  changed, and reloads the engine. Changes are always tracked, they only
+  trigger a reload when viruscan.auto_reload is ON.
+*/
+
+/* How often the watcher checks viruscan.database_directory, in milliseconds */
+#define VIRUS_WATCHER_POLL_INTERVAL 1000
+
+bool auto_reload = false;
+unsigned int auto_reload_quiet_period = VIRUS_AUTO_RELOAD_DEFAULT_QUIET_PERIOD;
+char signatures_changed_at[VIRUS_TIMESTAMP_LENGTH] = "";
+
+void format_timestamp(time_t timestamp, char *buf, size_t size) {
+  struct tm tm;
+
+  localtime_r(&timestamp, &tm);
+  strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+#ifdef __linux__
+
+static std::thread watcher;
+static std::atomic<bool> watcher_stopping{false};
+/* Wakes the watcher up when it has to stop */
+static int watcher_stop_fd = -1;
+
+static void watch_signatures(int inotify_fd) {
+  const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                        IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+  alignas(struct inotify_event) char events[4096];
+  std::string watched;
+  /* Warned about once, the watch is retried every poll interval */
+  std::string unwatchable;
+  int wd = -1;
+  bool pending = false;
+  std::chrono::steady_clock::time_point last_change;
+  char buf[1024];
+
+  while (!watcher_stopping) {
+    /* Follow viruscan.database_directory, from the locked copy */
+    std::string directory = current_database_settings().directory;
+    if (directory != watched) {
+      if (wd >= 0) inotify_rm_watch(inotify_fd, wd);
+      watched.clear();
+      wd = inotify_add_watch(inotify_fd, directory.c_str(), mask);
+      if (wd >= 0) {
+        watched = directory;
+        unwatchable.clear();
+      } else if (directory != unwatchable) {
+        snprintf(buf, 1024, "cannot watch signature directory %s: %s",
+                 directory.c_str(), strerror(errno));
+        LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG, buf);
+        unwatchable = directory;
+      }
+    }
+
+    int timeout = VIRUS_WATCHER_POLL_INTERVAL;
+    if (pending) {
+      long long elapsed =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - last_change)
+              .count();
+      timeout = (int)std::max(
+          0LL, std::min<long long>(auto_reload_quiet_period - elapsed,
+                                   VIRUS_WATCHER_POLL_INTERVAL));
+    }
+
+    struct pollfd fds[2] = {{inotify_fd, POLLIN, 0},
+                            {watcher_stop_fd, POLLIN, 0}};
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+    if (fds[1].revents & POLLIN) break;
+
+    if (fds[0].revents & POLLIN) {
+      ssize_t length;
+      while ((length = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + length;) {
+          struct inotify_event *event = (struct inotify_event *)p;
+          /*
+            The directory itself went away, watch it again. inotify_rm_watch()
+            queues an IN_IGNORED for the previous directory, not this one.
+          */
+          if (event->wd == wd &&
+              (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) {
+            wd = -1;
+            watched.clear();
+          }
+          p += sizeof(struct inotify_event) + event->len;
+        }
+      }
+      pending = true;
+      last_change = std::chrono::steady_clock::now();
+      format_timestamp(time(nullptr), signatures_changed_at,
+                       sizeof(signatures_changed_at));
+    }
+
+    if (pending && std::chrono::steady_clock::now() - last_change >=
+                       std::chrono::milliseconds(auto_reload_quiet_period)) {
+      pending = false;
+      if (auto_reload && engine_signatures_changed()) {
+        LogComponentErr(INFORMATION_LEVEL, ER_LOG_PRINTF_MSG,
+                        "clamav signatures changed, reloading the engine");
+        reload_engine();
+      }
+    }
+  }
+
+  if (wd >= 0) inotify_rm_watch(inotify_fd, wd);
+}
+
+void start_signature_watcher() {
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG,
+                    "cannot watch the signature directory, automatic reload "
+                    "is disabled");
+    return;
+  }
+
+  watcher_stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (watcher_stop_fd < 0) {
+    close(inotify_fd);
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG,
+                    "cannot watch the signature directory, automatic reload "
+                    "is disabled");
+    return;
+  }
+
+  watcher_stopping = false;
+  watcher = std::thread([inotify_fd] {
+    watch_signatures(inotify_fd);
+    close(inotify_fd);
+  });
+}
+
+void stop_signature_watcher() {
+  if (watcher.joinable()) {
+    uint64_t one = 1;
+    watcher_stopping = true;
+    /* Without the wake up, the watcher notices within a poll interval */
+    if (write(watcher_stop_fd, &one, sizeof(one)) != sizeof(one))
+      LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG,
+                      "cannot wake the signature watcher up");
+    /* A reload already started completes first */
+    watcher.join();
+  }
+
+  if (watcher_stop_fd >= 0) close(watcher_stop_fd);
+  watcher_stop_fd = -1;
+}
+
+#else
+
+void start_signature_watcher() {
+  if (auto_reload)
+    LogComponentErr(WARNING_LEVEL, ER_LOG_PRINTF_MSG,
+                    "viruscan.auto_reload needs inotify, it is only "
+                    "available on Linux");
+}
+
+void stop_signature_watcher() {}
+
+#endif